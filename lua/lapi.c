@@ -470,6 +470,15 @@ LUA_API void *lua_touserdata (lua_State *L, int idx) {
 }
 
 
+LUA_API int lua_tovector (lua_State *L, int idx, float *x, float *y) {
+  const TValue *o = index2value(L, idx);
+  if (!ttisvector(o)) return 0;  /* not a vector */
+  *x = vecvalue(o)[0];
+  *y = vecvalue(o)[1];
+  return 1;
+}
+
+
 LUA_API lua_State *lua_tothread (lua_State *L, int idx) {
   const TValue *o = index2value(L, idx);
   return (!ttisthread(o)) ? NULL : thvalue(o);
@@ -651,6 +660,14 @@ LUA_API void lua_pushlightuserdata (lua_State *L, void *p) {
 }
 
 
+LUA_API void lua_pushvector (lua_State *L, float x, float y) {
+  lua_lock(L);
+  setvecvalue(s2v(L->top.p), x, y);
+  api_incr_top(L);
+  lua_unlock(L);
+}
+
+
 LUA_API int lua_pushthread (lua_State *L) {
   lua_lock(L);
   setthvalue(L, s2v(L->top.p), L);
@@ -797,6 +814,54 @@ LUA_API void lua_createtable (lua_State *L, unsigned narray, unsigned nrec) {
 }
 
 
+/*
+** Remove all entries of a table, keeping the space allocated for them.
+*/
+LUA_API void lua_cleartable (lua_State *L, int idx) {
+  TValue *o;
+  lua_lock(L);
+  o = index2value(L, idx);
+  api_check(L, ttistable(o), "table expected");
+  luaH_clear(hvalue(o));
+  lua_unlock(L);
+}
+
+
+/*
+** Release the space a table does not need for its current entries.
+*/
+LUA_API void lua_shrinktable (lua_State *L, int idx) {
+  TValue *o;
+  lua_lock(L);
+  o = index2value(L, idx);
+  api_check(L, ttistable(o), "table expected");
+  luaH_shrink(L, hvalue(o));
+  luaC_checkGC(L);
+  lua_unlock(L);
+}
+
+
+/*
+** Exchange the entries (but not the metatables) of two tables.
+*/
+LUA_API void lua_swaptables (lua_State *L, int idx1, int idx2) {
+  TValue *o1, *o2;
+  Table *t1, *t2;
+  lua_lock(L);
+  o1 = index2value(L, idx1);
+  o2 = index2value(L, idx2);
+  api_check(L, ttistable(o1) && ttistable(o2), "table expected");
+  t1 = hvalue(o1);
+  t2 = hvalue(o2);
+  luaH_swap(t1, t2);
+  if (isblack(t1))  /* may now refer to white objects */
+    luaC_barrierback_(L, obj2gco(t1));
+  if (isblack(t2))
+    luaC_barrierback_(L, obj2gco(t2));
+  lua_unlock(L);
+}
+
+
 LUA_API int lua_getmetatable (lua_State *L, int objindex) {
   const TValue *obj;
   Table *mt;
@@ -1340,6 +1405,41 @@ void lua_setwarnf (lua_State *L, lua_WarnFunction f, void *ud) {
 }
 
 
+void lua_setgchook (lua_State *L, lua_GCHook f) {
+  lua_lock(L);
+  G(L)->gchook = f;
+  lua_unlock(L);
+}
+
+
+/*
+** Set the table of host constants ('nil' turns folding off). With
+** 'all', every chunk compiled afterwards folds them; otherwise only
+** chunks loaded with a 'K' in their mode do. Assigning to a host
+** constant in a chunk that folds them is a compile error.
+*/
+void lua_setconstants (lua_State *L, int idx, int all) {
+  TValue *o;
+  lua_lock(L);
+  o = index2value(L, idx);
+  api_check(L, ttisnil(o) || ttistable(o), "table expected");
+  G(L)->hostk = ttistable(o) ? hvalue(o) : NULL;
+  G(L)->hostkall = cast_byte(all != 0);
+  lua_unlock(L);
+}
+
+
+/*
+** Turn the optimizer on or off for all chunks compiled afterwards.
+** (Chunks loaded with an 'O' in their mode are optimized anyway.)
+*/
+void lua_setoptimize (lua_State *L, int on) {
+  lua_lock(L);
+  G(L)->optimize = cast_byte(on != 0);
+  lua_unlock(L);
+}
+
+
 void lua_warning (lua_State *L, const char *msg, int tocont) {
   lua_lock(L);
   luaE_warning(L, msg, tocont);
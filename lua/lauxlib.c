@@ -429,6 +429,13 @@ LUALIB_API lua_Number luaL_optnumber (lua_State *L, int arg, lua_Number def) {
 }
 
 
+LUALIB_API void luaL_checkvector (lua_State *L, int arg,
+                                  float *x, float *y) {
+  if (l_unlikely(!lua_tovector(L, arg, x, y)))
+    tag_error(L, arg, LUA_TVECTOR);
+}
+
+
 static void interror (lua_State *L, int arg) {
   if (lua_isnumber(L, arg))
     luaL_argerror(L, arg, "number has no integer representation");
@@ -934,6 +941,15 @@ LUALIB_API const char *luaL_tolstring (lua_State *L, int idx, size_t *len) {
       case LUA_TNIL:
         lua_pushliteral(L, "nil");
         break;
+      case LUA_TVECTOR: {  /* components at float precision */
+        float x = 0, y = 0;
+        char bx[32], by[32];
+        lua_tovector(L, idx, &x, &y);
+        l_sprintf(bx, sizeof(bx), "%.7g", (double)x);
+        l_sprintf(by, sizeof(by), "%.7g", (double)y);
+        lua_pushfstring(L, "vector(%s, %s)", bx, by);
+        break;
+      }
       default: {
         int tt = luaL_getmetafield(L, idx, "__name");  /* try name */
         const char *kind = (tt == LUA_TSTRING) ? lua_tostring(L, -1) :
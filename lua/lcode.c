@@ -14,6 +14,7 @@
 #include <limits.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "lua.h"
 
@@ -77,6 +78,15 @@ static TValue *const2val (FuncState *fs, const expdesc *e) {
 }
 
 
+/*
+** Get the value of a global folded to a host constant
+*/
+static void hostk2val (FuncState *fs, const expdesc *e, TValue *v) {
+  lua_assert(e->k == VHOSTK);
+  luaH_getstr(fs->ls->hostk, e->u.strval, v);
+}
+
+
 /*
 ** If expression is a constant, fills 'v' with its value
 ** and returns 1. Otherwise, returns 0.
@@ -102,6 +112,10 @@ int luaK_exp2const (FuncState *fs, const expdesc *e, TValue *v) {
       setobj(fs->ls->L, v, const2val(fs, e));
       return 1;
     }
+    case VHOSTK: {
+      hostk2val(fs, e, v);
+      return 1;
+    }
     default: return tonumeral(e, v);
   }
 }
@@ -775,6 +789,12 @@ void luaK_dischargevars (FuncState *fs, expdesc *e) {
       const2exp(const2val(fs, e), e);
       break;
     }
+    case VHOSTK: {
+      TValue k;
+      hostk2val(fs, e, &k);
+      const2exp(&k, e);
+      break;
+    }
     case VLOCAL: {  /* already in a register */
       int temp = e->u.var.ridx;
       e->u.info = temp;  /* (can't do a direct assignment; values overlap) */
@@ -1872,3 +1892,1152 @@ void luaK_finish (FuncState *fs) {
     }
   }
 }
+
+
+/*
+** {======================================================
+** Optimizer
+** An optional pass over the finished code of a function. It propagates
+** constants and copies between registers along the control flow, folds
+** the operations and tests that become constant, threads jumps, and
+** removes unreachable code and stores to registers never read again.
+** Debug information stays consistent, except that local variables can
+** show stale values where stores to them were removed.
+** =======================================================
+*/
+
+/* limit for the per-block register states of a function */
+#define MAXOPTSTATES	(1 << 18)
+
+/* maximum number of rounds over a function */
+#define MAXOPTROUNDS	4
+
+/* abstract values of registers */
+#define RV_UNDEF	0	/* block not reached yet */
+#define RV_CONST	1	/* holds constant 'k' */
+#define RV_COPY		2	/* holds the same value as register 'reg' */
+#define RV_ANY		3	/* unknown */
+
+typedef struct RegVal {
+  lu_byte kind;
+  lu_byte reg;
+  TValue k;
+} RegVal;
+
+
+/* instruction flags */
+#define OF_LEADER	1	/* starts a basic block */
+#define OF_DEAD		2	/* to be removed */
+#define OF_REACHED	4	/* reachable from the entry */
+
+
+typedef struct OptState {
+  FuncState *fs;
+  Instruction *code;
+  int n;  /* number of instructions */
+  int nr;  /* number of registers */
+  int nb;  /* number of basic blocks */
+  int nanchors;  /* scratch blocks anchored on the stack */
+  lu_byte *flags;  /* flags of each instruction */
+  lu_byte *pinned;  /* registers captured by closures or to be closed */
+  int *bstart;  /* first instruction of each block, plus 'n' */
+  int *bof;  /* block of each instruction */
+  int *work;  /* worklist */
+  lu_byte *inwork;  /* whether a block is in the worklist */
+} OptState;
+
+
+/*
+** Allocate a zeroed scratch block, anchored on the stack so that an
+** error in the middle of the pass does not leak it.
+*/
+static void *optalloc (OptState *os, size_t size) {
+  lua_State *L = os->fs->ls->L;
+  Udata *u = luaS_newudata(L, size, 0);
+  setuvalue(L, s2v(L->top.p), u);
+  luaD_inctop(L);
+  os->nanchors++;
+  memset(getudatamem(u), 0, size);
+  return getudatamem(u);
+}
+
+
+static void optinit (OptState *os, FuncState *fs) {
+  Proto *f = fs->f;
+  int i, j;
+  os->fs = fs;
+  os->code = f->code;
+  os->n = fs->pc;
+  os->nr = f->maxstacksize;
+  os->nb = 0;
+  os->nanchors = 0;
+  os->flags = optalloc(os, os->n + 1);
+  os->pinned = optalloc(os, os->nr);
+  os->bstart = optalloc(os, (os->n + 1) * sizeof(int));
+  os->bof = optalloc(os, (os->n + 1) * sizeof(int));
+  os->work = optalloc(os, os->n * sizeof(int));
+  os->inwork = optalloc(os, os->n);
+  for (i = 0; i < fs->np; i++) {  /* registers captured by closures */
+    Proto *p = f->p[i];
+    for (j = 0; j < p->sizeupvalues; j++)
+      if (p->upvalues[j].instack)
+        os->pinned[p->upvalues[j].idx] = 1;
+  }
+  for (i = 0; i < os->n; i++) {  /* registers to be closed */
+    Instruction ins = os->code[i];
+    if (GET_OPCODE(ins) == OP_TBC)
+      os->pinned[GETARG_A(ins)] = 1;
+    else if (GET_OPCODE(ins) == OP_TFORPREP) {
+      for (j = 0; j < 4; j++)
+        os->pinned[GETARG_A(ins) + j] = 1;
+    }
+  }
+}
+
+
+static void optkill (OptState *os, int pc) {
+  os->flags[pc] |= OF_DEAD;
+}
+
+
+/*
+** Whether instruction 'pc' is the one skipped by an OP_LFALSESKIP,
+** which must then stay where it is.
+*/
+static int optskipped (OptState *os, int pc) {
+  return (pc > 0 && GET_OPCODE(os->code[pc - 1]) == OP_LFALSESKIP &&
+          !(os->flags[pc - 1] & OF_DEAD));
+}
+
+
+/*
+** Put the possible successors of instruction 'pc' into 's' and return
+** how many there are. An arithmetic instruction that succeeds skips its
+** OP_MMBIN*, but that one just falls through, so it is not a branch.
+** (OP_TAILCALL may return right away, but it is not worth breaking the
+** OP_RETURN that follows it.)
+*/
+static int optsuccs (OptState *os, int pc, int *s) {
+  Instruction i = os->code[pc];
+  if (os->flags[pc] & OF_DEAD) {
+    s[0] = pc + 1;
+    return 1;
+  }
+  switch (GET_OPCODE(i)) {
+    case OP_JMP: s[0] = pc + 1 + GETARG_sJ(i); return 1;
+    case OP_LFALSESKIP: s[0] = pc + 2; return 1;
+    case OP_FORPREP: s[0] = pc + 1; s[1] = pc + GETARG_Bx(i) + 2; return 2;
+    case OP_FORLOOP: case OP_TFORLOOP:
+      s[0] = pc + 1; s[1] = pc + 1 - GETARG_Bx(i); return 2;
+    case OP_TFORPREP: s[0] = pc + 1 + GETARG_Bx(i); return 1;
+    case OP_RETURN: case OP_RETURN0: case OP_RETURN1: return 0;
+    default: {
+      if (testTMode(GET_OPCODE(i))) {  /* skips the following jump? */
+        s[0] = pc + 1; s[1] = pc + 2; return 2;
+      }
+      s[0] = pc + 1; return 1;
+    }
+  }
+}
+
+
+/*
+** Split the code into basic blocks.
+*/
+static void optblocks (OptState *os) {
+  int pc, s[2];
+  os->flags[0] |= OF_LEADER;
+  for (pc = 0; pc < os->n; pc++) {
+    int ns = optsuccs(os, pc, s);
+    if (!(ns == 1 && s[0] == pc + 1)) {  /* not a plain fall through? */
+      int j;
+      for (j = 0; j < ns; j++)
+        os->flags[s[j]] |= OF_LEADER;
+      os->flags[pc + 1] |= OF_LEADER;
+    }
+  }
+  os->nb = 0;
+  for (pc = 0; pc < os->n; pc++) {
+    if (os->flags[pc] & OF_LEADER)
+      os->bstart[os->nb++] = pc;
+    os->bof[pc] = os->nb - 1;
+  }
+  os->bstart[os->nb] = os->n;
+}
+
+
+/*
+** Mark as dead all instructions not reachable from the entry. An
+** OP_FORLOOP is kept as long as its OP_FORPREP is, even if the body
+** never gets to it, because the OP_FORPREP jump is relative to it.
+*/
+static int optunreachable (OptState *os) {
+  int pc, sp = 0, changed = 0;
+  os->work[sp++] = 0;
+  os->flags[0] |= OF_REACHED;
+  while (sp > 0) {
+    int s[3];
+    int j, ns;
+    pc = os->work[--sp];
+    ns = optsuccs(os, pc, s);
+    if (GET_OPCODE(os->code[pc]) == OP_FORPREP && !(os->flags[pc] & OF_DEAD))
+      s[ns++] = pc + GETARG_Bx(os->code[pc]) + 1;  /* its OP_FORLOOP */
+    for (j = 0; j < ns; j++) {
+      if (!(os->flags[s[j]] & OF_REACHED)) {
+        os->flags[s[j]] |= OF_REACHED;
+        os->work[sp++] = s[j];
+      }
+    }
+  }
+  for (pc = 0; pc < os->n; pc++) {
+    if (!(os->flags[pc] & (OF_REACHED | OF_DEAD)) && !optskipped(os, pc)) {
+      optkill(os, pc);
+      changed = 1;
+    }
+  }
+  return changed;
+}
+
+
+/*
+** Remove the dead instructions, fixing jumps, line information, and
+** the ranges of local variables.
+*/
+static void optcompact (OptState *os) {
+  FuncState *fs = os->fs;
+  Proto *f = fs->f;
+  Instruction *code = os->code;
+  int *newpc = os->bof;
+  int *lines = os->bstart;
+  int pc, np = 0, nabs = 0;
+  int line = f->linedefined;
+  for (pc = 0; pc < os->n; pc++) {  /* decode line of each instruction */
+    if (f->lineinfo[pc] == ABSLINEINFO) {
+      lua_assert(f->abslineinfo[nabs].pc == pc);
+      line = f->abslineinfo[nabs++].line;
+    }
+    else
+      line += f->lineinfo[pc];
+    lines[pc] = line;
+    newpc[pc] = np;
+    if (!(os->flags[pc] & OF_DEAD))
+      np++;
+  }
+  newpc[os->n] = np;
+  if (np == os->n)
+    return;  /* nothing to remove */
+  fs->previousline = f->linedefined;
+  fs->iwthabs = 0;
+  fs->nabslineinfo = 0;
+  for (pc = 0; pc < os->n; pc++) {
+    Instruction *ip = &code[pc];
+    if (os->flags[pc] & OF_DEAD)
+      continue;
+    switch (GET_OPCODE(*ip)) {
+      case OP_JMP: {
+        SETARG_sJ(*ip, newpc[pc + 1 + GETARG_sJ(*ip)] - newpc[pc] - 1);
+        break;
+      }
+      case OP_FORPREP: {  /* jumps past its OP_FORLOOP */
+        int loop = pc + GETARG_Bx(*ip) + 1;
+        SETARG_Bx(*ip, newpc[loop] - newpc[pc] - 1);
+        break;
+      }
+      case OP_TFORPREP: {
+        int target = pc + 1 + GETARG_Bx(*ip);
+        SETARG_Bx(*ip, newpc[target] - newpc[pc] - 1);
+        break;
+      }
+      case OP_FORLOOP: case OP_TFORLOOP: {
+        int target = pc + 1 - GETARG_Bx(*ip);
+        SETARG_Bx(*ip, newpc[pc] + 1 - newpc[target]);
+        break;
+      }
+      default: break;
+    }
+    code[newpc[pc]] = *ip;
+    fs->pc = newpc[pc] + 1;
+    savelineinfo(fs, f, lines[pc]);
+  }
+  fs->pc = np;
+  for (pc = 0; pc < fs->ndebugvars; pc++) {
+    LocVar *var = &f->locvars[pc];
+    var->startpc = newpc[var->startpc];
+    var->endpc = newpc[var->endpc];
+  }
+}
+
+
+/*
+** {------------------------------------------------------
+** Constant and copy propagation
+** -------------------------------------------------------
+*/
+
+static int optsameconst (const TValue *v1, const TValue *v2) {
+  return (ttypetag(v1) == ttypetag(v2) && luaV_rawequalobj(v1, v2));
+}
+
+
+/*
+** Whether registers 'a' and 'b' are known to hold the same value.
+*/
+static int optsameval (OptState *os, const RegVal *st, int a, int b) {
+  const RegVal *va = &st[a];
+  const RegVal *vb = &st[b];
+  if (a == b)
+    return 1;
+  else if (os->pinned[a] || os->pinned[b])
+    return 0;
+  else if ((va->kind == RV_COPY && va->reg == b) ||
+           (vb->kind == RV_COPY && vb->reg == a))
+    return 1;
+  else if (va->kind == RV_COPY && vb->kind == RV_COPY)
+    return (va->reg == vb->reg);
+  else if (va->kind == RV_CONST && vb->kind == RV_CONST)
+    return optsameconst(&va->k, &vb->k);
+  else
+    return 0;
+}
+
+
+/* register 'r' changes: registers copied from it are unknown now */
+static void optforget (OptState *os, RegVal *st, int r) {
+  int x;
+  for (x = 0; x < os->nr; x++)
+    if (st[x].kind == RV_COPY && st[x].reg == r)
+      st[x].kind = RV_ANY;
+}
+
+
+static void optsetany (OptState *os, RegVal *st, int r) {
+  if (r < os->nr) {
+    optforget(os, st, r);
+    st[r].kind = RV_ANY;
+  }
+}
+
+
+static void optsetconst (OptState *os, RegVal *st, int r, const TValue *v) {
+  optforget(os, st, r);
+  if (os->pinned[r])
+    st[r].kind = RV_ANY;
+  else {
+    st[r].kind = RV_CONST;
+    setobj(os->fs->ls->L, &st[r].k, v);
+  }
+}
+
+
+static void optsetcopy (OptState *os, RegVal *st, int r, int src) {
+  RegVal v = st[src];
+  if (optsameval(os, st, r, src))
+    return;  /* 'r' already holds that value */
+  optforget(os, st, r);
+  if (os->pinned[r] || os->pinned[src])
+    st[r].kind = RV_ANY;  /* a closure can change them at any call */
+  else if (v.kind == RV_CONST || v.kind == RV_COPY)
+    st[r] = v;
+  else {
+    st[r].kind = RV_COPY;
+    st[r].reg = cast_byte(src);
+  }
+}
+
+
+/* all registers from 'from' on are unknown */
+static void optkillfrom (OptState *os, RegVal *st, int from) {
+  int x;
+  for (x = 0; x < os->nr; x++) {
+    if (x >= from || (st[x].kind == RV_COPY && st[x].reg >= from))
+      st[x].kind = RV_ANY;
+  }
+}
+
+
+/*
+** Update the register state 'st' over instruction 'pc'.
+*/
+static void opttransfer (OptState *os, RegVal *st, int pc) {
+  Instruction i = os->code[pc];
+  Proto *f = os->fs->f;
+  int a = GETARG_A(i);
+  TValue v;
+  int x;
+  if (os->flags[pc] & OF_DEAD)
+    return;
+  switch (GET_OPCODE(i)) {
+    case OP_MOVE: optsetcopy(os, st, a, GETARG_B(i)); break;
+    case OP_LOADI: setivalue(&v, GETARG_sBx(i)); optsetconst(os, st, a, &v); break;
+    case OP_LOADF: {
+      setfltvalue(&v, cast_num(GETARG_sBx(i)));
+      optsetconst(os, st, a, &v);
+      break;
+    }
+    case OP_LOADK: optsetconst(os, st, a, &f->k[GETARG_Bx(i)]); break;
+    case OP_LOADKX: {
+      optsetconst(os, st, a, &f->k[GETARG_Ax(os->code[pc + 1])]);
+      break;
+    }
+    case OP_LOADFALSE: case OP_LFALSESKIP: {
+      setbfvalue(&v);
+      optsetconst(os, st, a, &v);
+      break;
+    }
+    case OP_LOADTRUE: setbtvalue(&v); optsetconst(os, st, a, &v); break;
+    case OP_LOADNIL: {
+      setnilvalue(&v);
+      for (x = a; x <= a + GETARG_B(i); x++)
+        optsetconst(os, st, x, &v);
+      break;
+    }
+    case OP_GETUPVAL: case OP_GETTABUP: case OP_GETTABLE: case OP_GETI:
+    case OP_GETFIELD: case OP_NEWTABLE: case OP_ADDI: case OP_ADDK:
+    case OP_SUBK: case OP_MULK: case OP_MODK: case OP_POWK: case OP_DIVK:
+    case OP_IDIVK: case OP_BANDK: case OP_BORK: case OP_BXORK: case OP_SHRI:
+    case OP_SHLI: case OP_ADD: case OP_SUB: case OP_MUL: case OP_MOD:
+    case OP_POW: case OP_DIV: case OP_IDIV: case OP_BAND: case OP_BOR:
+    case OP_BXOR: case OP_SHL: case OP_SHR: case OP_UNM: case OP_BNOT:
+    case OP_NOT: case OP_LEN: case OP_CLOSURE: case OP_TESTSET: {
+      optsetany(os, st, a);
+      break;
+    }
+    case OP_SELF: optsetany(os, st, a); optsetany(os, st, a + 1); break;
+    case OP_CONCAT: {
+      for (x = a; x < a + GETARG_B(i); x++)
+        optsetany(os, st, x);
+      break;
+    }
+    case OP_FORPREP: case OP_FORLOOP: {
+      for (x = a; x <= a + 2; x++)
+        optsetany(os, st, x);
+      break;
+    }
+    case OP_TFORPREP: {
+      for (x = a; x <= a + 3; x++)
+        optsetany(os, st, x);
+      break;
+    }
+    case OP_CALL: case OP_VARARG: optkillfrom(os, st, a); break;
+    case OP_TFORCALL: optkillfrom(os, st, a + 3); break;
+    case OP_MMBIN: case OP_MMBINI: case OP_MMBINK: case OP_SETUPVAL:
+    case OP_SETTABUP: case OP_SETTABLE: case OP_SETI: case OP_SETFIELD:
+    case OP_EQ: case OP_LT: case OP_LE: case OP_EQK: case OP_EQI:
+    case OP_LTI: case OP_LEI: case OP_GTI: case OP_GEI: case OP_TEST:
+    case OP_JMP: case OP_CLOSE: case OP_TBC: case OP_RETURN:
+    case OP_RETURN0: case OP_RETURN1: case OP_TAILCALL: case OP_TFORLOOP:
+    case OP_SETLIST: case OP_EXTRAARG: {
+      break;  /* no registers changed */
+    }
+    default: optkillfrom(os, st, 0); break;
+  }
+}
+
+
+/* constant in register 'r', if known */
+static const TValue *optconst (const RegVal *st, int r) {
+  return (st[r].kind == RV_CONST) ? &st[r].k : NULL;
+}
+
+
+/* register known to hold the same value as register 'r' */
+static int optsource (const RegVal *st, int r) {
+  return (st[r].kind == RV_COPY) ? st[r].reg : r;
+}
+
+
+static int propA (Instruction *ip, const RegVal *st) {
+  int r = GETARG_A(*ip);
+  if (st[r].kind != RV_COPY) return 0;
+  SETARG_A(*ip, st[r].reg);
+  return 1;
+}
+
+
+static int propB (Instruction *ip, const RegVal *st) {
+  int r = GETARG_B(*ip);
+  if (st[r].kind != RV_COPY) return 0;
+  SETARG_B(*ip, st[r].reg);
+  return 1;
+}
+
+
+static int propC (Instruction *ip, const RegVal *st) {
+  int r = GETARG_C(*ip);
+  if (st[r].kind != RV_COPY) return 0;
+  SETARG_C(*ip, st[r].reg);
+  return 1;
+}
+
+
+/*
+** Build in 'i' an instruction loading constant 'v' into register 'a'.
+** Float zeros are left alone, as 'luaK_numberK' cannot tell -0.0 from
+** 0.0.
+*/
+static int loadconst (FuncState *fs, int a, const TValue *v, Instruction *i) {
+  int k;
+  switch (ttypetag(v)) {
+    case LUA_VNIL: *i = CREATE_ABCk(OP_LOADNIL, a, 0, 0, 0); return 1;
+    case LUA_VFALSE: *i = CREATE_ABCk(OP_LOADFALSE, a, 0, 0, 0); return 1;
+    case LUA_VTRUE: *i = CREATE_ABCk(OP_LOADTRUE, a, 0, 0, 0); return 1;
+    case LUA_VNUMINT: {
+      if (fitsBx(ivalue(v))) {
+        *i = CREATE_ABx(OP_LOADI, a, cast_uint(ivalue(v) + OFFSET_sBx));
+        return 1;
+      }
+      k = luaK_intK(fs, ivalue(v));
+      break;
+    }
+    case LUA_VNUMFLT: {
+      lua_Integer fi;
+      if (fltvalue(v) == 0)
+        return 0;
+      if (luaV_flttointeger(fltvalue(v), &fi, F2Ieq) && fitsBx(fi)) {
+        *i = CREATE_ABx(OP_LOADF, a, cast_uint(fi + OFFSET_sBx));
+        return 1;
+      }
+      k = luaK_numberK(fs, fltvalue(v));
+      break;
+    }
+    case LUA_VSHRSTR: case LUA_VLNGSTR: k = stringK(fs, tsvalue(v)); break;
+    default: return 0;
+  }
+  if (k > MAXARG_Bx)
+    return 0;
+  *i = CREATE_ABx(OP_LOADK, a, cast_uint(k));
+  return 1;
+}
+
+
+/*
+** Index of number 'v' in the constants, if it fits in a C operand;
+** -1 otherwise. 'intonly' accepts only integers.
+*/
+static int numk (FuncState *fs, const TValue *v, int intonly) {
+  int k;
+  if (ttisinteger(v))
+    k = luaK_intK(fs, ivalue(v));
+  else if (ttisfloat(v) && !intonly && fltvalue(v) != 0)
+    k = luaK_numberK(fs, fltvalue(v));
+  else
+    return -1;
+  return (k <= MAXARG_C) ? k : -1;
+}
+
+
+/*
+** Fold arithmetic operation 'op' over constants 'v1' and 'v2', with the
+** same restrictions as 'constfolding'.
+*/
+static int foldarith (FuncState *fs, int op, const TValue *v1,
+                                     const TValue *v2, TValue *res) {
+  TValue n1, n2;
+  if (!ttisnumber(v1) || !ttisnumber(v2))
+    return 0;
+  setobj(fs->ls->L, &n1, v1);
+  setobj(fs->ls->L, &n2, v2);
+  if (!validop(op, &n1, &n2) || !luaO_rawarith(fs->ls->L, op, &n1, &n2, res))
+    return 0;
+  if (ttisfloat(res)) {  /* folds neither NaN nor 0.0 */
+    lua_Number n = fltvalue(res);
+    if (luai_numisnan(n) || n == 0)
+      return 0;
+  }
+  return 1;
+}
+
+
+/*
+** Arithmetic over two registers, followed by its OP_MMBIN: fold it if
+** both operands are constant, or use the K form for a constant operand.
+*/
+static int optarith (OptState *os, const RegVal *st, int pc) {
+  FuncState *fs = os->fs;
+  Instruction *ip = &os->code[pc];
+  Instruction *mm = ip + 1;
+  OpCode op = GET_OPCODE(*ip);
+  int a = GETARG_A(*ip);
+  int b = optsource(st, GETARG_B(*ip));
+  int c = optsource(st, GETARG_C(*ip));
+  const TValue *v1 = optconst(st, b);
+  const TValue *v2 = optconst(st, c);
+  int bitwise = (op >= OP_BAND);
+  TValue res;
+  Instruction ni;
+  int k;
+  lua_assert(GET_OPCODE(*mm) == OP_MMBIN);
+  if (v1 && v2 &&
+      foldarith(fs, cast_int(op - OP_ADD) + LUA_OPADD, v1, v2, &res) &&
+      loadconst(fs, a, &res, &ni)) {
+    *ip = ni;
+    optkill(os, pc + 1);
+    return 1;
+  }
+  if (op <= OP_BXOR) {  /* has a K form? */
+    OpCode kop = cast(OpCode, (op - OP_ADD) + OP_ADDK);
+    if (v2 && (k = numk(fs, v2, bitwise)) >= 0) {
+      *ip = CREATE_ABCk(kop, a, b, k, 0);
+      *mm = CREATE_ABCk(OP_MMBINK, b, k, GETARG_C(*mm), 0);
+      return 1;
+    }
+    if (v1 && (op == OP_ADD || op == OP_MUL || bitwise) &&
+        (k = numk(fs, v1, bitwise)) >= 0) {  /* commutative */
+      *ip = CREATE_ABCk(kop, a, c, k, 0);
+      *mm = CREATE_ABCk(OP_MMBINK, c, k, GETARG_C(*mm), 1);
+      return 1;
+    }
+  }
+  if (b == GETARG_B(*ip) && c == GETARG_C(*ip))
+    return 0;
+  SETARG_B(*ip, b); SETARG_C(*ip, c);
+  SETARG_A(*mm, b); SETARG_B(*mm, c);
+  return 1;
+}
+
+
+/*
+** Arithmetic over a register and an immediate or K operand, followed
+** by its OP_MMBINI/OP_MMBINK.
+*/
+static int optarithk (OptState *os, const RegVal *st, int pc) {
+  FuncState *fs = os->fs;
+  Instruction *ip = &os->code[pc];
+  OpCode op = GET_OPCODE(*ip);
+  int b = optsource(st, GETARG_B(*ip));
+  const TValue *v1 = optconst(st, b);
+  if (v1) {
+    TValue imm, res;
+    const TValue *v2 = &imm;
+    Instruction ni;
+    int aop;
+    setivalue(&imm, GETARG_sC(*ip));
+    switch (op) {
+      case OP_ADDI: aop = LUA_OPADD; break;
+      case OP_SHRI: aop = LUA_OPSHR; break;
+      case OP_SHLI: v2 = v1; v1 = &imm; aop = LUA_OPSHL; break;
+      default: {
+        v2 = &fs->f->k[GETARG_C(*ip)];
+        aop = cast_int(op - OP_ADDK) + LUA_OPADD;
+        break;
+      }
+    }
+    if (foldarith(fs, aop, v1, v2, &res) &&
+        loadconst(fs, GETARG_A(*ip), &res, &ni)) {
+      *ip = ni;
+      optkill(os, pc + 1);
+      return 1;
+    }
+  }
+  if (b == GETARG_B(*ip))
+    return 0;
+  SETARG_B(*ip, b);
+  SETARG_A(*(ip + 1), b);
+  return 1;
+}
+
+
+static int optunary (OptState *os, const RegVal *st, int pc) {
+  FuncState *fs = os->fs;
+  Instruction *ip = &os->code[pc];
+  OpCode op = GET_OPCODE(*ip);
+  const TValue *v = optconst(st, optsource(st, GETARG_B(*ip)));
+  TValue res;
+  Instruction ni;
+  if (v && op == OP_NOT) {
+    *ip = CREATE_ABCk(l_isfalse(v) ? OP_LOADTRUE : OP_LOADFALSE,
+                      GETARG_A(*ip), 0, 0, 0);
+    return 1;
+  }
+  if (v && (op == OP_UNM || op == OP_BNOT) &&
+      foldarith(fs, (op == OP_UNM) ? LUA_OPUNM : LUA_OPBNOT, v, v, &res) &&
+      loadconst(fs, GETARG_A(*ip), &res, &ni)) {
+    *ip = ni;
+    return 1;
+  }
+  return propB(ip, st);
+}
+
+
+/*
+** Outcome of test 'i' ('cond' as in the VM), if it is known.
+*/
+static int testvalue (FuncState *fs, Instruction i, const RegVal *st,
+                                     int *cond) {
+  lua_State *L = fs->ls->L;
+  const TValue *v = optconst(st, GETARG_A(i));
+  TValue imm;
+  switch (GET_OPCODE(i)) {
+    case OP_EQ: case OP_LT: case OP_LE: {
+      const TValue *v2 = optconst(st, GETARG_B(i));
+      if (!v || !v2)
+        return 0;
+      else if (GET_OPCODE(i) == OP_EQ)
+        *cond = luaV_rawequalobj(v, v2);
+      else if (ttisnumber(v) && ttisnumber(v2))
+        *cond = (GET_OPCODE(i) == OP_LT) ? luaV_lessthan(L, v, v2)
+                                        : luaV_lessequal(L, v, v2);
+      else
+        return 0;
+      return 1;
+    }
+    case OP_EQK: {
+      if (!v) return 0;
+      *cond = luaV_rawequalobj(v, &fs->f->k[GETARG_B(i)]);
+      return 1;
+    }
+    case OP_EQI: case OP_LTI: case OP_LEI: case OP_GTI: case OP_GEI: {
+      if (!v)
+        return 0;
+      setivalue(&imm, GETARG_sB(i));
+      if (GET_OPCODE(i) == OP_EQI)
+        *cond = luaV_rawequalobj(v, &imm);
+      else if (!ttisnumber(v))
+        return 0;  /* metamethod or error */
+      else switch (GET_OPCODE(i)) {
+        case OP_LTI: *cond = luaV_lessthan(L, v, &imm); break;
+        case OP_LEI: *cond = luaV_lessequal(L, v, &imm); break;
+        case OP_GTI: *cond = luaV_lessthan(L, &imm, v); break;
+        default: *cond = luaV_lessequal(L, &imm, v); break;
+      }
+      return 1;
+    }
+    case OP_TEST: {
+      if (!v) return 0;
+      *cond = !l_isfalse(v);
+      return 1;
+    }
+    case OP_TESTSET: {
+      v = optconst(st, GETARG_B(i));
+      if (!v) return 0;
+      *cond = !l_isfalse(v);
+      return 1;
+    }
+    default: return 0;
+  }
+}
+
+
+/*
+** A test and its jump: when the outcome is known, the jump becomes
+** unconditional or goes away.
+*/
+static int opttest (OptState *os, const RegVal *st, int pc) {
+  Instruction *ip = &os->code[pc];
+  OpCode op = GET_OPCODE(*ip);
+  int changed, cond;
+  lua_assert(GET_OPCODE(*(ip + 1)) == OP_JMP);
+  if (op == OP_EQ || op == OP_LT || op == OP_LE)
+    changed = propA(ip, st) | propB(ip, st);
+  else if (op == OP_TESTSET)
+    changed = propB(ip, st);
+  else
+    changed = propA(ip, st);
+  if (!testvalue(os->fs, *ip, st, &cond))
+    return changed;
+  if (cond == GETARG_k(*ip)) {  /* always jumps */
+    if (op == OP_TESTSET)  /* still does the assignment */
+      *ip = CREATE_ABCk(OP_MOVE, GETARG_A(*ip), GETARG_B(*ip), 0, 0);
+    else
+      optkill(os, pc);
+  }
+  else {  /* never jumps */
+    optkill(os, pc);
+    optkill(os, pc + 1);
+  }
+  return 1;
+}
+
+
+/*
+** Rewrite instruction 'pc' given the register state 'st' before it.
+*/
+static int optrewrite (OptState *os, const RegVal *st, int pc) {
+  Instruction *ip = &os->code[pc];
+  OpCode op = GET_OPCODE(*ip);
+  switch (op) {
+    case OP_MOVE: {
+      int a = GETARG_A(*ip), b = GETARG_B(*ip);
+      Instruction ni;
+      if (optsameval(os, st, a, b)) {
+        optkill(os, pc);
+        return 1;
+      }
+      else if (st[b].kind == RV_CONST &&
+               loadconst(os->fs, a, &st[b].k, &ni)) {
+        *ip = ni;
+        return 1;
+      }
+      return propB(ip, st);
+    }
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_MOD: case OP_POW:
+    case OP_DIV: case OP_IDIV: case OP_BAND: case OP_BOR: case OP_BXOR:
+    case OP_SHL: case OP_SHR:
+      return optarith(os, st, pc);
+    case OP_ADDI: case OP_ADDK: case OP_SUBK: case OP_MULK: case OP_MODK:
+    case OP_POWK: case OP_DIVK: case OP_IDIVK: case OP_BANDK: case OP_BORK:
+    case OP_BXORK: case OP_SHRI: case OP_SHLI:
+      return optarithk(os, st, pc);
+    case OP_UNM: case OP_BNOT: case OP_NOT:
+      return optunary(os, st, pc);
+    case OP_LEN: case OP_GETI: case OP_GETFIELD:
+      return propB(ip, st);
+    case OP_GETTABLE:
+      return propB(ip, st) | propC(ip, st);
+    case OP_SELF:
+      return propB(ip, st) | (!GETARG_k(*ip) ? propC(ip, st) : 0);
+    case OP_SETTABLE:
+      return propA(ip, st) | propB(ip, st) |
+             (!GETARG_k(*ip) ? propC(ip, st) : 0);
+    case OP_SETI: case OP_SETFIELD:
+      return propA(ip, st) | (!GETARG_k(*ip) ? propC(ip, st) : 0);
+    case OP_SETTABUP:
+      return (!GETARG_k(*ip) ? propC(ip, st) : 0);
+    case OP_SETUPVAL: case OP_RETURN1:
+      return propA(ip, st);
+    default:
+      if (testTMode(op))
+        return opttest(os, st, pc);
+      return 0;
+  }
+}
+
+
+/* merge state 'st' into the entry state of block 'b' */
+static int optmerge (OptState *os, RegVal *in, int b, const RegVal *st) {
+  RegVal *bin = &in[b * os->nr];
+  int r, changed = 0;
+  for (r = 0; r < os->nr; r++) {
+    if (bin[r].kind == RV_UNDEF) {
+      bin[r] = st[r];
+      changed = 1;
+    }
+    else if (bin[r].kind != RV_ANY &&
+             !(bin[r].kind == st[r].kind &&
+               ((st[r].kind == RV_COPY && bin[r].reg == st[r].reg) ||
+                (st[r].kind == RV_CONST && optsameconst(&bin[r].k, &st[r].k))))) {
+      bin[r].kind = RV_ANY;
+      changed = 1;
+    }
+  }
+  return changed;
+}
+
+
+static int optpropagate (OptState *os) {
+  RegVal *in, *st;
+  int b, pc, sp = 0, changed = 0;
+  optblocks(os);
+  if (cast_sizet(os->nb + 1) * os->nr > MAXOPTSTATES)
+    return 0;  /* too large */
+  in = optalloc(os, cast_sizet(os->nb + 1) * os->nr * sizeof(RegVal));
+  st = &in[os->nb * os->nr];  /* current state */
+  for (pc = 0; pc < os->nr; pc++)  /* nothing known at the entry */
+    in[pc].kind = RV_ANY;
+  os->work[sp++] = 0;
+  os->inwork[0] = 1;
+  while (sp > 0) {  /* propagate states to a fixpoint */
+    int s[2];
+    int j, ns;
+    b = os->work[--sp];
+    os->inwork[b] = 0;
+    memcpy(st, &in[b * os->nr], os->nr * sizeof(RegVal));
+    for (pc = os->bstart[b]; pc < os->bstart[b + 1]; pc++)
+      opttransfer(os, st, pc);
+    ns = optsuccs(os, os->bstart[b + 1] - 1, s);
+    for (j = 0; j < ns; j++) {
+      int sb = os->bof[s[j]];
+      if (optmerge(os, in, sb, st) && !os->inwork[sb]) {
+        os->inwork[sb] = 1;
+        os->work[sp++] = sb;
+      }
+    }
+  }
+  for (b = 0; b < os->nb; b++) {  /* rewrite each reached block */
+    if (in[b * os->nr].kind == RV_UNDEF)
+      continue;  /* unreachable; removed below */
+    memcpy(st, &in[b * os->nr], os->nr * sizeof(RegVal));
+    for (pc = os->bstart[b]; pc < os->bstart[b + 1]; pc++) {
+      if (!(os->flags[pc] & OF_DEAD))
+        changed |= optrewrite(os, st, pc);
+      opttransfer(os, st, pc);
+    }
+  }
+  return optunreachable(os) | changed;
+}
+
+/* }------------------------------------------------------ */
+
+
+/*
+** Thread jumps to jumps, remove jumps to the next instruction, and
+** replace unconditional jumps to a plain return by that return.
+*/
+static int optjumps (OptState *os) {
+  Instruction *code = os->code;
+  int pc, changed = 0;
+  for (pc = 0; pc < os->n; pc++) {
+    Instruction i = code[pc];
+    if (GET_OPCODE(i) == OP_JMP) {
+      int target = finaltarget(code, pc);
+      if (target != pc + 1 + GETARG_sJ(i)) {
+        fixjump(os->fs, pc, target);
+        changed = 1;
+      }
+      if ((pc > 0 && testTMode(GET_OPCODE(code[pc - 1]))) ||
+          optskipped(os, pc))
+        continue;  /* must stay a jump */
+      if (target == pc + 1) {
+        optkill(os, pc);
+        changed = 1;
+      }
+      else if (GET_OPCODE(code[target]) == OP_RETURN0 ||
+               GET_OPCODE(code[target]) == OP_RETURN1) {
+        code[pc] = code[target];
+        changed = 1;
+      }
+    }
+  }
+  return changed;
+}
+
+
+/*
+** {------------------------------------------------------
+** Dead store elimination
+** -------------------------------------------------------
+*/
+
+static void liveset (OptState *os, lu_byte *live, int from, int to) {
+  if (to >= os->nr) to = os->nr - 1;
+  for (; from <= to; from++)
+    live[from >> 3] |= cast_byte(1 << (from & 7));
+}
+
+
+static void liveclear (OptState *os, lu_byte *live, int from, int to) {
+  if (to >= os->nr) to = os->nr - 1;
+  for (; from <= to; from++)
+    live[from >> 3] &= cast_byte(~(1 << (from & 7)));
+}
+
+
+/*
+** Update the set of live registers 'live' backwards over instruction
+** 'i': registers it surely writes are dead before it, unless it also
+** reads them. Instructions not listed read every register.
+*/
+static void optliveness (OptState *os, Instruction i, lu_byte *live) {
+  int a = GETARG_A(i);  /* 'B' and 'C' only exist in iABC formats */
+  int all = os->nr - 1;
+  switch (GET_OPCODE(i)) {
+    case OP_MOVE: {
+      liveclear(os, live, a, a);
+      liveset(os, live, GETARG_B(i), GETARG_B(i));
+      break;
+    }
+    case OP_LOADI: case OP_LOADF: case OP_LOADK: case OP_LOADKX:
+    case OP_LOADFALSE: case OP_LFALSESKIP: case OP_LOADTRUE:
+    case OP_GETUPVAL: case OP_GETTABUP: case OP_NEWTABLE: case OP_CLOSURE: {
+      liveclear(os, live, a, a);
+      break;
+    }
+    case OP_LOADNIL: liveclear(os, live, a, a + GETARG_B(i)); break;
+    case OP_SETUPVAL: case OP_TBC: case OP_RETURN1: case OP_MMBINI:
+    case OP_MMBINK: case OP_EQK: case OP_EQI: case OP_LTI: case OP_LEI:
+    case OP_GTI: case OP_GEI: case OP_TEST: {
+      liveset(os, live, a, a);
+      break;
+    }
+    case OP_GETTABLE: {
+      liveclear(os, live, a, a);
+      liveset(os, live, GETARG_B(i), GETARG_B(i));
+      liveset(os, live, GETARG_C(i), GETARG_C(i));
+      break;
+    }
+    case OP_GETI: case OP_GETFIELD: case OP_ADDI: case OP_ADDK: case OP_SUBK:
+    case OP_MULK: case OP_MODK: case OP_POWK: case OP_DIVK: case OP_IDIVK:
+    case OP_BANDK: case OP_BORK: case OP_BXORK: case OP_SHRI: case OP_SHLI:
+    case OP_UNM: case OP_BNOT: case OP_NOT: case OP_LEN: {
+      liveclear(os, live, a, a);
+      liveset(os, live, GETARG_B(i), GETARG_B(i));
+      break;
+    }
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_MOD: case OP_POW:
+    case OP_DIV: case OP_IDIV: case OP_BAND: case OP_BOR: case OP_BXOR:
+    case OP_SHL: case OP_SHR: {
+      liveclear(os, live, a, a);
+      liveset(os, live, GETARG_B(i), GETARG_B(i));
+      liveset(os, live, GETARG_C(i), GETARG_C(i));
+      break;
+    }
+    case OP_SETTABUP: {
+      if (!GETARG_k(i)) liveset(os, live, GETARG_C(i), GETARG_C(i));
+      break;
+    }
+    case OP_SETTABLE: {
+      liveset(os, live, a, a);
+      liveset(os, live, GETARG_B(i), GETARG_B(i));
+      if (!GETARG_k(i)) liveset(os, live, GETARG_C(i), GETARG_C(i));
+      break;
+    }
+    case OP_SETI: case OP_SETFIELD: {
+      liveset(os, live, a, a);
+      if (!GETARG_k(i)) liveset(os, live, GETARG_C(i), GETARG_C(i));
+      break;
+    }
+    case OP_SELF: {
+      liveclear(os, live, a, a + 1);
+      liveset(os, live, GETARG_B(i), GETARG_B(i));
+      if (!GETARG_k(i)) liveset(os, live, GETARG_C(i), GETARG_C(i));
+      break;
+    }
+    case OP_MMBIN: case OP_EQ: case OP_LT: case OP_LE: {
+      liveset(os, live, a, a);
+      liveset(os, live, GETARG_B(i), GETARG_B(i));
+      break;
+    }
+    case OP_TESTSET: {  /* 'a' maybe written */
+      liveset(os, live, GETARG_B(i), GETARG_B(i));
+      break;
+    }
+    case OP_CONCAT: liveset(os, live, a, a + GETARG_B(i) - 1); break;
+    case OP_CLOSE: liveset(os, live, a, all); break;
+    case OP_JMP: case OP_RETURN0: case OP_EXTRAARG: break;
+    case OP_VARARG: {
+      if (GETARG_C(i) > 0) liveclear(os, live, a, a + GETARG_C(i) - 2);
+      break;
+    }
+    case OP_CALL: case OP_TAILCALL: {
+      int b = GETARG_B(i);
+      if (GET_OPCODE(i) == OP_CALL && GETARG_C(i) > 0)
+        liveclear(os, live, a, a + GETARG_C(i) - 2);
+      liveset(os, live, a, (b == 0) ? all : a + b - 1);
+      break;
+    }
+    case OP_RETURN: {
+      int b = GETARG_B(i);
+      liveset(os, live, a, (b == 0) ? all : a + b - 2);
+      break;
+    }
+    case OP_FORLOOP: case OP_FORPREP: liveset(os, live, a, a + 2); break;
+    case OP_TFORPREP: case OP_TFORCALL: case OP_TFORLOOP: {
+      liveset(os, live, a, a + 3);
+      break;
+    }
+    case OP_SETLIST: {
+      int b = GETARG_B(i);
+      liveset(os, live, a, (b == 0) ? all : a + b);
+      break;
+    }
+    default: liveset(os, live, 0, all); break;
+  }
+}
+
+
+/*
+** Whether instruction 'pc' only stores into registers that are dead
+** after it, without any other effect.
+*/
+static int optdeadstore (OptState *os, int pc, const lu_byte *live) {
+  Instruction i = os->code[pc];
+  int a = GETARG_A(i);
+  int last = a;
+  switch (GET_OPCODE(i)) {
+    case OP_MOVE: case OP_LOADI: case OP_LOADF: case OP_LOADK: case OP_LOADKX:
+    case OP_LOADFALSE: case OP_LOADTRUE: case OP_GETUPVAL: case OP_NOT:
+      break;
+    case OP_LOADNIL: last = a + GETARG_B(i); break;
+    default: return 0;
+  }
+  if (optskipped(os, pc))
+    return 0;
+  for (; a <= last; a++) {
+    if (os->pinned[a] || (live[a >> 3] & (1 << (a & 7))))
+      return 0;
+  }
+  return 1;
+}
+
+
+/* registers live at the end of block 'b' */
+static void optliveout (OptState *os, const lu_byte *in, int b,
+                                      lu_byte *live, int nbytes) {
+  int s[2];
+  int j, x, ns = optsuccs(os, os->bstart[b + 1] - 1, s);
+  memset(live, 0, nbytes);
+  for (j = 0; j < ns; j++) {
+    const lu_byte *sin = &in[os->bof[s[j]] * nbytes];
+    for (x = 0; x < nbytes; x++)
+      live[x] |= sin[x];
+  }
+}
+
+
+static int optdeadstores (OptState *os) {
+  int nbytes = (os->nr + 7) / 8;
+  lu_byte *in, *live;
+  int b, pc, changed;
+  optblocks(os);
+  in = optalloc(os, cast_sizet(os->nb + 1) * nbytes);
+  live = &in[os->nb * nbytes];
+  do {  /* registers live at the entry of each block, to a fixpoint */
+    changed = 0;
+    for (b = os->nb - 1; b >= 0; b--) {
+      optliveout(os, in, b, live, nbytes);
+      for (pc = os->bstart[b + 1] - 1; pc >= os->bstart[b]; pc--)
+        optliveness(os, os->code[pc], live);
+      if (memcmp(live, &in[b * nbytes], nbytes) != 0) {
+        memcpy(&in[b * nbytes], live, nbytes);
+        changed = 1;
+      }
+    }
+  } while (changed);
+  for (b = 0; b < os->nb; b++) {  /* now remove the dead stores */
+    optliveout(os, in, b, live, nbytes);
+    for (pc = os->bstart[b + 1] - 1; pc >= os->bstart[b]; pc--) {
+      if (optdeadstore(os, pc, live)) {
+        optkill(os, pc);
+        if (GET_OPCODE(os->code[pc]) == OP_LOADKX)
+          optkill(os, pc + 1);  /* its OP_EXTRAARG */
+        changed = 1;
+      }
+      else
+        optliveness(os, os->code[pc], live);
+    }
+  }
+  return changed;
+}
+
+/* }------------------------------------------------------ */
+
+
+static int optphase (FuncState *fs, int (*phase) (OptState *os)) {
+  lua_State *L = fs->ls->L;
+  OptState os;
+  int changed;
+  optinit(&os, fs);
+  changed = phase(&os);
+  if (changed)
+    optcompact(&os);
+  L->top.p -= os.nanchors;
+  return changed;
+}
+
+
+/*
+** Optimize the code of function 'fs', which must be finished (see
+** 'luaK_finish'), repeating until nothing changes.
+*/
+void luaK_optimize (FuncState *fs) {
+  int round;
+  for (round = 0; round < MAXOPTROUNDS; round++) {
+    int changed = optphase(fs, optpropagate);
+    changed |= optphase(fs, optjumps);
+    changed |= optphase(fs, optdeadstores);
+    if (!changed)
+      break;
+  }
+}
+
+/* }====================================================== */
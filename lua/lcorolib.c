@@ -190,6 +190,30 @@ static int luaB_close (lua_State *L) {
 }
 
 
+/*
+** setpool(max [, stacksize]): how many collected coroutines are kept
+** for reuse, and the stack size new coroutines start with
+*/
+static int luaB_setpool (lua_State *L) {
+  int max = (int)luaL_checkinteger(L, 1);
+  int stacksize = (int)luaL_optinteger(L, 2, -1);
+  luaL_argcheck(L, max >= 0, 1, "must be non-negative");
+  lua_setthreadpool(L, max, stacksize);
+  return 0;
+}
+
+
+/* poolstats() -> reused, created, pooled */
+static int luaB_poolstats (lua_State *L) {
+  size_t created, reused;
+  int pooled = lua_threadpoolinfo(L, &created, &reused);
+  lua_pushinteger(L, (lua_Integer)reused);
+  lua_pushinteger(L, (lua_Integer)created);
+  lua_pushinteger(L, pooled);
+  return 3;
+}
+
+
 static const luaL_Reg co_funcs[] = {
   {"create", luaB_cocreate},
   {"resume", luaB_coresume},
@@ -199,6 +223,8 @@ static const luaL_Reg co_funcs[] = {
   {"yield", luaB_yield},
   {"isyieldable", luaB_yieldable},
   {"close", luaB_close},
+  {"setpool", luaB_setpool},
+  {"poolstats", luaB_poolstats},
   {NULL, NULL}
 };
 
@@ -1018,7 +1018,8 @@ static void f_parser (lua_State *L, void *ud) {
   }
   else {
     checkmode(L, mode, "text");
-    cl = luaY_parser(L, p->z, &p->buff, &p->dyd, p->name, c);
+    cl = luaY_parser(L, p->z, &p->buff, &p->dyd, p->name, c,
+                     strchr(mode, 'O') != NULL, strchr(mode, 'K') != NULL);
   }
   lua_assert(cl->nupvalues == cl->p->sizeupvalues);
   luaF_initupvals(L, cl);
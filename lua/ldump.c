@@ -155,6 +155,8 @@ static void dumpString (DumpState *D, TString *ts) {
 }
 
 
+#if !defined(LUA_QUICKEN)
+
 static void dumpCode (DumpState *D, const Proto *f) {
   dumpInt(D, f->sizecode);
   dumpAlign(D, sizeof(f->code[0]));
@@ -162,6 +164,33 @@ static void dumpCode (DumpState *D, const Proto *f) {
   dumpVector(D, f->code, f->sizecode);
 }
 
+#else
+
+/*
+** Dump code with quickened instructions turned back into their
+** generic forms, in chunks to keep the number of writes low.
+*/
+static void dumpCode (DumpState *D, const Proto *f) {
+  Instruction buff[128];
+  int i, n = 0;
+  dumpInt(D, f->sizecode);
+  dumpAlign(D, sizeof(f->code[0]));
+  lua_assert(f->code != NULL);
+  for (i = 0; i < f->sizecode; i++) {
+    Instruction inst = f->code[i];
+    SET_OPCODE(inst, luaP_unquicken(GET_OPCODE(inst)));
+    buff[n++] = inst;
+    if (n == sizeof(buff) / sizeof(buff[0])) {
+      dumpVector(D, buff, n);
+      n = 0;
+    }
+  }
+  if (n > 0)
+    dumpVector(D, buff, n);
+}
+
+#endif
+
 
 static void dumpFunction (DumpState *D, const Proto *f);
 
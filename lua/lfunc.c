@@ -20,6 +20,7 @@
 #include "lgc.h"
 #include "lmem.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstate.h"
 
 
@@ -245,6 +246,8 @@ Proto *luaF_newproto (lua_State *L) {
   f->p = NULL;
   f->sizep = 0;
   f->code = NULL;
+  f->icache = NULL;
+  f->sizeicache = 0;
   f->sizecode = 0;
   f->lineinfo = NULL;
   f->sizelineinfo = 0;
@@ -264,12 +267,47 @@ Proto *luaF_newproto (lua_State *L) {
 }
 
 
+/*
+** Create the inline caches of 'f', once its code is final. There is one
+** cache per constant used as a key by GETTABUP, GETFIELD, SETTABUP,
+** SETFIELD or SELF, shared by all sites using that key; functions with
+** no such sites get none. (Constants may not be loaded yet, so every
+** SELF with a constant key gets one.)
+*/
+void luaF_initcache (lua_State *L, Proto *f) {
+  int i;
+  int n = 0;
+  for (i = 0; i < f->sizecode; i++) {
+    Instruction inst = f->code[i];
+    int k;
+    switch (GET_OPCODE(inst)) {
+      case OP_GETTABUP: case OP_GETFIELD: k = GETARG_C(inst); break;
+      case OP_SETTABUP: case OP_SETFIELD: k = GETARG_B(inst); break;
+      case OP_SELF:
+        if (!TESTARG_k(inst)) continue;
+        k = GETARG_C(inst);
+        break;
+      default: continue;
+    }
+    if (k >= n)
+      n = k + 1;
+  }
+  if (n == 0)
+    return;
+  f->icache = luaM_newvector(L, n, unsigned int);
+  f->sizeicache = n;
+  for (i = 0; i < n; i++)
+    f->icache[i] = 0;
+}
+
+
 void luaF_freeproto (lua_State *L, Proto *f) {
   if (!(f->flag & PF_FIXED)) {
     luaM_freearray(L, f->code, f->sizecode);
     luaM_freearray(L, f->lineinfo, f->sizelineinfo);
     luaM_freearray(L, f->abslineinfo, f->sizeabslineinfo);
   }
+  luaM_freearray(L, f->icache, f->sizeicache);
   luaM_freearray(L, f->p, f->sizep);
   luaM_freearray(L, f->k, f->sizek);
   luaM_freearray(L, f->locvars, f->sizelocvars);
@@ -243,18 +243,27 @@ void luaC_fix (lua_State *L, GCObject *o) {
 
 
 /*
-** create a new collectable object (with given type, size, and offset)
-** and link it to 'allgc' list.
+** link an object (with given type) to 'allgc' list as a new object.
+** (Also used to bring back threads kept for reuse.)
 */
-GCObject *luaC_newobjdt (lua_State *L, int tt, size_t sz, size_t offset) {
+void luaC_linkobj (lua_State *L, GCObject *o, int tt) {
   global_State *g = G(L);
-  char *p = cast_charp(luaM_newobject(L, novariant(tt), sz));
-  GCObject *o = cast(GCObject *, p + offset);
   g->GCdebt--;
   o->marked = luaC_white(g);
   o->tt = tt;
   o->next = g->allgc;
   g->allgc = o;
+}
+
+
+/*
+** create a new collectable object (with given type, size, and offset)
+** and link it to 'allgc' list.
+*/
+GCObject *luaC_newobjdt (lua_State *L, int tt, size_t sz, size_t offset) {
+  char *p = cast_charp(luaM_newobject(L, novariant(tt), sz));
+  GCObject *o = cast(GCObject *, p + offset);
+  luaC_linkobj(L, o, tt);
   return o;
 }
 
@@ -404,6 +413,7 @@ static void restartcollection (global_State *g) {
   g->marked = NFIXED;
   markobject(g, g->mainthread);
   markvalue(g, &g->l_registry);
+  markobjectN(g, g->hostk);
   markmt(g);
   markbeingfnz(g);  /* mark any finalizing object left from previous cycle */
 }
@@ -1486,6 +1496,7 @@ static l_obj atomic (lua_State *L) {
   markobject(g, L);  /* mark running thread */
   /* registry and global metatables may be changed by API */
   markvalue(g, &g->l_registry);
+  markobjectN(g, g->hostk);
   markmt(g);  /* mark global metatables */
   work += propagateall(g);  /* empties 'gray' list */
   /* remark occasional upvalues of (maybe) dead threads */
@@ -1665,6 +1676,8 @@ void luaC_step (lua_State *L) {
   if (!gcrunning(g))  /* not running? */
     luaE_setdebt(g, 2000);
   else {
+    lua_GCHook hook = g->gchook;
+    if (hook) hook(L, 1);
     switch (g->gckind) {
       case KGC_INC: case KGC_GENMAJOR:
         incstep(L, g);
@@ -1674,6 +1687,7 @@ void luaC_step (lua_State *L) {
         setminordebt(g);
         break;
     }
+    if (hook) hook(L, 0);
   }
 }
 
@@ -1705,7 +1719,9 @@ static void fullinc (lua_State *L, global_State *g) {
 */
 void luaC_fullgc (lua_State *L, int isemergency) {
   global_State *g = G(L);
+  lua_GCHook hook = g->gchook;
   lua_assert(!g->gcemergency);
+  if (hook) hook(L, 1);
   g->gcemergency = isemergency;  /* set flag */
   switch (g->gckind) {
     case KGC_GENMINOR: fullgen(L, g); break;
@@ -1717,6 +1733,7 @@ void luaC_fullgc (lua_State *L, int isemergency) {
       break;
   }
   g->gcemergency = 0;
+  if (hook) hook(L, 0);
 }
 
 /* }====================================================== */
@@ -36,6 +36,7 @@ static const luaL_Reg stdlibs[] = {
   {LUA_STRLIBNAME, luaopen_string},
   {LUA_TABLIBNAME, luaopen_table},
   {LUA_UTF8LIBNAME, luaopen_utf8},
+  {LUA_VECLIBNAME, luaopen_vector},
   {NULL, NULL}
 };
 
@@ -57,7 +58,7 @@ LUALIB_API void luaL_openselectedlibs (lua_State *L, int load, int preload) {
       lua_setfield(L, -2, lib->name);  /* add library to PRELOAD table */
     }
   }
-  lua_assert((mask >> 1) == LUA_UTF8LIBK);
+  lua_assert((mask >> 1) == LUA_VECLIBK);
   lua_pop(L, 1);  /* remove PRELOAD table */
 }
 
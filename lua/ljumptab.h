@@ -108,5 +108,15 @@ static const void *const disptab[NUM_OPCODES] = {
 &&L_OP_VARARG,
 &&L_OP_VARARGPREP,
 &&L_OP_EXTRAARG
+#if defined(LUA_QUICKEN)
+,&&L_OP_ADDFF,
+&&L_OP_SUBFF,
+&&L_OP_MULFF,
+&&L_OP_DIVFF,
+&&L_OP_ADDKF,
+&&L_OP_SUBKF,
+&&L_OP_MULKF,
+&&L_OP_DIVKF
+#endif
 
 };
@@ -75,6 +75,8 @@ typedef struct LexState {
   struct Dyndata *dyd;  /* dynamic structures used by the parser */
   TString *source;  /* current source name */
   TString *envn;  /* environment variable name */
+  Table *hostk;  /* host constants folded into this chunk (or NULL) */
+  lu_byte optimize;  /* run 'luaK_optimize' over each function */
 } LexState;
 
 
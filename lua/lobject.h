@@ -52,6 +52,7 @@ typedef union Value {
   lua_CFunction f; /* light C functions */
   lua_Integer i;   /* integer numbers */
   lua_Number n;    /* float numbers */
+  float v[2];      /* vectors */
   /* not used, but may avoid warnings for uninitialized value */
   lu_byte ub;
 } Value;
@@ -363,6 +364,31 @@ typedef struct GCObject {
 /* }================================================================== */
 
 
+/*
+** {==================================================================
+** Vectors
+** ===================================================================
+*/
+
+/*
+** Vectors are two single precision floats packed into the value
+** itself, so they are never allocated and not collectable.
+*/
+#define LUA_VVECTOR	makevariant(LUA_TVECTOR, 0)
+
+#define ttisvector(o)		checktag((o), LUA_VVECTOR)
+
+#define vecvalue(o)	check_exp(ttisvector(o), val_(o).v)
+
+#define vecvalueraw(vl)	((vl).v)
+
+#define setvecvalue(obj,x,y) \
+  { TValue *io=(obj); val_(io).v[0]=(x); val_(io).v[1]=(y); \
+    settt_(io, LUA_VVECTOR); }
+
+/* }================================================================== */
+
+
 /*
 ** {==================================================================
 ** Strings
@@ -597,6 +623,7 @@ typedef struct Proto {
   int sizeupvalues;  /* size of 'upvalues' */
   int sizek;  /* size of 'k' */
   int sizecode;
+  int sizeicache;  /* size of 'icache' */
   int sizelineinfo;
   int sizep;  /* size of 'p' */
   int sizelocvars;
@@ -605,6 +632,7 @@ typedef struct Proto {
   int lastlinedefined;  /* debug information  */
   TValue *k;  /* constants used by the function */
   Instruction *code;  /* opcodes */
+  unsigned int *icache;  /* inline caches, by constant index (see lvm.c) */
   struct Proto **p;  /* functions defined inside the function */
   Upvaldesc *upvalues;  /* upvalue information */
   ls_byte *lineinfo;  /* information about source lines (debug information) */
@@ -100,5 +100,35 @@ LUAI_DDEF const lu_byte luaP_opmodes[NUM_OPCODES] = {
  ,opmode(0, 1, 0, 0, 1, iABC)		/* OP_VARARG */
  ,opmode(0, 0, 1, 0, 1, iABC)		/* OP_VARARGPREP */
  ,opmode(0, 0, 0, 0, 0, iAx)		/* OP_EXTRAARG */
+#if defined(LUA_QUICKEN)
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_ADDFF */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_SUBFF */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_MULFF */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_DIVFF */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_ADDKF */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_SUBKF */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_MULKF */
+ ,opmode(0, 0, 0, 0, 1, iABC)		/* OP_DIVKF */
+#endif
 };
 
+
+#if defined(LUA_QUICKEN)
+/*
+** Generic opcode of a quickened one; other opcodes map to themselves.
+*/
+OpCode luaP_unquicken (OpCode op) {
+  switch (op) {
+    case OP_ADDFF: return OP_ADD;
+    case OP_SUBFF: return OP_SUB;
+    case OP_MULFF: return OP_MUL;
+    case OP_DIVFF: return OP_DIV;
+    case OP_ADDKF: return OP_ADDK;
+    case OP_SUBKF: return OP_SUBK;
+    case OP_MULKF: return OP_MULK;
+    case OP_DIVKF: return OP_DIVK;
+    default: return op;
+  }
+}
+#endif
+
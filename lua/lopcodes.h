@@ -307,10 +307,26 @@ OP_VARARG,/*	A C	R[A], R[A+1], ..., R[A+C-2] = vararg		*/
 OP_VARARGPREP,/*A	(adjust vararg parameters)			*/
 
 OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
+
+#if defined(LUA_QUICKEN)
+/* quickened variants, only ever written by the VM (see lvm.c) */
+,OP_ADDFF,/*	A B C	R[A] := R[B] + R[C]  (floats)			*/
+OP_SUBFF,/*	A B C	R[A] := R[B] - R[C]  (floats)			*/
+OP_MULFF,/*	A B C	R[A] := R[B] * R[C]  (floats)			*/
+OP_DIVFF,/*	A B C	R[A] := R[B] / R[C]  (floats)			*/
+OP_ADDKF,/*	A B C	R[A] := R[B] + K[C]  (floats)			*/
+OP_SUBKF,/*	A B C	R[A] := R[B] - K[C]  (floats)			*/
+OP_MULKF,/*	A B C	R[A] := R[B] * K[C]  (floats)			*/
+OP_DIVKF/*	A B C	R[A] := R[B] / K[C]  (floats)			*/
+#endif
 } OpCode;
 
 
+#if defined(LUA_QUICKEN)
+#define NUM_OPCODES	((int)(OP_DIVKF) + 1)
+#else
 #define NUM_OPCODES	((int)(OP_EXTRAARG) + 1)
+#endif
 
 
 
@@ -340,6 +356,10 @@ OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
   (*) In OP_LOADKX and OP_NEWTABLE, the next instruction is always
   OP_EXTRAARG.
 
+  (*) Quickened opcodes (OP_ADDFF and on, only with LUA_QUICKEN) replace their generic
+  opcode in place while it keeps seeing float operands, and are
+  never dumped (see 'luaP_unquicken').
+
   (*) In OP_SETLIST, if (B == 0) then real B = 'top'; if k, then
   real C = EXTRAARG _ C (the bits of EXTRAARG concatenated with the
   bits of C).
@@ -380,6 +400,10 @@ OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
 
 LUAI_DDEC(const lu_byte luaP_opmodes[NUM_OPCODES];)
 
+#if defined(LUA_QUICKEN)
+LUAI_FUNC OpCode luaP_unquicken (OpCode op);
+#endif
+
 #define getOpMode(m)	(cast(enum OpMode, luaP_opmodes[m] & 7))
 #define testAMode(m)	(luaP_opmodes[m] & (1 << 3))
 #define testTMode(m)	(luaP_opmodes[m] & (1 << 4))
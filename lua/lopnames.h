@@ -96,6 +96,16 @@ static const char *const opnames[] = {
   "VARARG",
   "VARARGPREP",
   "EXTRAARG",
+#if defined(LUA_QUICKEN)
+  "ADDFF",
+  "SUBFF",
+  "MULFF",
+  "DIVFF",
+  "ADDKF",
+  "SUBKF",
+  "MULKF",
+  "DIVKF",
+#endif
   NULL
 };
 
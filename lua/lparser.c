@@ -63,6 +63,7 @@ typedef struct BlockCnt {
 */
 static void statement (LexState *ls);
 static void expr (LexState *ls, expdesc *v);
+static void globalvar (LexState *ls, TString *varname, expdesc *var);
 
 
 static l_noret error_expected (LexState *ls, int token) {
@@ -302,6 +303,10 @@ static void check_readonly (LexState *ls, expdesc *e) {
         varname = up->name;
       break;
     }
+    case VHOSTK: {
+      varname = e->u.strval;
+      break;
+    }
     default:
       return;  /* other cases cannot be read-only */
   }
@@ -464,6 +469,49 @@ static void singlevaraux (FuncState *fs, TString *n, expdesc *var, int base) {
 }
 
 
+/*
+** Access global 'varname' through the environment variable.
+*/
+static void globalvar (LexState *ls, TString *varname, expdesc *var) {
+  FuncState *fs = ls->fs;
+  expdesc key;
+  singlevaraux(fs, ls->envn, var, 1);  /* get environment variable */
+  lua_assert(var->k != VVOID);  /* this one must exist */
+  luaK_exp2anyregup(fs, var);  /* but could be a constant */
+  codestring(&key, varname);  /* key is variable name */
+  luaK_indexed(fs, var, &key);  /* env[varname] */
+}
+
+
+/*
+** Check whether global 'varname' is a host constant with a value that
+** can be folded. Only globals read through the chunk's own environment
+** count, so a local '_ENV' in this or any enclosing function turns
+** folding off.
+*/
+static int hostconstant (LexState *ls, TString *varname, expdesc *var) {
+  FuncState *fs;
+  TValue k;
+  if (ls->hostk == NULL || tagisempty(luaH_getstr(ls->hostk, varname, &k)))
+    return 0;
+  switch (ttypetag(&k)) {
+    case LUA_VNUMINT: case LUA_VNUMFLT: case LUA_VFALSE: case LUA_VTRUE:
+    case LUA_VSHRSTR: case LUA_VLNGSTR: break;
+    default: return 0;  /* not a compile-time constant */
+  }
+  for (fs = ls->fs; fs != NULL; fs = fs->prev) {
+    int i;
+    for (i = cast_int(fs->nactvar) - 1; i >= 0; i--) {
+      if (eqstr(ls->envn, getlocalvardesc(fs, i)->vd.name))
+        return 0;  /* environment is shadowed */
+    }
+  }
+  init_exp(var, VHOSTK, 0);
+  var->u.strval = varname;
+  return 1;
+}
+
+
 /*
 ** Find a variable with the given name 'n', handling global variables
 ** too.
@@ -472,14 +520,8 @@ static void singlevar (LexState *ls, expdesc *var) {
   TString *varname = str_checkname(ls);
   FuncState *fs = ls->fs;
   singlevaraux(fs, varname, var, 1);
-  if (var->k == VVOID) {  /* global name? */
-    expdesc key;
-    singlevaraux(fs, ls->envn, var, 1);  /* get environment variable */
-    lua_assert(var->k != VVOID);  /* this one must exist */
-    luaK_exp2anyregup(fs, var);  /* but could be a constant */
-    codestring(&key, varname);  /* key is variable name */
-    luaK_indexed(fs, var, &key);  /* env[varname] */
-  }
+  if (var->k == VVOID && !hostconstant(ls, varname, var))  /* global name? */
+    globalvar(ls, varname, var);
 }
 
 
@@ -770,7 +812,10 @@ static void close_func (LexState *ls) {
   leaveblock(fs);
   lua_assert(fs->bl == NULL);
   luaK_finish(fs);
+  if (ls->optimize)
+    luaK_optimize(fs);
   luaM_shrinkvector(L, f->code, f->sizecode, fs->pc, Instruction);
+  luaF_initcache(L, f);
   luaM_shrinkvector(L, f->lineinfo, f->sizelineinfo, fs->pc, ls_byte);
   luaM_shrinkvector(L, f->abslineinfo, f->sizeabslineinfo,
                        fs->nabslineinfo, AbsLineInfo);
@@ -1949,7 +1994,8 @@ static void mainfunc (LexState *ls, FuncState *fs) {
 
 
 LClosure *luaY_parser (lua_State *L, ZIO *z, Mbuffer *buff,
-                       Dyndata *dyd, const char *name, int firstchar) {
+                       Dyndata *dyd, const char *name, int firstchar,
+                       int optimize, int fold) {
   LexState lexstate;
   FuncState funcstate;
   LClosure *cl = luaF_newLclosure(L, 1);  /* create main closure */
@@ -1964,6 +2010,8 @@ LClosure *luaY_parser (lua_State *L, ZIO *z, Mbuffer *buff,
   luaC_objbarrier(L, funcstate.f, funcstate.f->source);
   lexstate.buff = buff;
   lexstate.dyd = dyd;
+  lexstate.hostk = (fold || G(L)->hostkall) ? G(L)->hostk : NULL;
+  lexstate.optimize = cast_byte(optimize || G(L)->optimize);
   dyd->actvar.n = dyd->gt.n = dyd->label.n = 0;
   luaX_setinput(L, &lexstate, z, funcstate.f->source, firstchar);
   mainfunc(&lexstate, &funcstate);
@@ -40,6 +40,8 @@ typedef enum {
   VUPVAL,  /* upvalue variable; info = index of upvalue in 'upvalues' */
   VCONST,  /* compile-time <const> variable;
               info = absolute index in 'actvar.arr'  */
+  VHOSTK,  /* global folded to a host constant (see 'lua_setconstants');
+              strval = global name */
   VINDEXED,  /* indexed variable;
                 ind.t = table register;
                 ind.idx = key's R index */
@@ -165,7 +167,8 @@ typedef struct FuncState {
 
 LUAI_FUNC int luaY_nvarstack (FuncState *fs);
 LUAI_FUNC LClosure *luaY_parser (lua_State *L, ZIO *z, Mbuffer *buff,
-                                 Dyndata *dyd, const char *name, int firstchar);
+                                 Dyndata *dyd, const char *name, int firstchar,
+                                 int optimize, int fold);
 
 
 #endif
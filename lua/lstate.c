@@ -162,15 +162,15 @@ LUAI_FUNC void luaE_incCstack (lua_State *L) {
 }
 
 
-static void stack_init (lua_State *L1, lua_State *L) {
+/*
+** erase the stack of 'L1' and set up its first CallInfo
+*/
+static void stack_reset (lua_State *L1) {
   int i; CallInfo *ci;
-  /* initialize stack array */
-  L1->stack.p = luaM_newvector(L, BASIC_STACK_SIZE + EXTRA_STACK, StackValue);
   L1->tbclist.p = L1->stack.p;
-  for (i = 0; i < BASIC_STACK_SIZE + EXTRA_STACK; i++)
-    setnilvalue(s2v(L1->stack.p + i));  /* erase new stack */
+  for (i = 0; i < stacksize(L1) + EXTRA_STACK; i++)
+    setnilvalue(s2v(L1->stack.p + i));  /* erase stack */
   L1->top.p = L1->stack.p;
-  L1->stack_last.p = L1->stack.p + BASIC_STACK_SIZE;
   /* initialize first ci */
   ci = &L1->base_ci;
   ci->next = ci->previous = NULL;
@@ -185,6 +185,14 @@ static void stack_init (lua_State *L1, lua_State *L) {
 }
 
 
+static void stack_init (lua_State *L1, lua_State *L, int size) {
+  /* initialize stack array */
+  L1->stack.p = luaM_newvector(L, size + EXTRA_STACK, StackValue);
+  L1->stack_last.p = L1->stack.p + size;
+  stack_reset(L1);
+}
+
+
 static void freestack (lua_State *L) {
   if (L->stack.p == NULL)
     return;  /* stack not completely built yet */
@@ -195,6 +203,21 @@ static void freestack (lua_State *L) {
 }
 
 
+/*
+** free the threads kept for reuse, keeping at most 'n' of them
+*/
+static void trimthreadpool (lua_State *L, int n) {
+  global_State *g = G(L);
+  while (g->nfreethreads > n) {
+    lua_State *L1 = g->freethreads;
+    g->freethreads = cast(lua_State *, L1->next);
+    g->nfreethreads--;
+    freestack(L1);
+    luaM_free(L, fromstate(L1));
+  }
+}
+
+
 /*
 ** Create registry table and its predefined values
 */
@@ -222,7 +245,7 @@ static void init_registry (lua_State *L, global_State *g) {
 static void f_luaopen (lua_State *L, void *ud) {
   global_State *g = G(L);
   UNUSED(ud);
-  stack_init(L, L);  /* init stack */
+  stack_init(L, L, BASIC_STACK_SIZE);  /* init stack */
   init_registry(L, g);
   luaS_init(L);
   luaT_init(L);
@@ -267,6 +290,7 @@ static void close_state (lua_State *L) {
     luaC_freeallobjects(L);  /* collect all objects */
     luai_userstateclose(L);
   }
+  trimthreadpool(L, 0);  /* free threads kept by the collection above */
   luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size);
   freestack(L);
   lua_assert(g->totalbytes == sizeof(LG));
@@ -275,15 +299,30 @@ static void close_state (lua_State *L) {
 }
 
 
+/*
+** New threads come from the pool of collected threads when possible,
+** keeping their stacks; otherwise they are built from scratch.
+*/
 LUA_API lua_State *lua_newthread (lua_State *L) {
   global_State *g = G(L);
-  GCObject *o;
   lua_State *L1;
+  StkId stack = NULL, stack_last = NULL;
   lua_lock(L);
   luaC_checkGC(L);
-  /* create new thread */
-  o = luaC_newobjdt(L, LUA_TTHREAD, sizeof(LX), offsetof(LX, l));
-  L1 = gco2th(o);
+  if (g->freethreads != NULL) {  /* reuse a collected thread */
+    L1 = g->freethreads;
+    g->freethreads = cast(lua_State *, L1->next);
+    g->nfreethreads--;
+    g->threadsreused++;
+    luaC_linkobj(L, obj2gco(L1), LUA_VTHREAD);
+    stack = L1->stack.p;
+    stack_last = L1->stack_last.p;
+  }
+  else {  /* create new thread */
+    GCObject *o = luaC_newobjdt(L, LUA_TTHREAD, sizeof(LX), offsetof(LX, l));
+    L1 = gco2th(o);
+    g->threadsnew++;
+  }
   /* anchor it on L stack */
   setthvalue2s(L, L->top.p, L1);
   api_incr_top(L);
@@ -296,19 +335,79 @@ LUA_API lua_State *lua_newthread (lua_State *L) {
   memcpy(lua_getextraspace(L1), lua_getextraspace(g->mainthread),
          LUA_EXTRASPACE);
   luai_userstatethread(L, L1);
-  stack_init(L1, L);  /* init stack */
+  if (stack != NULL) {  /* reused thread? */
+    L1->stack.p = stack;
+    L1->stack_last.p = stack_last;
+    stack_reset(L1);
+  }
+  else
+    stack_init(L1, L, g->threadstack);  /* init stack */
   lua_unlock(L);
   return L1;
 }
 
 
+/*
+** Dead threads go to the pool while it has room, unless their stacks
+** grew too big to be worth keeping or the collector needs the memory.
+*/
 void luaE_freethread (lua_State *L, lua_State *L1) {
+  global_State *g = G(L);
   LX *l = fromstate(L1);
   luaF_closeupval(L1, L1->stack.p);  /* close all upvalues */
   lua_assert(L1->openupval == NULL);
   luai_userstatefree(L, L1);
-  freestack(L1);
-  luaM_free(L, l);
+  if (g->nfreethreads < g->maxfreethreads && !g->gcemergency &&
+      L1->stack.p != NULL && stacksize(L1) <= 4 * g->threadstack) {
+    L1->ci = &L1->base_ci;
+    freeCI(L1);  /* keep only the stack */
+    L1->next = cast(GCObject *, g->freethreads);
+    g->freethreads = L1;
+    g->nfreethreads++;
+  }
+  else {
+    freestack(L1);
+    luaM_free(L, l);
+  }
+}
+
+
+/*
+** Set how many collected threads are kept for reuse and the stack size
+** new threads start with. Negative values keep the current settings.
+*/
+LUA_API void lua_setthreadpool (lua_State *L, int max, int stacksize) {
+  global_State *g = G(L);
+  lua_lock(L);
+  if (max >= 0) {
+    g->maxfreethreads = max;
+    trimthreadpool(L, max);
+  }
+  if (stacksize >= 0) {
+    if (stacksize <= LUA_MINSTACK)  /* room for the first CallInfo */
+      stacksize = LUA_MINSTACK + 1;
+    else if (stacksize > LUAI_MAXSTACK)
+      stacksize = LUAI_MAXSTACK;
+    g->threadstack = stacksize;
+  }
+  lua_unlock(L);
+}
+
+
+/*
+** Number of threads built from scratch and taken from the pool so far;
+** returns how many threads the pool holds now.
+*/
+LUA_API int lua_threadpoolinfo (lua_State *L, size_t *created,
+                                size_t *reused) {
+  global_State *g = G(L);
+  int n;
+  lua_lock(L);
+  if (created) *created = g->threadsnew;
+  if (reused) *reused = g->threadsreused;
+  n = g->nfreethreads;
+  lua_unlock(L);
+  return n;
 }
 
 
@@ -360,6 +459,15 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud, unsigned seed) {
   g->ud = ud;
   g->warnf = NULL;
   g->ud_warn = NULL;
+  g->gchook = NULL;
+  g->freethreads = NULL;
+  g->nfreethreads = 0;
+  g->maxfreethreads = THREADPOOL;
+  g->threadstack = BASIC_STACK_SIZE;
+  g->threadsnew = g->threadsreused = 0;
+  g->hostk = NULL;
+  g->hostkall = 0;
+  g->optimize = 0;
   g->mainthread = L;
   g->seed = seed;
   g->gcstp = GCSTPGC;  /* no GC while building state */
@@ -153,6 +153,15 @@ struct lua_longjmp;  /* defined in ldo.c */
 #endif
 
 
+/*
+** Default number of collected threads kept for reuse (see
+** 'lua_setthreadpool').
+*/
+#if !defined(THREADPOOL)
+#define THREADPOOL		1024
+#endif
+
+
 #define BASIC_STACK_SIZE        (2*LUA_MINSTACK)
 
 #define stacksize(th)	cast_int((th)->stack_last.p - (th)->stack.p)
@@ -309,6 +318,16 @@ typedef struct global_State {
   TString *strcache[STRCACHE_N][STRCACHE_M];  /* cache for strings in API */
   lua_WarnFunction warnf;  /* warning function */
   void *ud_warn;         /* auxiliary data to 'warnf' */
+  lua_GCHook gchook;  /* called around collector steps */
+  struct lua_State *freethreads;  /* collected threads kept for reuse */
+  int nfreethreads;  /* number of threads in 'freethreads' */
+  int maxfreethreads;  /* maximum number of threads in 'freethreads' */
+  int threadstack;  /* initial stack size of new threads */
+  size_t threadsnew;  /* number of threads built from scratch */
+  size_t threadsreused;  /* number of threads taken from 'freethreads' */
+  struct Table *hostk;  /* host constants for new chunks (or NULL) */
+  lu_byte hostkall;  /* fold host constants in every chunk */
+  lu_byte optimize;  /* optimize the code of every new chunk */
 } global_State;
 
 
@@ -175,6 +175,19 @@ static int l_hashfloat (lua_Number n) {
 #endif
 
 
+/*
+** Hash for vectors. Adding 0.0f turns a -0.0 component into 0.0, so
+** that vectors that compare equal also hash equally.
+*/
+static unsigned int l_hashvec (const float *v) {
+  float x = v[0] + 0.0f, y = v[1] + 0.0f;
+  unsigned int ux, uy;
+  memcpy(&ux, &x, sizeof(ux));
+  memcpy(&uy, &y, sizeof(uy));
+  return (ux ^ (ux >> 16)) + (uy ^ (uy >> 16)) * 31u;
+}
+
+
 /*
 ** returns the 'main' position of an element in a table (that is,
 ** the index of its hash value).
@@ -209,6 +222,8 @@ static Node *mainpositionTV (const Table *t, const TValue *key) {
       lua_CFunction f = fvalue(key);
       return hashpointer(t, f);
     }
+    case LUA_VVECTOR:
+      return hashmod(t, l_hashvec(vecvalue(key)));
     default: {
       GCObject *o = gcvalue(key);
       return hashpointer(t, o);
@@ -259,6 +274,9 @@ static int equalkey (const TValue *k1, const Node *n2, int deadok) {
       return pvalue(k1) == pvalueraw(keyval(n2));
     case LUA_VLCF:
       return fvalue(k1) == fvalueraw(keyval(n2));
+    case LUA_VVECTOR:
+      return (vecvalue(k1)[0] == vecvalueraw(keyval(n2))[0] &&
+              vecvalue(k1)[1] == vecvalueraw(keyval(n2))[1]);
     case ctb(LUA_VLNGSTR):
       return luaS_eqlngstr(tsvalue(k1), keystrval(n2));
     default:
@@ -762,6 +780,7 @@ void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize) {
 
 /*
 ** nums[i] = number of keys 'k' where 2^(i - 1) < k <= 2^i
+** ('ek' is the key about to be inserted, if any)
 */
 static void rehash (lua_State *L, Table *t, const TValue *ek) {
   unsigned int asize;  /* optimal size for array part */
@@ -774,10 +793,11 @@ static void rehash (lua_State *L, Table *t, const TValue *ek) {
   na = numusearray(t, nums);  /* count keys in array part */
   totaluse = na;  /* all those keys are integer keys */
   totaluse += numusehash(t, nums, &na);  /* count keys in hash part */
-  /* count extra key */
-  if (ttisinteger(ek))
-    na += countint(ivalue(ek), nums);
-  totaluse++;
+  if (ek != NULL) {  /* count extra key */
+    if (ttisinteger(ek))
+      na += countint(ivalue(ek), nums);
+    totaluse++;
+  }
   /* compute new size for array part */
   asize = computesizes(nums, &na);
   /* resize the table to new computed sizes */
@@ -786,6 +806,52 @@ static void rehash (lua_State *L, Table *t, const TValue *ek) {
 
 
 
+/*
+** Resize table 't' to the smallest sizes that hold its current entries.
+*/
+void luaH_shrink (lua_State *L, Table *t) {
+  rehash(L, t, NULL);
+}
+
+
+/*
+** Remove all entries from table 't', keeping both parts at their sizes.
+** (No barrier is needed, as the table only loses references.)
+*/
+void luaH_clear (Table *t) {
+  unsigned int asize = setlimittosize(t);
+  unsigned int i;
+  for (i = 0; i < asize; i++)
+    *getArrTag(t, i) = LUA_VEMPTY;
+  if (!isdummy(t)) {
+    unsigned int size = sizenode(t);
+    for (i = 0; i < size; i++) {
+      Node *n = gnode(t, i);
+      gnext(n) = 0;
+      setnilkey(n);
+      setempty(gval(n));
+    }
+    if (haslastfree(t))
+      getlastfree(t) = gnode(t, size);  /* all positions are free */
+  }
+}
+
+
+/*
+** Exchange the entries of tables 't1' and 't2', which keep their
+** metatables. Nothing is allocated, so this cannot fail.
+*/
+void luaH_swap (Table *t1, Table *t2) {
+  Table aux = *t1;
+  t1->flags = t2->flags; t1->lsizenode = t2->lsizenode;
+  t1->alimit = t2->alimit; t1->array = t2->array; t1->node = t2->node;
+  t2->flags = aux.flags; t2->lsizenode = aux.lsizenode;
+  t2->alimit = aux.alimit; t2->array = aux.array; t2->node = aux.node;
+  invalidateTMcache(t1);  /* metamethod fields may have moved */
+  invalidateTMcache(t2);
+}
+
+
 /*
 ** }=============================================================
 */
@@ -861,6 +927,11 @@ static void luaH_newkey (lua_State *L, Table *t, const TValue *key,
     else if (l_unlikely(luai_numisnan(f)))
       luaG_runerror(L, "table index is NaN");
   }
+  else if (ttisvector(key)) {
+    const float *v = vecvalue(key);
+    if (l_unlikely(v[0] != v[0] || v[1] != v[1]))
+      luaG_runerror(L, "table index is a vector with NaN");
+  }
   if (ttisnil(value))
     return;  /* do not insert nil values */
   mp = mainpositionTV(t, key);
@@ -964,8 +1035,22 @@ const TValue *luaH_Hgetshortstr (Table *t, TString *key) {
 }
 
 
-int luaH_getshortstr (Table *t, TString *key, TValue *res) {
-  return finishnodeget(luaH_Hgetshortstr(t, key), res);
+/*
+** Look for a short string after a miss in its inline cache '*ic' (see
+** 'luaH_fastgetshortstr'), saving where the key is now, if present.
+*/
+static const TValue *Hgetshortstrcached (Table *t, TString *key,
+                                         unsigned int *ic) {
+  const TValue *slot = luaH_Hgetshortstr(t, key);
+  if (!isabstkey(slot))
+    *ic = cast_uint(nodefromval(slot) - gnode(t, 0));
+  return slot;
+}
+
+
+int luaH_getshortstrcached (Table *t, TString *key, TValue *res,
+                                      unsigned int *ic) {
+  return finishnodeget(Hgetshortstrcached(t, key, ic), res);
 }
 
 
@@ -1064,6 +1149,12 @@ int luaH_psetshortstr (Table *t, TString *key, TValue *val) {
 }
 
 
+int luaH_psetshortstrcached (Table *t, TString *key, TValue *val,
+                                       unsigned int *ic) {
+  return finishnodeset(t, Hgetshortstrcached(t, key, ic), val);
+}
+
+
 int luaH_psetstr (Table *t, TString *key, TValue *val) {
   return finishnodeset(t, Hgetstr(t, key), val);
 }
@@ -54,6 +54,31 @@
     else { tag = luaH_getint(h, (k), res); }}
 
 
+/*
+** Inline-cached access for short-string keys: 'ic' is an lvalue holding
+** the index of the node where the key was last found, which is used
+** only after checking that that node still holds the key.
+*/
+#define luaH_ichit(h,k,ic) \
+  ((ic) < cast_uint(sizenode(h)) && keyisshrstr(gnode(h, ic)) && \
+   keystrval(gnode(h, ic)) == (k))
+
+#define luaH_fastgetshortstr(t,k,res,ic,tag) \
+  { Table *h = t; \
+    if (luaH_ichit(h, k, ic)) { \
+      const TValue *v = gval(gnode(h, ic)); \
+      tag = ttypetag(v); \
+      if (!tagisempty(tag)) { setobj(cast(lua_State *, NULL), res, v); }} \
+    else { tag = luaH_getshortstrcached(h, (k), res, &(ic)); }}
+
+#define luaH_fastsetshortstr(t,k,val,ic,hres) \
+  { Table *h = t; \
+    if (luaH_ichit(h, k, ic) && !isempty(gval(gnode(h, ic)))) { \
+      setobj(cast(lua_State *, NULL), gval(gnode(h, ic)), val); \
+      hres = HOK; } \
+    else { hres = luaH_psetshortstrcached(h, (k), val, &(ic)); }}
+
+
 #define luaH_fastseti(t,k,val,hres) \
   { Table *h = t; lua_Unsigned u = l_castS2U(k) - 1u; \
     if ((u < h->alimit)) { \
@@ -138,12 +163,15 @@
 
 
 LUAI_FUNC int luaH_get (Table *t, const TValue *key, TValue *res);
-LUAI_FUNC int luaH_getshortstr (Table *t, TString *key, TValue *res);
 LUAI_FUNC int luaH_getstr (Table *t, TString *key, TValue *res);
 LUAI_FUNC int luaH_getint (Table *t, lua_Integer key, TValue *res);
 
 /* Special get for metamethods */
 LUAI_FUNC const TValue *luaH_Hgetshortstr (Table *t, TString *key);
+LUAI_FUNC int luaH_getshortstrcached (Table *t, TString *key, TValue *res,
+                                                 unsigned int *ic);
+LUAI_FUNC int luaH_psetshortstrcached (Table *t, TString *key, TValue *val,
+                                                   unsigned int *ic);
 
 LUAI_FUNC TString *luaH_getstrkey (Table *t, TString *key);
 
@@ -163,6 +191,9 @@ LUAI_FUNC Table *luaH_new (lua_State *L);
 LUAI_FUNC void luaH_resize (lua_State *L, Table *t, unsigned nasize,
                                                     unsigned nhsize);
 LUAI_FUNC void luaH_resizearray (lua_State *L, Table *t, unsigned nasize);
+LUAI_FUNC void luaH_shrink (lua_State *L, Table *t);
+LUAI_FUNC void luaH_clear (Table *t);
+LUAI_FUNC void luaH_swap (Table *t1, Table *t2);
 LUAI_FUNC void luaH_free (lua_State *L, Table *t);
 LUAI_FUNC int luaH_next (lua_State *L, Table *t, StkId key);
 LUAI_FUNC lua_Unsigned luaH_getn (Table *t);
@@ -69,6 +69,22 @@ static int tcreate (lua_State *L) {
 }
 
 
+/* clear(t): empties 't' and keeps its space, to be filled again */
+static int tclear (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_cleartable(L, 1);
+  return 0;
+}
+
+
+/* shrink(t): releases the space 't' does not need for what it holds */
+static int tshrink (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_shrinktable(L, 1);
+  return 0;
+}
+
+
 static int tinsert (lua_State *L) {
   lua_Integer pos;  /* where to insert new element */
   lua_Integer e = aux_getn(L, 1, TAB_RW);
@@ -401,6 +417,9 @@ static int sort (lua_State *L) {
 static const luaL_Reg tab_funcs[] = {
   {"concat", tconcat},
   {"create", tcreate},
+  {"new", tcreate},
+  {"clear", tclear},
+  {"shrink", tshrink},
   {"insert", tinsert},
   {"pack", tpack},
   {"unpack", tunpack},
@@ -31,6 +31,7 @@ LUAI_DDEF const char *const luaT_typenames_[LUA_TOTALTYPES] = {
   "no value",
   "nil", "boolean", udatatypename, "number",
   "string", "table", "function", udatatypename, "thread",
+  "vector",
   "upvalue", "proto" /* these last cases are used for tests only */
 };
 
@@ -149,6 +150,9 @@ static int callbinTM (lua_State *L, const TValue *p1, const TValue *p2,
 
 void luaT_trybinTM (lua_State *L, const TValue *p1, const TValue *p2,
                     StkId res, TMS event) {
+  if ((ttisvector(p1) || ttisvector(p2)) &&
+      luaV_arithvec(p1, p2, s2v(res), event))
+    return;  /* vector arithmetic needs no metamethod */
   if (l_unlikely(callbinTM(L, p1, p2, res, event) < 0)) {
     switch (event) {
       case TM_BAND: case TM_BOR: case TM_BXOR:
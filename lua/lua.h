@@ -70,8 +70,9 @@ typedef struct lua_State lua_State;
 #define LUA_TFUNCTION		6
 #define LUA_TUSERDATA		7
 #define LUA_TTHREAD		8
+#define LUA_TVECTOR		9
 
-#define LUA_NUMTYPES		9
+#define LUA_NUMTYPES		10
 
 
 
@@ -131,6 +132,13 @@ typedef void * (*lua_Alloc) (void *ud, void *ptr, size_t osize, size_t nsize);
 typedef void (*lua_WarnFunction) (void *ud, const char *msg, int tocont);
 
 
+/*
+** Type for GC hooks, called with 'begin' set before a collector step
+** (or full collection) and cleared after it
+*/
+typedef void (*lua_GCHook) (lua_State *L, int begin);
+
+
 /*
 ** Type used by the debug API to collect debug information
 */
@@ -164,6 +172,9 @@ LUA_API lua_State *(lua_newstate) (lua_Alloc f, void *ud, unsigned seed);
 LUA_API void       (lua_close) (lua_State *L);
 LUA_API lua_State *(lua_newthread) (lua_State *L);
 LUA_API int        (lua_closethread) (lua_State *L, lua_State *from);
+LUA_API void       (lua_setthreadpool) (lua_State *L, int max, int stacksize);
+LUA_API int        (lua_threadpoolinfo) (lua_State *L, size_t *created,
+                                         size_t *reused);
 
 LUA_API lua_CFunction (lua_atpanic) (lua_State *L, lua_CFunction panicf);
 
@@ -206,6 +217,8 @@ LUA_API lua_CFunction   (lua_tocfunction) (lua_State *L, int idx);
 LUA_API void	       *(lua_touserdata) (lua_State *L, int idx);
 LUA_API lua_State      *(lua_tothread) (lua_State *L, int idx);
 LUA_API const void     *(lua_topointer) (lua_State *L, int idx);
+LUA_API int             (lua_tovector) (lua_State *L, int idx,
+                                        float *x, float *y);
 
 
 /*
@@ -253,6 +266,7 @@ LUA_API const char *(lua_pushfstring) (lua_State *L, const char *fmt, ...);
 LUA_API void  (lua_pushcclosure) (lua_State *L, lua_CFunction fn, int n);
 LUA_API void  (lua_pushboolean) (lua_State *L, int b);
 LUA_API void  (lua_pushlightuserdata) (lua_State *L, void *p);
+LUA_API void  (lua_pushvector) (lua_State *L, float x, float y);
 LUA_API int   (lua_pushthread) (lua_State *L);
 
 
@@ -268,6 +282,9 @@ LUA_API int (lua_rawgeti) (lua_State *L, int idx, lua_Integer n);
 LUA_API int (lua_rawgetp) (lua_State *L, int idx, const void *p);
 
 LUA_API void  (lua_createtable) (lua_State *L, unsigned narr, unsigned nrec);
+LUA_API void  (lua_cleartable) (lua_State *L, int idx);
+LUA_API void  (lua_shrinktable) (lua_State *L, int idx);
+LUA_API void  (lua_swaptables) (lua_State *L, int idx1, int idx2);
 LUA_API void *(lua_newuserdatauv) (lua_State *L, size_t sz, int nuvalue);
 LUA_API int   (lua_getmetatable) (lua_State *L, int objindex);
 LUA_API int  (lua_getiuservalue) (lua_State *L, int idx, int n);
@@ -323,6 +340,21 @@ LUA_API int (lua_isyieldable) (lua_State *L);
 LUA_API void (lua_setwarnf) (lua_State *L, lua_WarnFunction f, void *ud);
 LUA_API void (lua_warning)  (lua_State *L, const char *msg, int tocont);
 
+LUA_API void (lua_setgchook) (lua_State *L, lua_GCHook f);
+
+/*
+** Host constants: globals named by the string keys of this table are
+** folded into chunks compiled afterwards, as if declared '<const>'.
+** Only chunks loaded with a 'K' in their mode fold them, unless 'all'
+*/
+LUA_API void (lua_setconstants) (lua_State *L, int idx, int all);
+
+/*
+** Optimizer: when on, every chunk compiled afterwards goes through it,
+** as do chunks loaded with an 'O' in their mode
+*/
+LUA_API void (lua_setoptimize) (lua_State *L, int on);
+
 
 /*
 ** garbage-collection options
@@ -405,6 +437,7 @@ LUA_API void (lua_closeslot) (lua_State *L, int idx);
 #define lua_isnil(L,n)		(lua_type(L, (n)) == LUA_TNIL)
 #define lua_isboolean(L,n)	(lua_type(L, (n)) == LUA_TBOOLEAN)
 #define lua_isthread(L,n)	(lua_type(L, (n)) == LUA_TTHREAD)
+#define lua_isvector(L,n)	(lua_type(L, (n)) == LUA_TVECTOR)
 #define lua_isnone(L,n)		(lua_type(L, (n)) == LUA_TNONE)
 #define lua_isnoneornil(L, n)	(lua_type(L, (n)) <= 0)
 
@@ -724,6 +724,14 @@
 */
 /* #define LUA_USE_APICHECK */
 
+
+/*
+@@ LUA_QUICKEN turns on quickening, where arithmetic instructions
+** that see two floats rewrite themselves into float-only variants
+** (see lvm.c).
+*/
+/* #define LUA_QUICKEN */
+
 /* }================================================================== */
 
 
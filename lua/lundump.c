@@ -191,6 +191,7 @@ static void loadCode (LoadState *S, Proto *f) {
     f->sizecode = n;
     loadVector(S, f->code, n);
   }
+  luaF_initcache(S->L, f);
 }
 
 
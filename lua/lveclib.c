@@ -0,0 +1,113 @@
+/*
+** $Id: lveclib.c $
+** Standard library for vectors
+** See Copyright Notice in lua.h
+*/
+
+#define lveclib_c
+#define LUA_LIB
+
+#include "lprefix.h"
+
+
+#include <math.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+/*
+** Vectors are values, like numbers: arithmetic, comparison with '==',
+** and reading the components 'v.x' and 'v.y' are built into the VM.
+** This library only adds what has no operator.
+*/
+
+
+static int vec_new (lua_State *L) {
+  float x = (float)luaL_optnumber(L, 1, 0);
+  float y = (float)luaL_optnumber(L, 2, 0);
+  lua_pushvector(L, x, y);
+  return 1;
+}
+
+
+static int vec_unpack (lua_State *L) {
+  float x, y;
+  luaL_checkvector(L, 1, &x, &y);
+  lua_pushnumber(L, (lua_Number)x);
+  lua_pushnumber(L, (lua_Number)y);
+  return 2;
+}
+
+
+static int vec_dot (lua_State *L) {
+  float ax, ay, bx, by;
+  luaL_checkvector(L, 1, &ax, &ay);
+  luaL_checkvector(L, 2, &bx, &by);
+  lua_pushnumber(L, (lua_Number)(ax * bx + ay * by));
+  return 1;
+}
+
+
+/* z component of the 3D cross product, i.e. the 2D perp dot product */
+static int vec_cross (lua_State *L) {
+  float ax, ay, bx, by;
+  luaL_checkvector(L, 1, &ax, &ay);
+  luaL_checkvector(L, 2, &bx, &by);
+  lua_pushnumber(L, (lua_Number)(ax * by - ay * bx));
+  return 1;
+}
+
+
+static int vec_length (lua_State *L) {
+  float x, y;
+  luaL_checkvector(L, 1, &x, &y);
+  lua_pushnumber(L, l_mathop(sqrt)((lua_Number)x * x + (lua_Number)y * y));
+  return 1;
+}
+
+
+/* a zero vector stays zero */
+static int vec_normalize (lua_State *L) {
+  float x, y;
+  lua_Number len;
+  luaL_checkvector(L, 1, &x, &y);
+  len = l_mathop(sqrt)((lua_Number)x * x + (lua_Number)y * y);
+  if (len > 0)
+    lua_pushvector(L, (float)(x / len), (float)(y / len));
+  else
+    lua_pushvector(L, 0, 0);
+  return 1;
+}
+
+
+static int vec_lerp (lua_State *L) {
+  float ax, ay, bx, by;
+  float t;
+  luaL_checkvector(L, 1, &ax, &ay);
+  luaL_checkvector(L, 2, &bx, &by);
+  t = (float)luaL_checknumber(L, 3);
+  lua_pushvector(L, ax + (bx - ax) * t, ay + (by - ay) * t);
+  return 1;
+}
+
+
+static const luaL_Reg vec_funcs[] = {
+  {"new", vec_new},
+  {"unpack", vec_unpack},
+  {"dot", vec_dot},
+  {"cross", vec_cross},
+  {"length", vec_length},
+  {"normalize", vec_normalize},
+  {"lerp", vec_lerp},
+  {NULL, NULL}
+};
+
+
+LUAMOD_API int luaopen_vector (lua_State *L) {
+  luaL_newlib(L, vec_funcs);
+  return 1;
+}
+
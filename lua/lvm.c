@@ -285,6 +285,82 @@ static int floatforloop (StkId ra) {
 }
 
 
+/*
+** {==================================================================
+** Vectors
+** ===================================================================
+*/
+
+/* Read an arithmetic operand as a vector; numbers fill both components */
+static int tovecoperand (const TValue *o, float *v) {
+  lua_Number n;
+  if (ttisvector(o)) {
+    v[0] = vecvalue(o)[0];
+    v[1] = vecvalue(o)[1];
+    return 1;
+  }
+  else if (tonumberns(o, n)) {
+    v[0] = v[1] = cast(float, n);
+    return 1;
+  }
+  else return 0;
+}
+
+
+/*
+** Arithmetic on vectors, done componentwise in single precision: '+'
+** and '-' between two vectors, '*' and '/' between two vectors or a
+** vector and a number, and unary minus. At least one operand must be
+** a vector. Return 0 for anything else, which is left to metamethods.
+*/
+int luaV_arithvec (const TValue *p1, const TValue *p2, TValue *res,
+                   TMS event) {
+  float a[2], b[2];
+  if (!tovecoperand(p1, a) || !tovecoperand(p2, b))
+    return 0;
+  switch (event) {
+    case TM_ADD: case TM_SUB: {
+      if (!ttisvector(p1) || !ttisvector(p2))
+        return 0;  /* no adding numbers to vectors */
+      if (event == TM_SUB) {
+        b[0] = -b[0]; b[1] = -b[1];
+      }
+      setvecvalue(res, a[0] + b[0], a[1] + b[1]);
+      return 1;
+    }
+    case TM_MUL:
+      setvecvalue(res, a[0] * b[0], a[1] * b[1]);
+      return 1;
+    case TM_DIV:
+      setvecvalue(res, a[0] / b[0], a[1] / b[1]);
+      return 1;
+    case TM_UNM:
+      setvecvalue(res, -a[0], -a[1]);
+      return 1;
+    default: return 0;
+  }
+}
+
+
+/*
+** Components of a vector are read as fields 'x' and 'y'. Return 0 for
+** any other key, which is left to metamethods.
+*/
+static int getveccomponent (const TValue *t, const TValue *key,
+                            TValue *val) {
+  if (ttisshrstring(key) && tsvalue(key)->shrlen == 1) {
+    char c = *getshrstr(tsvalue(key));
+    if (c == 'x' || c == 'y') {
+      setfltvalue(val, cast_num(vecvalue(t)[c - 'x']));
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* }================================================================== */
+
+
 /*
 ** Finish the table access 'val = t[key]' and return the tag of the result.
 */
@@ -295,6 +371,8 @@ int luaV_finishget (lua_State *L, const TValue *t, TValue *key, StkId val,
   for (loop = 0; loop < MAXTAGLOOP; loop++) {
     if (tag == LUA_VNOTABLE) {  /* 't' is not a table? */
       lua_assert(!ttistable(t));
+      if (ttisvector(t) && getveccomponent(t, key, s2v(val)))
+        return LUA_VNUMFLT;
       tm = luaT_gettmbyobj(L, t, TM_INDEX);
       if (l_unlikely(notm(tm)))
         luaG_typeerror(L, t, "index");  /* no metamethod */
@@ -583,6 +661,8 @@ int luaV_equalobj (lua_State *L, const TValue *t1, const TValue *t2) {
     case LUA_VNUMFLT: return luai_numeq(fltvalue(t1), fltvalue(t2));
     case LUA_VLIGHTUSERDATA: return pvalue(t1) == pvalue(t2);
     case LUA_VLCF: return fvalue(t1) == fvalue(t2);
+    case LUA_VVECTOR: return (vecvalue(t1)[0] == vecvalue(t2)[0] &&
+                              vecvalue(t1)[1] == vecvalue(t2)[1]);
     case LUA_VSHRSTR: return eqshrstr(tsvalue(t1), tsvalue(t2));
     case LUA_VLNGSTR: return luaS_eqlngstr(tsvalue(t1), tsvalue(t2));
     case LUA_VUSERDATA: {
@@ -974,6 +1054,75 @@ void luaV_finishOp (lua_State *L) {
   op_arith_aux(L, v1, v2, iop, fop); }
 
 
+/*
+** {==================================================================
+** Quickening (optional, see LUA_QUICKEN): the float paths of generic
+** arithmetic instructions that find two floats rewrite the instruction
+** into its float-only variant. That variant checks just the two tags,
+** and on anything else rewrites itself back and runs the generic code.
+** Code of fixed prototypes may be read-only, so it is never rewritten.
+** ===================================================================
+*/
+
+#if !defined(LUA_QUICKEN)
+#define quicken(v1,v2,op)	((void)0)
+#else
+#define setcurrentop(op)  SET_OPCODE(cl->p->code[pc - cl->p->code - 1], op)
+
+#define quicken(v1,v2,op)  \
+  { if (ttisfloat(v1) && ttisfloat(v2) && !(cl->p->flag & PF_FIXED))  \
+      setcurrentop(op); }
+#endif
+
+
+/*
+** Arithmetic over integers and floats with a register or K second
+** operand 'v2e', which can be quickened into 'qop'.
+*/
+#define op_arithq(L,v2e,iop,fop,qop) {  \
+  StkId ra = RA(i); \
+  TValue *v1 = vRB(i);  \
+  TValue *v2 = v2e;  \
+  if (ttisinteger(v1) && ttisinteger(v2)) {  \
+    lua_Integer i1 = ivalue(v1); lua_Integer i2 = ivalue(v2);  \
+    pc++; setivalue(s2v(ra), iop(L, i1, i2));  \
+  }  \
+  else {  \
+    quicken(v1, v2, qop);  \
+    op_arithf_aux(L, v1, v2, fop); }}
+
+
+/*
+** Same as 'op_arithq' for float-only operations.
+*/
+#define op_arithfq(L,v2e,fop,qop) {  \
+  StkId ra = RA(i); \
+  TValue *v1 = vRB(i);  \
+  TValue *v2 = v2e;  \
+  quicken(v1, v2, qop);  \
+  op_arithf_aux(L, v1, v2, fop); }
+
+
+#if defined(LUA_QUICKEN)
+/*
+** Quickened float arithmetic; 'op' is the generic opcode to go back to,
+** and 'generic' its code.
+*/
+#define op_arithff(L,v2e,fop,op,generic) {  \
+  TValue *v1 = vRB(i);  \
+  TValue *v2 = v2e;  \
+  if (l_likely(ttisfloat(v1) && ttisfloat(v2))) {  \
+    StkId ra = RA(i); \
+    pc++; setfltvalue(s2v(ra), fop(L, fltvalue(v1), fltvalue(v2)));  \
+  }  \
+  else {  \
+    setcurrentop(op);  \
+    generic; }}
+#endif
+
+/* }================================================================== */
+
+
 /*
 ** Bitwise operations with constant operand.
 */
@@ -1066,6 +1215,9 @@ void luaV_finishOp (lua_State *L) {
 #define KC(i)	(k+GETARG_C(i))
 #define RKC(i)	((TESTARG_k(i)) ? k + GETARG_C(i) : s2v(base + GETARG_C(i)))
 
+/* inline cache of the key constant with index 'k' (see 'luaF_initcache') */
+#define IC(k)	(cl->p->icache[k])
+
 
 
 #define updatetrap(ci)  (trap = ci->u.l.trap)
@@ -1256,7 +1408,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *rc = KC(i);
         TString *key = tsvalue(rc);  /* key must be a short string */
         int tag;
-        luaV_fastget(upval, key, s2v(ra), luaH_getshortstr, tag);
+        luaV_fastgetcached(upval, key, s2v(ra), IC(GETARG_C(i)), tag);
         if (tagisempty(tag))
           Protect(luaV_finishget(L, upval, rc, ra, tag));
         vmbreak;
@@ -1294,8 +1446,9 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *rc = KC(i);
         TString *key = tsvalue(rc);  /* key must be a short string */
         int tag;
-        luaV_fastget(rb, key, s2v(ra), luaH_getshortstr, tag);
-        if (tagisempty(tag))
+        luaV_fastgetcached(rb, key, s2v(ra), IC(GETARG_C(i)), tag);
+        if (tagisempty(tag) &&  /* not a table hit nor a vector component? */
+            !(ttisvector(rb) && getveccomponent(rb, rc, s2v(ra))))
           Protect(luaV_finishget(L, rb, rc, ra, tag));
         vmbreak;
       }
@@ -1305,7 +1458,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *rb = KB(i);
         TValue *rc = RKC(i);
         TString *key = tsvalue(rb);  /* key must be a short string */
-        luaV_fastset(upval, key, rc, hres, luaH_psetshortstr);
+        luaV_fastsetcached(upval, key, rc, IC(GETARG_B(i)), hres);
         if (hres == HOK)
           luaV_finishfastset(L, upval, rc);
         else
@@ -1350,7 +1503,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *rb = KB(i);
         TValue *rc = RKC(i);
         TString *key = tsvalue(rb);  /* key must be a short string */
-        luaV_fastset(s2v(ra), key, rc, hres, luaH_psetshortstr);
+        luaV_fastsetcached(s2v(ra), key, rc, IC(GETARG_B(i)), hres);
         if (hres == HOK)
           luaV_finishfastset(L, s2v(ra), rc);
         else
@@ -1383,7 +1536,11 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *rc = RKC(i);
         TString *key = tsvalue(rc);  /* key must be a string */
         setobj2s(L, ra + 1, rb);
-        luaV_fastget(rb, key, s2v(ra), luaH_getstr, tag);
+        if (TESTARG_k(i) && ttisshrstring(rc)) {
+          luaV_fastgetcached(rb, key, s2v(ra), IC(GETARG_C(i)), tag);
+        }
+        else
+          luaV_fastget(rb, key, s2v(ra), luaH_getstr, tag);
         if (tagisempty(tag))
           Protect(luaV_finishget(L, rb, rc, ra, tag));
         vmbreak;
@@ -1393,15 +1550,15 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         vmbreak;
       }
       vmcase(OP_ADDK) {
-        op_arithK(L, l_addi, luai_numadd);
+        op_arithq(L, KC(i), l_addi, luai_numadd, OP_ADDKF);
         vmbreak;
       }
       vmcase(OP_SUBK) {
-        op_arithK(L, l_subi, luai_numsub);
+        op_arithq(L, KC(i), l_subi, luai_numsub, OP_SUBKF);
         vmbreak;
       }
       vmcase(OP_MULK) {
-        op_arithK(L, l_muli, luai_nummul);
+        op_arithq(L, KC(i), l_muli, luai_nummul, OP_MULKF);
         vmbreak;
       }
       vmcase(OP_MODK) {
@@ -1414,7 +1571,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         vmbreak;
       }
       vmcase(OP_DIVK) {
-        op_arithfK(L, luai_numdiv);
+        op_arithfq(L, KC(i), luai_numdiv, OP_DIVKF);
         vmbreak;
       }
       vmcase(OP_IDIVK) {
@@ -1455,15 +1612,15 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         vmbreak;
       }
       vmcase(OP_ADD) {
-        op_arith(L, l_addi, luai_numadd);
+        op_arithq(L, vRC(i), l_addi, luai_numadd, OP_ADDFF);
         vmbreak;
       }
       vmcase(OP_SUB) {
-        op_arith(L, l_subi, luai_numsub);
+        op_arithq(L, vRC(i), l_subi, luai_numsub, OP_SUBFF);
         vmbreak;
       }
       vmcase(OP_MUL) {
-        op_arith(L, l_muli, luai_nummul);
+        op_arithq(L, vRC(i), l_muli, luai_nummul, OP_MULFF);
         vmbreak;
       }
       vmcase(OP_MOD) {
@@ -1476,7 +1633,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         vmbreak;
       }
       vmcase(OP_DIV) {  /* float division (always with floats) */
-        op_arithf(L, luai_numdiv);
+        op_arithfq(L, vRC(i), luai_numdiv, OP_DIVFF);
         vmbreak;
       }
       vmcase(OP_IDIV) {  /* floor division */
@@ -1898,6 +2055,48 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         lua_assert(0);
         vmbreak;
       }
+#if defined(LUA_QUICKEN)
+      vmcase(OP_ADDFF) {
+        op_arithff(L, vRC(i), luai_numadd, OP_ADD,
+                   op_arith(L, l_addi, luai_numadd));
+        vmbreak;
+      }
+      vmcase(OP_SUBFF) {
+        op_arithff(L, vRC(i), luai_numsub, OP_SUB,
+                   op_arith(L, l_subi, luai_numsub));
+        vmbreak;
+      }
+      vmcase(OP_MULFF) {
+        op_arithff(L, vRC(i), luai_nummul, OP_MUL,
+                   op_arith(L, l_muli, luai_nummul));
+        vmbreak;
+      }
+      vmcase(OP_DIVFF) {
+        op_arithff(L, vRC(i), luai_numdiv, OP_DIV,
+                   op_arithf(L, luai_numdiv));
+        vmbreak;
+      }
+      vmcase(OP_ADDKF) {
+        op_arithff(L, KC(i), luai_numadd, OP_ADDK,
+                   op_arithK(L, l_addi, luai_numadd));
+        vmbreak;
+      }
+      vmcase(OP_SUBKF) {
+        op_arithff(L, KC(i), luai_numsub, OP_SUBK,
+                   op_arithK(L, l_subi, luai_numsub));
+        vmbreak;
+      }
+      vmcase(OP_MULKF) {
+        op_arithff(L, KC(i), luai_nummul, OP_MULK,
+                   op_arithK(L, l_muli, luai_nummul));
+        vmbreak;
+      }
+      vmcase(OP_DIVKF) {
+        op_arithff(L, KC(i), luai_numdiv, OP_DIVK,
+                   op_arithfK(L, luai_numdiv));
+        vmbreak;
+      }
+#endif
     }
   }
 }
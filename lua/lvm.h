@@ -91,6 +91,19 @@ typedef enum {
   else { luaH_fastgeti(hvalue(t), k, res, tag); }
 
 
+/*
+** Variants of 'luaV_fastget'/'luaV_fastset' for short-string keys with
+** an inline cache 'ic' (see 'luaH_fastgetshortstr')
+*/
+#define luaV_fastgetcached(t,k,res,ic,tag) \
+  if (!ttistable(t)) tag = LUA_VNOTABLE; \
+  else { luaH_fastgetshortstr(hvalue(t), k, res, ic, tag); }
+
+#define luaV_fastsetcached(t,k,val,ic,hres) \
+  if (!ttistable(t)) hres = HNOTATABLE; \
+  else { luaH_fastsetshortstr(hvalue(t), k, val, ic, hres); }
+
+
 #define luaV_fastset(t,k,val,hres,f) \
   (hres = (!ttistable(t) ? HNOTATABLE : f(hvalue(t), k, val)))
 
@@ -120,6 +133,8 @@ LUAI_FUNC int luaV_tointeger (const TValue *obj, lua_Integer *p, F2Imod mode);
 LUAI_FUNC int luaV_tointegerns (const TValue *obj, lua_Integer *p,
                                 F2Imod mode);
 LUAI_FUNC int luaV_flttointeger (lua_Number n, lua_Integer *p, F2Imod mode);
+LUAI_FUNC int luaV_arithvec (const TValue *p1, const TValue *p2,
+                             TValue *res, TMS event);
 LUAI_FUNC int luaV_finishget (lua_State *L, const TValue *t, TValue *key,
                                             StkId val, int tag);
 LUAI_FUNC void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
@@ -0,0 +1,193 @@
+-- Checks the bytecode optimizer: chunks loaded with mode "tO" (and their
+-- dumps) must behave exactly like the same chunks loaded with mode "t".
+-- Run with lua_tests (see CF_LUA_BUILD_LUA_TESTS); an optional argument
+-- sets how many random chunks to try.
+
+print "testing bytecode optimizer"
+
+-- Describes the outcome of a call; error messages are compared without
+-- their position and the variable names they mention, which may differ
+local function show (ok, ...)
+  local parts = { tostring(ok) }
+  for i = 1, select("#", ...) do
+    local v = select(i, ...)
+    if type(v) == "table" then
+      local sub = {}
+      for j = 1, #v do
+        local x = v[j]
+        sub[j] = math.type(x) and (math.type(x) .. ":" .. string.format("%.17g", x))
+                 or tostring(x)
+      end
+      v = "{" .. table.concat(sub, ",") .. "}"
+    elseif math.type(v) then
+      v = math.type(v) .. ":" .. string.format("%.17g", v)
+    elseif not ok then
+      v = string.gsub(tostring(v), "^.-:%d+: ", "")
+      v = string.gsub(v, " %(%a+ '[^']*'%)", "")
+    end
+    parts[#parts + 1] = tostring(v)
+  end
+  return table.concat(parts, " ")
+end
+
+
+-- Runs 'src' plain, optimized and optimized after a dump, with the
+-- same arguments, and checks that all three agree
+local function check (src, ...)
+  local f0 = assert(load(src, "=chunk", "t"))
+  local f1 = assert(load(src, "=chunk", "tO"))
+  local f2 = assert(load(string.dump(f1), "=chunk", "b"))
+  local r0 = show(pcall(f0, ...))
+  local r1 = show(pcall(f1, ...))
+  local r2 = show(pcall(f2, ...))
+  if r0 ~= r1 or r0 ~= r2 then
+    error(string.format("optimized code differs\n%s\n-- plain:  %s\n-- opt:    %s\n-- dumped: %s",
+                        src, r0, r1, r2))
+  end
+end
+
+
+-- a loop whose body always leaves through a goto keeps its OP_FORLOOP
+check([[
+local t = {1, 2, 3}
+for i = 1, 0 do if 0.0 then goto done end end
+if t[2] then goto done end
+error("x")
+::done::
+return "ok"
+]])
+check([[
+local s = 0
+for i = 1, 3 do s = s + i goto out end
+::out::
+for k, v in pairs({10}) do s = s + v goto out2 end
+::out2::
+return s
+]])
+check([[
+local a, b = ...
+for i = a, b do if i > 1 then goto done end end
+do return "looped" end
+::done::
+return "left"
+]], 1, 5)
+
+-- constant folding, copy propagation and dead branches
+check([[
+local dt <const> = 1 / 60
+local k, debug_mode = 4, false
+local x = ...
+local y = x * dt + k * 2
+if debug_mode then print("never") end
+local z = y
+return z, y, k .. "", -0.0, 1 // 0.0
+]], 3)
+check([[
+local a = ... local b = a local c = b
+a = 10
+return b, c, a
+]], {})
+
+
+-- random chunks
+local R = math.random
+math.randomseed(44)
+local nvars = 6
+local consts = { "0", "1", "2", "-3", "2.5", "0.5", "1e300", "'s'", "'10'",
+                 "true", "false", "nil", "7//2", "3.0", "-0.0", "0.0",
+                 "math.huge", "255", "1<<40" }
+local binops = { "+", "-", "*", "/", "//", "%", "^", "&", "|", "~", "<<",
+                 ">>", "..", "==", "~=", "<", "<=", ">", ">=", "and", "or" }
+local labels = 0
+
+local function var () return "v" .. R(1, nvars) end
+
+local function atom ()
+  local r = R(1, 10)
+  if r <= 5 then return var()
+  elseif r <= 9 then return consts[R(#consts)]
+  else return "up"
+  end
+end
+
+local function expr (d)
+  if d <= 0 or R(1, 3) == 1 then return atom() end
+  local r = R(1, 8)
+  if r == 1 then return "(not " .. expr(d - 1) .. ")"
+  elseif r == 2 then return "(- " .. expr(d - 1) .. ")"
+  elseif r == 3 then return "t[" .. R(1, 3) .. "]"
+  else return "(" .. expr(d - 1) .. " " .. binops[R(#binops)] .. " " .. expr(d - 1) .. ")"
+  end
+end
+
+local function stmt (d, out, ind)
+  local r = R(1, 21)
+  local function add (s) out[#out + 1] = ind .. s end
+  if r <= 4 then add(var() .. " = " .. expr(2))
+  elseif r == 5 and d > 0 then
+    add("if " .. expr(2) .. " then")
+    for _ = 1, R(1, 3) do stmt(d - 1, out, ind .. "  ") end
+    if R(1, 2) == 1 then add("else") stmt(d - 1, out, ind .. "  ") end
+    add("end")
+  elseif r == 6 and d > 0 then
+    add("for i = " .. R(-2, 2) .. ", " .. R(-1, 4) .. " do")
+    for _ = 1, R(1, 3) do stmt(d - 1, out, ind .. "  ") end
+    add("end")
+  elseif r == 7 then add("acc[#acc + 1] = " .. expr(2))
+  elseif r == 8 then add("t[" .. R(1, 3) .. "] = " .. expr(1))
+  elseif r == 9 and d > 0 then
+    add("local n = 0 while n < " .. R(0, 3) .. " do n = n + 1")
+    stmt(d - 1, out, ind .. "  ")
+    add("end")
+  elseif r == 10 then add("up = " .. expr(1))
+  elseif r == 11 then add("local " .. var() .. " = " .. expr(1))
+  elseif r == 13 then
+    add("do local function g () " .. var() .. " = " .. expr(1) ..
+        " return " .. var() .. " end acc[#acc + 1] = g() end")
+  elseif r == 14 and d > 0 then
+    add("for k, w in ipairs(t) do")
+    stmt(d - 1, out, ind .. "  ")
+    add("  acc[#acc + 1] = w")
+    add("end")
+  elseif r == 15 and d > 0 then
+    add("do local c = 0 repeat c = c + 1")
+    stmt(d - 1, out, ind .. "  ")
+    add("until c >= " .. R(1, 3) .. " or " .. expr(1) .. " end")
+  elseif r == 16 then add(var() .. ", " .. var() .. " = " .. var() .. ", " .. var())
+  elseif r == 17 then add("acc[#acc + 1] = select('#', ...) + " .. R(0, 2))
+  elseif r == 18 and d > 0 then
+    labels = labels + 1
+    local l = "top" .. labels
+    add("do local c = 0 ::" .. l .. ":: c = c + 1")
+    stmt(d - 1, out, ind .. "  ")
+    add("if c < " .. R(1, 3) .. " then goto " .. l .. " end end")
+  elseif r == 19 then add("acc[#acc + 1] = tostring(" .. expr(2) .. ")")
+  elseif r == 20 then add("if " .. expr(1) .. " then goto done end")
+  elseif r == 21 and d > 0 then
+    add("for i = " .. R(-1, 2) .. ", " .. R(-1, 2) .. " do")
+    add("  if " .. expr(1) .. " then goto done end")
+    stmt(d - 1, out, ind .. "  ")
+    add("  goto done")
+    add("end")
+  else add("do local v1 = " .. atom() .. " acc[#acc + 1] = v1 end")
+  end
+end
+
+local function chunk ()
+  local out = { "local up = 1", "local t = {1, 2.5, 'x'}", "local acc = {}" }
+  local decl = {}
+  for i = 1, nvars do decl[i] = "v" .. i end
+  out[#out + 1] = "local " .. table.concat(decl, ", ") .. " = ..."
+  out[#out + 1] = "do"
+  for _ = 1, R(3, 12) do stmt(3, out, "  ") end
+  out[#out + 1] = "end"
+  out[#out + 1] = "::done::"
+  out[#out + 1] = "return acc, " .. table.concat(decl, ", ") .. ", up, t[1], t[2], t[3]"
+  return table.concat(out, "\n")
+end
+
+for _ = 1, tonumber(arg and arg[1]) or 2000 do
+  check(chunk(), R(-2, 3), 2.5, nil, "7", false, R(0, 1) == 1)
+end
+
+print "OK"
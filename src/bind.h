@@ -64,8 +64,40 @@ extern "C" {
 //     return 0;
 // }
 
-// Call this once from main to bind everything.
-void REF_BindLua(lua_State* L);
+// Call this once from main to bind everything. With `headless` set, functions marked by
+// REF_HEADLESS_NOOP_BEGIN are bound as no-ops instead.
+void REF_BindLua(lua_State* L, bool headless = false);
+
+// Binds only the worker safe subset (see REF_WORKER_SAFE_BEGIN) plus all constants, for extra
+// lua_States running on other threads. Globals are not synced into worker states.
+void REF_BindLuaWorker(lua_State* L);
+
+// Folds every REF_CONSTANT into chunks loaded afterwards as a compile-time constant, so reading one
+// compiles to a LOADK/LOADI instead of a global table lookup. Both bind functions call this. Only
+// chunks that opt in by loading with a `K` in their mode are folded, e.g. `load(src, name, "tK")`,
+// unless `strict` folds every chunk. Assigning to a constant's name in a folded chunk is a compile
+// error, so its value can't change behind folded reads. The globals stay set for `_G` lookups and
+// chunks that aren't folded.
+void REF_FoldConstants(lua_State* L, bool strict = false);
+
+// Timeline tracing. While started, calls to bound functions, Lua callbacks made through
+// `REF_CallLuaFunction`, garbage collector steps and zones marked by REF_TraceBegin/REF_TraceEnd
+// are recorded into a ring buffer per thread, keeping the newest `events_per_thread` events (as
+// given to the first start).
+// `REF_TraceDump` writes them to `path` as Chrome trace event JSON, which can be opened in
+// chrome://tracing or https://ui.perfetto.dev. While stopped each hook costs a single branch.
+void REF_TraceStart(int events_per_thread = 1 << 16);
+void REF_TraceStop();
+bool REF_TraceDump(const char* path);
+
+// State images, to skip running a script's setup on every launch. `REF_ImageMark` must be called right
+// after binding the state to be saved, and `REF_ImageSave` later writes every value reachable in it
+// to a file. `REF_ImageLoad` restores that into a state bound the same way, by the same executable.
+// Both return NULL on success or an error message, and loading leaves the state untouched on error.
+// Coroutines and userdata other than buffers can't be saved. Only load images you made yourself.
+void REF_ImageMark(lua_State* L);
+const char* REF_ImageSave(lua_State* L, const char* path);
+const char* REF_ImageLoad(lua_State* L, const char* path);
 
 // Syncs all global variables to Lua.
 // Callable from Lua. Recommended to call this once per frame after gathering application inputs.
@@ -90,10 +122,43 @@ int REF_SyncGlobals(lua_State* L);
 // Expose a function to the reflection system. It will be bound to Lua with a custom name.
 #define REF_FUNCTION_EX(name, F)
 
+// Marks an already bound function as recordable. While a REF_CommandList is recording, calls
+// from Lua to recordable functions are captured into the list instead of running, and can be
+// replayed later entirely from C. Use the same name the function was bound with. Example:
+//
+//     REF_FUNCTION_EX(draw_line, cf_draw_line);
+//     REF_RECORDABLE(draw_line);
+#define REF_RECORDABLE(name)
+
+// Like REF_RECORDABLE, but parameters of type T* are recorded as a copy of the T they point to, for
+// state such as sprites that may change or be freed before the list is replayed.
+#define REF_RECORDABLE_COPY(name, T)
+
 // Wraps a manually written function and removes prefix "wrap_" from the name bound to Lua.
 // This means functions with the signature: int func(lua_State* L)
 #define REF_WRAP_MANUAL(F)
 
+// Functions and manual wraps bound between these two markers are also bound into worker states by
+// `REF_BindLuaWorker`. Only put functions in here that touch no shared state, so they're safe to
+// call from any thread at any time. Example:
+//
+//     REF_WORKER_SAFE_BEGIN();
+//     REF_FUNCTION(circle_to_circle);
+//     REF_FUNCTION(aabb_to_aabb);
+//     REF_WORKER_SAFE_END();
+#define REF_WORKER_SAFE_BEGIN()
+#define REF_WORKER_SAFE_END()
+
+// Functions and manual wraps bound between these two markers do nothing and return nothing when
+// bound by `REF_BindLua` in headless mode, for anything that needs a window, GPU or audio device.
+// Example:
+//
+//     REF_HEADLESS_NOOP_BEGIN();
+//     REF_FUNCTION(draw_line);
+//     REF_HEADLESS_NOOP_END();
+#define REF_HEADLESS_NOOP_BEGIN()
+#define REF_HEADLESS_NOOP_END()
+
 // Expose a constant to the reflection system. This is for defines, string literals, enums, etc.
 // The constant will be cast to 64-bit `uintptr_t`.
 #define REF_CONSTANT(C)
@@ -202,6 +267,12 @@ int REF_SyncGlobals(lua_State* L);
 #define REF_FLAT_FLOATS(T)
 #define REF_FLAT_INTS(T)
 
+// Structs of exactly two floats, such as 2d vectors, can instead be sent as a single Lua vector
+// value (see lua_pushvector). Vectors support + - * / and `v.x`/`v.y` natively in the VM, so math
+// on them in Lua allocates nothing. A vector parameter, return value, struct member or array
+// element takes one Lua value rather than two.
+#define REF_VECTOR(T)
+
 // Passing Lua callbacks into C functions is a little tricky, but not too difficult.
 // Bind a function to Lua to collect the callback name from Lua as a string. Store this
 // somewhere, for example as a userdata pointer. Pass a wrapper callback to your C code.
@@ -266,6 +337,7 @@ int REF_SyncGlobals(lua_State* L);
 #endif
 
 #include <utility>
+#include <atomic>
 
 // For debugging.
 inline void REF_PrintLuaStack(lua_State *L)
@@ -302,6 +374,11 @@ inline void REF_PrintLuaStack(lua_State *L)
 			case LUA_TLIGHTUSERDATA:
 				printf("[%d] LIGHTUSERDATA\n", i);
 				break;
+			case LUA_TVECTOR: {
+				float x, y;
+				lua_tovector(L, i, &x, &y);
+				printf("[%d] VECTOR(%f, %f)\n", i, x, y);
+			} break;
 			default:
 				printf("[%d] Unknown type\n", i);
 				break;
@@ -326,6 +403,30 @@ struct REF_List
 	T* next;
 };
 
+// Appends raw bytes, used for all binary encoding.
+void REF_EncodeBytes(Array<uint8_t>* out, const void* data, int size)
+{
+	int at = out->count();
+	out->ensure_capacity(at + size);
+	out->set_count(at + size);
+	CF_MEMCPY(out->data() + at, data, size);
+}
+
+template <typename T>
+void REF_EncodeValue(Array<uint8_t>* out, T v)
+{
+	REF_EncodeBytes(out, &v, sizeof(T));
+}
+
+// Reads raw bytes, returns false if the input is too short.
+bool REF_DecodeBytes(const uint8_t** p, const uint8_t* end, void* data, int size)
+{
+	if (end - *p < size) return false;
+	CF_MEMCPY(data, *p, size);
+	*p += size;
+	return true;
+}
+
 // An abstract representation of types in C++, used to write generic routines
 // for binding things to Lua.
 struct REF_Type
@@ -345,6 +446,22 @@ struct REF_Type
 	virtual int flattened_count() const { return 1; }
 	virtual const REF_Type* flattened_type() const { return this; }
 	void zero(void* v) const { CF_MEMSET(v, 0, size()); }
+
+	// Binary encoding, see REF_Encode. Defaults to the raw bytes, which suits numbers, flattened
+	// math types and handles. Pointers don't mean anything once saved, so they're written as nothing
+	// and read back as NULL. Decoding returns false on truncated input.
+	virtual void encode(Array<uint8_t>* out, const void* v) const
+	{
+		if (!is_pointer()) REF_EncodeBytes(out, v, size());
+	}
+	virtual bool decode(const uint8_t** p, const uint8_t* end, void* v) const
+	{
+		if (is_pointer()) {
+			zero(v);
+			return true;
+		}
+		return REF_DecodeBytes(p, end, v, size());
+	}
 };
 
 // Display a helpful message if a function or constant was attempted to be bound
@@ -588,6 +705,23 @@ struct char_ptr_Type : public REF_Type
 	virtual const REF_Type* address_type() const override { return NULL; }
 	virtual void lua_set(lua_State* L, void* v) const { lua_pushstring(L, *(char**)v); }
 	virtual void lua_get(lua_State* L, int index, void* v) const { String s = lua_tostring(L, index); *(char**)v = s.steal(); }
+	virtual void encode(Array<uint8_t>* out, const void* v) const override
+	{
+		const char* s = *(const char**)v;
+		uint32_t len = s ? (uint32_t)strlen(s) : 0;
+		REF_EncodeValue(out, len);
+		REF_EncodeBytes(out, s, (int)len);
+	}
+	virtual bool decode(const uint8_t** p, const uint8_t* end, void* v) const override
+	{
+		uint32_t len;
+		if (!REF_DecodeBytes(p, end, &len, sizeof(len)) || (uint32_t)(end - *p) < len) return false;
+		String s;
+		s.append((const char*)*p, (const char*)*p + len);
+		*p += len;
+		*(char**)v = s.steal();
+		return true;
+	}
 } g_char_ptr_Type;
 template <> struct REF_TypeGetter<char*> { static const REF_Type* get() { return &g_char_ptr_Type; } };
 template <> struct REF_TypeGetter<const char*> { static const REF_Type* get() { return &g_char_ptr_Type; } };
@@ -605,6 +739,15 @@ struct String_Type : public REF_Type
 	virtual const REF_Type* address_type() const override { return NULL; }
 	virtual void lua_set(lua_State* L, void* v) const { lua_pushstring(L, ((String*)v)->c_str()); }
 	virtual void lua_get(lua_State* L, int index, void* v) const { *(String*)v = String(lua_tostring(L, index)); }
+	virtual void encode(Array<uint8_t>* out, const void* v) const override { const char* s = ((const String*)v)->c_str(); g_char_ptr_Type.encode(out, &s); }
+	virtual bool decode(const uint8_t** p, const uint8_t* end, void* v) const override
+	{
+		char* s = NULL;
+		if (!g_char_ptr_Type.decode(p, end, &s)) return false;
+		*(String*)v = s;
+		sfree(s);
+		return true;
+	}
 } g_String_Type;
 template <> struct REF_TypeGetter<String> { static const REF_Type* get() { return &g_String_Type; } };
 
@@ -666,6 +809,7 @@ struct REF_Member
 	size_t array_count_offset = 0;
 	const REF_Type* array_count_type = NULL;
 	bool is_array_external = false;
+	int array_capacity = 0; // Element count of fixed size array members.
 
 	bool is_array() const { return array_count_name == NULL ? false : true; }
 };
@@ -802,6 +946,77 @@ struct REF_Struct : public REF_Type, REF_List<REF_Struct>
 			lua_pop(L, 1);
 		}
 	}
+
+	// True if member `i` holds the element count of an array member.
+	bool is_array_count(int i) const
+	{
+		const REF_Member* mptr = members();
+		for (int j = 0; j < member_count(); ++j) {
+			if (mptr[j].is_array() && mptr[j].array_count_offset == mptr[i].offset) return true;
+		}
+		return false;
+	}
+
+	// Members are written in declaration order with no names, so the layout of the REF_STRUCT
+	// must match between encoding and decoding. Arrays are written as a count then each element,
+	// and the member holding the count is skipped.
+	virtual void encode(Array<uint8_t>* out, const void* v) const override
+	{
+		int count = member_count();
+		const REF_Member* mptr = members();
+		for (int i = 0; i < count; ++i) {
+			const REF_Member* m = mptr + i;
+			const void* mv = (const void*)((uintptr_t)v + m->offset);
+			if (is_array_count(i)) continue;
+			if (m->is_array()) {
+				int n = 0;
+				REF_GetType<int>()->cast(&n, (void*)((uintptr_t)v + m->array_count_offset), m->array_count_type);
+				const REF_Type* element_type = m->is_array_external ? m->type->dereference_type() : m->type;
+				const uint8_t* data = m->is_array_external ? *(const uint8_t**)mv : (const uint8_t*)mv;
+				REF_EncodeValue(out, (uint32_t)n);
+				for (int j = 0; j < n; ++j) {
+					element_type->encode(out, data + j * element_type->size());
+				}
+			} else {
+				m->type->encode(out, mv);
+			}
+		}
+	}
+
+	// Expects `v` zero'd. On failure `v` is left safe to pass to cleanup().
+	virtual bool decode(const uint8_t** p, const uint8_t* end, void* v) const override
+	{
+		int count = member_count();
+		const REF_Member* mptr = members();
+		for (int i = 0; i < count; ++i) {
+			const REF_Member* m = mptr + i;
+			void* mv = (void*)((uintptr_t)v + m->offset);
+			if (is_array_count(i)) continue;
+			if (m->is_array()) {
+				uint32_t n;
+				if (!REF_DecodeBytes(p, end, &n, sizeof(n))) return false;
+				const REF_Type* element_type = m->is_array_external ? m->type->dereference_type() : m->type;
+				uint8_t* data = (uint8_t*)mv;
+				if (m->is_array_external) {
+					// Every element takes at least a byte, which bounds the allocation by the input size.
+					if (n > (uint32_t)(end - *p)) return false;
+					data = (uint8_t*)cf_alloc((size_t)n * element_type->size());
+					CF_MEMSET(data, 0, (size_t)n * element_type->size());
+					*(void**)mv = data;
+				} else if (n > (uint32_t)m->array_capacity) {
+					return false;
+				}
+				for (uint32_t j = 0; j < n; ++j) {
+					if (!element_type->decode(p, end, data + j * element_type->size())) return false;
+				}
+				int count = (int)n;
+				m->array_count_type->cast((void*)((uintptr_t)v + m->array_count_offset), &count, REF_GetType<int>());
+			} else {
+				if (!m->type->decode(p, end, mv)) return false;
+			}
+		}
+		return true;
+	}
 };
 
 // An abstract representation of a typed pointer, useful for implementing generic utilities
@@ -857,6 +1072,303 @@ void REF_LuaSet(lua_State* L, T* t)
 	REF_GetType<T>()->lua_set(L, (void*)t);
 }
 
+// A packed, resizable block of bytes owned by Lua as full userdata. Buffers move bulk data
+// between Lua and C in one call, instead of one table entry per element. The memory is
+// released when Lua garbage collects the buffer.
+struct REF_Buffer
+{
+	uint8_t* data;
+	int size;
+	int capacity;
+};
+
+// Returns false, leaving the buffer as is, for a negative size.
+bool REF_BufferResize(REF_Buffer* buf, int size)
+{
+	if (size < 0) return false;
+	if (size > buf->capacity) {
+		int capacity = buf->capacity > INT_MAX / 2 ? INT_MAX : max(size, buf->capacity * 2);
+		uint8_t* data = (uint8_t*)cf_alloc(capacity);
+		if (!data) return false;
+		if (buf->size) CF_MEMCPY(data, buf->data, buf->size);
+		cf_free(buf->data);
+		buf->data = data;
+		buf->capacity = capacity;
+	}
+	if (size > buf->size) CF_MEMSET(buf->data + buf->size, 0, size - buf->size);
+	buf->size = size;
+	return true;
+}
+
+// Pushes a new zero'd buffer onto the Lua stack.
+REF_Buffer* REF_LuaPushBuffer(lua_State* L, int size)
+{
+	REF_Buffer* buf = (REF_Buffer*)lua_newuserdata(L, sizeof(REF_Buffer));
+	CF_MEMSET(buf, 0, sizeof(REF_Buffer));
+	if (luaL_newmetatable(L, "REF_Buffer")) {
+		lua_pushcfunction(L, [](lua_State* L) -> int {
+			REF_Buffer* buf = (REF_Buffer*)lua_touserdata(L, 1);
+			cf_free(buf->data);
+			buf->data = NULL;
+			return 0;
+		});
+		lua_setfield(L, -2, "__gc");
+		lua_pushcfunction(L, [](lua_State* L) -> int {
+			lua_pushinteger(L, ((REF_Buffer*)lua_touserdata(L, 1))->size);
+			return 1;
+		});
+		lua_setfield(L, -2, "__len");
+	}
+	lua_setmetatable(L, -2);
+	REF_BufferResize(buf, size);
+	return buf;
+}
+
+// Returns NULL if the value at `index` is not a buffer.
+REF_Buffer* REF_LuaToBuffer(lua_State* L, int index)
+{
+	return (REF_Buffer*)luaL_testudata(L, index, "REF_Buffer");
+}
+
+// Reads a packed run of floats from Lua. Accepts a buffer without copying, or a string of packed
+// floats (e.g. from `string.pack`) or a flat table of numbers, which are copied into `scratch`.
+const float* REF_LuaGetFloats(lua_State* L, int index, int* count, Array<float>* scratch)
+{
+	if (REF_Buffer* buf = REF_LuaToBuffer(L, index)) {
+		*count = buf->size / (int)sizeof(float);
+		return (const float*)buf->data;
+	} else if (lua_type(L, index) == LUA_TSTRING) {
+		// Copied, as string bytes aren't aligned for floats.
+		size_t len = 0;
+		const char* s = lua_tolstring(L, index, &len);
+		int n = (int)(len / sizeof(float));
+		scratch->ensure_capacity(n);
+		scratch->set_count(n);
+		if (n) CF_MEMCPY(scratch->data(), s, n * sizeof(float));
+		*count = n;
+		return scratch->data();
+	} else {
+		luaL_argexpected(L, lua_istable(L, index), index, "buffer, string or table");
+		int n = (int)luaL_len(L, index);
+		scratch->ensure_capacity(n);
+		scratch->set_count(n);
+		for (int i = 0; i < n; ++i) {
+			lua_rawgeti(L, index, i + 1);
+			(*scratch)[i] = (float)lua_tonumber(L, -1);
+			lua_pop(L, 1);
+		}
+		*count = n;
+		return scratch->data();
+	}
+}
+
+// Deep copies Lua values between lua_States (or through any other byte stream) by encoding them into
+// bytes. Supports nil, booleans, numbers, vectors, strings, light userdata, buffers, and tables of those,
+// including tables referenced more than once or cyclically. Encoding errors with luaL_error for
+// anything else, such as functions. `seen` is the stack index of an empty scratch table.
+//
+// With `move_buffers` set, a buffer's memory is handed over instead of copied. Those bytes then hold a
+// raw pointer, so they must be decoded exactly once, in the same process. The source buffers are only
+// emptied by REF_LuaFinishMove once encoding has succeeded, so an error leaves them untouched. With
+// `persistent` set, light userdata is an error, as with bytes meant for a file.
+enum REF_ValueTag : uint8_t
+{
+	REF_VALUE_NIL,
+	REF_VALUE_FALSE,
+	REF_VALUE_TRUE,
+	REF_VALUE_INTEGER,
+	REF_VALUE_NUMBER,
+	REF_VALUE_STRING,
+	REF_VALUE_LIGHTUSERDATA,
+	REF_VALUE_BUFFER,
+	REF_VALUE_BUFFER_MOVED,
+	REF_VALUE_TABLE,
+	REF_VALUE_TABLE_REF,
+	REF_VALUE_TABLE_END,
+	REF_VALUE_VECTOR,
+};
+
+// Bounds recursion for deeply nested tables, so bad input can't overflow the C stack.
+#define REF_LUA_ENCODE_MAX_DEPTH 200
+
+void REF_LuaEncode(lua_State* L, int index, int seen, Array<uint8_t>* out, bool move_buffers, bool persistent = false, int depth = 0)
+{
+	index = lua_absindex(L, index);
+	switch (lua_type(L, index)) {
+	case LUA_TNONE:
+	case LUA_TNIL: out->add(REF_VALUE_NIL); break;
+	case LUA_TBOOLEAN: out->add(lua_toboolean(L, index) ? REF_VALUE_TRUE : REF_VALUE_FALSE); break;
+	case LUA_TLIGHTUSERDATA:
+		if (persistent) luaL_error(L, "Can not serialize light userdata.");
+		out->add(REF_VALUE_LIGHTUSERDATA);
+		REF_EncodeValue(out, lua_touserdata(L, index));
+		break;
+	case LUA_TNUMBER:
+		if (lua_isinteger(L, index)) {
+			out->add(REF_VALUE_INTEGER);
+			REF_EncodeValue(out, (int64_t)lua_tointeger(L, index));
+		} else {
+			out->add(REF_VALUE_NUMBER);
+			REF_EncodeValue(out, (double)lua_tonumber(L, index));
+		}
+		break;
+	case LUA_TVECTOR:
+	{
+		float xy[2];
+		lua_tovector(L, index, xy, xy + 1);
+		out->add(REF_VALUE_VECTOR);
+		REF_EncodeBytes(out, xy, sizeof(xy));
+	} break;
+	case LUA_TSTRING:
+	{
+		size_t len = 0;
+		const char* str = lua_tolstring(L, index, &len);
+		out->add(REF_VALUE_STRING);
+		REF_EncodeValue(out, (uint32_t)len);
+		REF_EncodeBytes(out, str, (int)len);
+	} break;
+	case LUA_TUSERDATA:
+	{
+		REF_Buffer* buf = REF_LuaToBuffer(L, index);
+		if (!buf) luaL_error(L, "Can not copy userdata between Lua states (only buffers).");
+		if (move_buffers && !persistent) {
+			// Remembered in `seen` to be emptied later. A buffer seen twice is only moved once.
+			REF_Buffer moved = { };
+			lua_pushvalue(L, index);
+			if (lua_rawget(L, seen) == LUA_TNIL) moved = *buf;
+			lua_pop(L, 1);
+			lua_pushvalue(L, index);
+			lua_pushboolean(L, 1);
+			lua_rawset(L, seen);
+			out->add(REF_VALUE_BUFFER_MOVED);
+			REF_EncodeValue(out, moved);
+		} else {
+			out->add(REF_VALUE_BUFFER);
+			REF_EncodeValue(out, (uint32_t)buf->size);
+			REF_EncodeBytes(out, buf->data, buf->size);
+		}
+	} break;
+	case LUA_TTABLE:
+	{
+		// Tables seen before are written as their index in order of first appearance.
+		lua_pushvalue(L, index);
+		if (lua_rawget(L, seen) == LUA_TNUMBER) {
+			out->add(REF_VALUE_TABLE_REF);
+			REF_EncodeValue(out, (uint32_t)lua_tointeger(L, -1));
+			lua_pop(L, 1);
+			break;
+		}
+		lua_pop(L, 1);
+		if (depth >= REF_LUA_ENCODE_MAX_DEPTH) luaL_error(L, "Table nested too deeply to copy.");
+		lua_pushvalue(L, index);
+		lua_pushinteger(L, (lua_Integer)lua_rawlen(L, seen) + 1);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, seen, (lua_Integer)lua_rawlen(L, seen) + 1); // Keeps the count in the array part.
+		lua_rawset(L, seen);
+		out->add(REF_VALUE_TABLE);
+		luaL_checkstack(L, 4, "Table nested too deeply to copy.");
+		lua_pushnil(L);
+		while (lua_next(L, index)) {
+			REF_LuaEncode(L, -2, seen, out, move_buffers, persistent, depth + 1);
+			REF_LuaEncode(L, -1, seen, out, move_buffers, persistent, depth + 1);
+			lua_pop(L, 1);
+		}
+		out->add(REF_VALUE_TABLE_END);
+	} break;
+	default: luaL_error(L, "Can not copy a %s between Lua states.", luaL_typename(L, index));
+	}
+}
+
+// Empties the buffers moved by REF_LuaEncode with `move_buffers` set, once their bytes are safely
+// encoded. `seen` is the same table passed to REF_LuaEncode.
+void REF_LuaFinishMove(lua_State* L, int seen)
+{
+	seen = lua_absindex(L, seen);
+	lua_pushnil(L);
+	while (lua_next(L, seen)) {
+		lua_pop(L, 1);
+		if (REF_Buffer* buf = REF_LuaToBuffer(L, -1)) CF_MEMSET(buf, 0, sizeof(REF_Buffer));
+	}
+}
+
+void REF_LuaDecodeBytes(lua_State* L, const uint8_t** p, const uint8_t* end, void* data, int size)
+{
+	if (!REF_DecodeBytes(p, end, data, size)) luaL_error(L, "Serialized data is truncated.");
+}
+
+// Pushes one value decoded from `*p` and advances `*p` past it, raising a Lua error if the bytes
+// between `*p` and `end` are truncated or malformed. `seen` is the stack index of an empty scratch
+// table, used to resolve repeated tables. Pointers (light userdata and moved buffers) are only
+// accepted when `trusted` is set, as they are never valid in bytes read from a file.
+void REF_LuaDecode(lua_State* L, const uint8_t** p, const uint8_t* end, int seen, bool trusted, int depth = 0)
+{
+	uint8_t tag;
+	REF_LuaDecodeBytes(L, p, end, &tag, 1);
+	switch (tag) {
+	case REF_VALUE_NIL: lua_pushnil(L); break;
+	case REF_VALUE_FALSE: lua_pushboolean(L, 0); break;
+	case REF_VALUE_TRUE: lua_pushboolean(L, 1); break;
+	case REF_VALUE_LIGHTUSERDATA:
+	{
+		if (!trusted) luaL_error(L, "Serialized data can not hold light userdata.");
+		void* v;
+		REF_LuaDecodeBytes(L, p, end, &v, sizeof(v));
+		lua_pushlightuserdata(L, v);
+	} break;
+	case REF_VALUE_INTEGER: { int64_t v; REF_LuaDecodeBytes(L, p, end, &v, sizeof(v)); lua_pushinteger(L, (lua_Integer)v); } break;
+	case REF_VALUE_NUMBER: { double v; REF_LuaDecodeBytes(L, p, end, &v, sizeof(v)); lua_pushnumber(L, (lua_Number)v); } break;
+	case REF_VALUE_VECTOR: { float v[2]; REF_LuaDecodeBytes(L, p, end, v, sizeof(v)); lua_pushvector(L, v[0], v[1]); } break;
+	case REF_VALUE_STRING:
+	{
+		uint32_t len;
+		REF_LuaDecodeBytes(L, p, end, &len, sizeof(len));
+		if ((uint32_t)(end - *p) < len) luaL_error(L, "Serialized data is truncated.");
+		lua_pushlstring(L, (const char*)*p, len);
+		*p += len;
+	} break;
+	case REF_VALUE_BUFFER:
+	{
+		uint32_t size;
+		REF_LuaDecodeBytes(L, p, end, &size, sizeof(size));
+		if ((uint32_t)(end - *p) < size) luaL_error(L, "Serialized data is truncated.");
+		REF_Buffer* buf = REF_LuaPushBuffer(L, (int)size);
+		if (size) CF_MEMCPY(buf->data, *p, size);
+		*p += size;
+	} break;
+	case REF_VALUE_BUFFER_MOVED:
+	{
+		if (!trusted) luaL_error(L, "Serialized data can not hold moved buffers.");
+		REF_Buffer* buf = REF_LuaPushBuffer(L, 0);
+		REF_LuaDecodeBytes(L, p, end, buf, sizeof(REF_Buffer));
+	} break;
+	case REF_VALUE_TABLE:
+	{
+		if (depth >= REF_LUA_ENCODE_MAX_DEPTH) luaL_error(L, "Table nested too deeply to copy.");
+		luaL_checkstack(L, 4, "Table nested too deeply to copy.");
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, seen, (lua_Integer)lua_rawlen(L, seen) + 1);
+		while (true) {
+			if (*p == end) luaL_error(L, "Serialized data is truncated.");
+			if (**p == REF_VALUE_TABLE_END) break;
+			REF_LuaDecode(L, p, end, seen, trusted, depth + 1);
+			REF_LuaDecode(L, p, end, seen, trusted, depth + 1);
+			if (lua_isnil(L, -2)) luaL_error(L, "Serialized table has a nil key.");
+			lua_rawset(L, -3);
+		}
+		++*p;
+	} break;
+	case REF_VALUE_TABLE_REF:
+	{
+		uint32_t i;
+		REF_LuaDecodeBytes(L, p, end, &i, sizeof(i));
+		if (i < 1 || i > (uint32_t)lua_rawlen(L, seen)) luaL_error(L, "Serialized table reference is out of range.");
+		lua_rawgeti(L, seen, i);
+	} break;
+	default: luaL_error(L, "Serialized data has an unknown tag (%d).", (int)tag); break;
+	}
+}
+
 // Captures array param+count indices for REF_FunctionSignature.
 struct REF_ArrayParameter
 {
@@ -937,6 +1449,21 @@ void REF_ApplyWrapper(void (*fn)(), REF_Variable ret, REF_Variable* params, int
 	REF_Apply((T)fn, ret, params, param_count);
 }
 
+// True while registering between REF_WORKER_SAFE_BEGIN and REF_WORKER_SAFE_END. Globals within
+// one translation unit are constructed in order, so this scopes over the functions in between.
+inline bool& REF_WorkerSafeScope()
+{
+	static bool scope;
+	return scope;
+}
+
+// True while registering between REF_HEADLESS_NOOP_BEGIN and REF_HEADLESS_NOOP_END.
+inline bool& REF_HeadlessNoopScope()
+{
+	static bool scope;
+	return scope;
+}
+
 // A generic functor object, used to easily bind functions to Lua.
 struct REF_Function : public REF_List<REF_Function>
 {
@@ -957,6 +1484,19 @@ struct REF_Function : public REF_List<REF_Function>
 	const char* name() const { return m_name; }
 	const REF_FunctionSignature& sig() const { return m_sig; }
 
+	// Set by REF_RECORDABLE.
+	bool recordable = false;
+
+	// Set by REF_RECORDABLE_COPY.
+	const REF_Type* record_copy_type = NULL;
+	int record_copy_size = 0;
+
+	// Set by REF_WORKER_SAFE_BEGIN.
+	bool worker_safe = REF_WorkerSafeScope();
+
+	// Set by REF_HEADLESS_NOOP_BEGIN.
+	bool headless_noop = REF_HeadlessNoopScope();
+
 private:
 	const char* m_name;
 	REF_FunctionSignature m_sig;
@@ -967,6 +1507,355 @@ private:
 template <typename... Params>
 int REF_CallLuaFunction(lua_State* L, const char* fn_name, std::initializer_list<REF_Variable> return_values, Params... params);
 
+// -------------------------------------------------------------------------------------------------
+// Tracing.
+
+#define REF_TRACE_MAX_DEPTH 64
+
+// A finished zone. Names must outlive the trace, so they're string literals, REF_Function names or
+// interned strings.
+struct REF_TraceEvent
+{
+	const char* name;
+	const char* category;
+	uint64_t start;
+	uint64_t end;
+};
+
+struct REF_TraceZone
+{
+	const char* name;
+	uint64_t start;
+};
+
+// Owned by one thread at a time. Only the owner writes events, publishing each one by bumping
+// `count`, so `REF_TraceDump` can read the ring from another thread.
+struct REF_TraceRing
+{
+	REF_TraceEvent* events;
+	uint64_t mask;
+	std::atomic<uint64_t> count;
+	std::atomic<bool> in_use;
+	int tid;
+	const char* thread_name;
+	REF_TraceZone zones[REF_TRACE_MAX_DEPTH];
+	int depth;
+	REF_TraceRing* next;
+};
+
+struct REF_TraceState
+{
+	std::atomic<bool> enabled;
+	std::atomic<REF_TraceRing*> rings;
+	std::atomic<int> tid_gen;
+	int events_per_thread;
+	uint64_t start_ticks;
+};
+
+inline REF_TraceState& REF_Trace()
+{
+	static REF_TraceState state;
+	return state;
+}
+
+inline bool REF_Tracing()
+{
+	return REF_Trace().enabled.load(std::memory_order_relaxed);
+}
+
+// The calling thread's ring, created on its first event.
+inline REF_TraceRing*& REF_TraceThreadRing()
+{
+	thread_local REF_TraceRing* ring;
+	return ring;
+}
+
+inline const char*& REF_TraceThreadNameRef()
+{
+	thread_local const char* name;
+	return name;
+}
+
+// Hands the ring back for reuse by later threads once the owning thread exits.
+struct REF_TraceThreadRelease
+{
+	REF_TraceRing* ring = NULL;
+	~REF_TraceThreadRelease() { if (ring) ring->in_use.store(false, std::memory_order_release); }
+};
+
+REF_TraceRing* REF_TraceGetRing()
+{
+	REF_TraceRing*& ring = REF_TraceThreadRing();
+	if (ring) return ring;
+	REF_TraceState& trace = REF_Trace();
+
+	// Claim the ring of a finished thread, or make a new one.
+	for (REF_TraceRing* r = trace.rings.load(std::memory_order_acquire); r && !ring; r = r->next) {
+		bool expected = false;
+		if (r->in_use.compare_exchange_strong(expected, true)) ring = r;
+	}
+	if (!ring) {
+		uint64_t capacity = 1;
+		while (capacity < (uint64_t)trace.events_per_thread) capacity <<= 1;
+		ring = (REF_TraceRing*)cf_calloc(sizeof(REF_TraceRing), 1);
+		ring->events = (REF_TraceEvent*)cf_alloc(sizeof(REF_TraceEvent) * capacity);
+		ring->mask = capacity - 1;
+		ring->in_use.store(true);
+		ring->tid = trace.tid_gen.fetch_add(1) + 1;
+		REF_TraceRing* head = trace.rings.load();
+		do {
+			ring->next = head;
+		} while (!trace.rings.compare_exchange_weak(head, ring));
+	}
+	ring->thread_name = REF_TraceThreadNameRef();
+	ring->depth = 0;
+	thread_local REF_TraceThreadRelease release;
+	release.ring = ring;
+	return ring;
+}
+
+// Names the calling thread in dumped traces.
+inline void REF_TraceThreadName(const char* name)
+{
+	REF_TraceThreadNameRef() = name;
+	if (REF_TraceThreadRing()) REF_TraceThreadRing()->thread_name = name;
+}
+
+inline void REF_TraceEmit(const char* name, const char* category, uint64_t start, uint64_t end)
+{
+	REF_TraceRing* ring = REF_TraceGetRing();
+	uint64_t n = ring->count.load(std::memory_order_relaxed);
+	ring->events[n & ring->mask] = { name, category, start, end };
+	ring->count.store(n + 1, std::memory_order_release);
+}
+
+// Opens a zone on the calling thread, closed by the next REF_TraceEnd.
+inline void REF_TraceBegin(const char* name)
+{
+	if (!REF_Tracing()) return;
+	REF_TraceRing* ring = REF_TraceGetRing();
+	if (ring->depth < REF_TRACE_MAX_DEPTH) ring->zones[ring->depth] = { name, get_ticks() };
+	++ring->depth;
+}
+
+inline void REF_TraceEnd()
+{
+	REF_TraceRing* ring = REF_TraceThreadRing();
+	if (!ring || !ring->depth) return;
+	int depth = --ring->depth;
+	if (depth < REF_TRACE_MAX_DEPTH && REF_Tracing()) {
+		REF_TraceEmit(ring->zones[depth].name, "zone", ring->zones[depth].start, get_ticks());
+	}
+}
+
+// Records its own lifetime as one event, if tracing was on when it was made.
+struct REF_TraceScope
+{
+	REF_TraceScope(const char* name, const char* category)
+		: name(name)
+		, category(category)
+		, start(REF_Tracing() ? get_ticks() : 0)
+	{
+	}
+	~REF_TraceScope() { if (start) REF_TraceEmit(name, category, start, get_ticks()); }
+
+	const char* name;
+	const char* category;
+	uint64_t start;
+};
+
+// Installed by REF_BindLua and REF_BindLuaWorker. Collector steps never nest, so one start per
+// thread is enough.
+inline void REF_TraceGCHook(lua_State* L, int begin)
+{
+	thread_local uint64_t start;
+	if (begin) {
+		start = REF_Tracing() ? get_ticks() : 0;
+	} else if (start) {
+		REF_TraceEmit("GC step", "GC", start, get_ticks());
+		start = 0;
+	}
+}
+
+void REF_TraceStart(int events_per_thread)
+{
+	REF_TraceState& trace = REF_Trace();
+	if (trace.enabled.load()) return;
+
+	// Rings are never resized, as other threads may be writing into them.
+	if (!trace.rings.load()) trace.events_per_thread = events_per_thread > 0 ? events_per_thread : 1;
+	trace.start_ticks = get_ticks();
+	trace.enabled.store(true);
+}
+
+void REF_TraceStop()
+{
+	REF_Trace().enabled.store(false);
+}
+
+void REF_TraceWriteString(FILE* fp, const char* s)
+{
+	fputc('"', fp);
+	for (; *s; ++s) {
+		unsigned char c = (unsigned char)*s;
+		if (c == '"' || c == '\\') fprintf(fp, "\\%c", c);
+		else if (c < 0x20) fprintf(fp, "\\u%04x", c);
+		else fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+bool REF_TraceDump(const char* path)
+{
+	FILE* fp = fopen(path, "wb");
+	if (!fp) return false;
+	REF_TraceState& trace = REF_Trace();
+	double to_us = 1000000.0 / (double)get_tick_frequency();
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"CF_Lua\"}}");
+	Array<REF_TraceEvent> events;
+	for (REF_TraceRing* ring = trace.rings.load(std::memory_order_acquire); ring; ring = ring->next) {
+		if (ring->thread_name) {
+			fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", ring->tid);
+			REF_TraceWriteString(fp, ring->thread_name);
+			fprintf(fp, "}}");
+		}
+
+		// Copy out the newest events, then drop any the owning thread may have overwritten meanwhile.
+		uint64_t capacity = ring->mask + 1;
+		uint64_t count = ring->count.load(std::memory_order_acquire);
+		uint64_t first = count > capacity ? count - capacity : 0;
+		events.clear();
+		for (uint64_t i = first; i < count; ++i) {
+			events.add(ring->events[i & ring->mask]);
+		}
+		uint64_t after = ring->count.load(std::memory_order_acquire);
+		uint64_t skip = after >= capacity && after - capacity + 1 > first ? after - capacity + 1 - first : 0;
+
+		for (int i = (int)min(skip, (uint64_t)events.count()); i < events.count(); ++i) {
+			const REF_TraceEvent& e = events[i];
+			if (e.start < trace.start_ticks) continue;
+			fprintf(fp, ",\n{\"name\":");
+			REF_TraceWriteString(fp, e.name);
+			fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}", e.category, (double)(e.start - trace.start_ticks) * to_us, (double)(e.end - e.start) * to_us, ring->tid);
+		}
+	}
+	fprintf(fp, "\n]}\n");
+	bool ok = !ferror(fp);
+	return fclose(fp) == 0 && ok;
+}
+
+// A flat buffer of recorded calls to bound functions. Each command is a header followed by the
+// parameter values exactly as they were read from Lua, with arrays and strings copied inline.
+// Replaying a list calls each function directly from C, skipping Lua marshaling entirely.
+struct REF_CommandList
+{
+	Array<uint8_t> bytes;
+	int command_count = 0;
+	bool valid = false;
+};
+
+struct REF_CommandHeader
+{
+	const REF_Function* fn;
+	int size;
+};
+
+// The list currently being recorded into, or NULL.
+inline REF_CommandList*& REF_Recording() { static REF_CommandList* p = NULL; return p; }
+
+// Pushes a new empty command list onto the Lua stack. Lists are full userdata, released when Lua
+// garbage collects them.
+REF_CommandList* REF_LuaPushCommandList(lua_State* L)
+{
+	REF_CommandList* list = (REF_CommandList*)lua_newuserdata(L, sizeof(REF_CommandList));
+	new (list) REF_CommandList;
+	if (luaL_newmetatable(L, "REF_CommandList")) {
+		lua_pushcfunction(L, [](lua_State* L) -> int {
+			((REF_CommandList*)lua_touserdata(L, 1))->~REF_CommandList();
+			return 0;
+		});
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	return list;
+}
+
+inline int REF_Align8(int size) { return (size + 7) & ~7; }
+
+// Appends bytes to the command list, padded to keep every value 8-byte aligned.
+void REF_CommandListWrite(REF_CommandList* list, const void* data, int size)
+{
+	int at = list->bytes.count();
+	int aligned = REF_Align8(size);
+	list->bytes.ensure_capacity(at + aligned);
+	list->bytes.set_count(at + aligned);
+	CF_MEMSET(list->bytes.data() + at, 0, aligned);
+	if (size) CF_MEMCPY(list->bytes.data() + at, data, size);
+}
+
+void REF_CommandListRecord(REF_CommandList* list, const REF_Function* fn, const REF_Variable* params, int param_count)
+{
+	int start = list->bytes.count();
+	REF_CommandHeader header = { fn, 0 };
+	REF_CommandListWrite(list, &header, sizeof(header));
+	for (int i = 0; i < param_count; ++i) {
+		const REF_Variable* p = params + i;
+		if (p->is_array) {
+			// Copy the array contents inline, the pointer is patched back up during replay.
+			int sz = p->array_count * p->type->dereference_type()->size();
+			REF_CommandListWrite(list, &sz, sizeof(sz));
+			REF_CommandListWrite(list, *(void**)p->v, sz);
+		} else if (p->type == fn->record_copy_type) {
+			const void* v = *(void**)p->v;
+			int sz = v ? fn->record_copy_size : 0;
+			REF_CommandListWrite(list, &sz, sizeof(sz));
+			REF_CommandListWrite(list, v, sz);
+		} else if (p->type == REF_GetType<char*>()) {
+			const char* s = *(char**)p->v;
+			int sz = s ? (int)strlen(s) + 1 : 0;
+			REF_CommandListWrite(list, &sz, sizeof(sz));
+			REF_CommandListWrite(list, s, sz);
+		} else {
+			REF_CommandListWrite(list, p->v, p->type->size());
+		}
+	}
+	((REF_CommandHeader*)(list->bytes.data() + start))->size = list->bytes.count() - start;
+	list->command_count++;
+}
+
+void REF_CommandListReplay(const REF_CommandList* list)
+{
+	const int max_params = 16;
+	const uint8_t* at = list->bytes.data();
+	const uint8_t* end = at + list->bytes.count();
+	while (at < end) {
+		const REF_CommandHeader* header = (const REF_CommandHeader*)at;
+		const REF_FunctionSignature& sig = header->fn->sig();
+		assert(sig.param_count <= max_params);
+		REF_Variable params[max_params];
+		const void* pointers[max_params];
+		const uint8_t* p = at + REF_Align8(sizeof(REF_CommandHeader));
+		for (int i = 0; i < sig.param_count; ++i) {
+			params[i].type = sig.params[i];
+			if (sig.param_is_array[i] || sig.params[i] == REF_GetType<char*>() || sig.params[i] == header->fn->record_copy_type) {
+				int sz = *(const int*)p;
+				p += REF_Align8(sizeof(int));
+				pointers[i] = sz ? p : NULL;
+				params[i].v = (void*)(pointers + i);
+				p += REF_Align8(sz);
+			} else {
+				params[i].v = (void*)p;
+				p += REF_Align8(params[i].type->size());
+			}
+		}
+
+		// Return values are discarded, a void REF_Variable ignores them.
+		header->fn->apply(REF_Variable(), params, sig.param_count);
+		at += header->size;
+	}
+}
+
 // The function used to automatically bind functions to Lua, capable of calling C-style functions.
 int REF_LuaCFunction(lua_State* L)
 {
@@ -1046,8 +1935,14 @@ int REF_LuaCFunction(lua_State* L)
 		}
 	}
 
-	// Call the actual function.
-	fn->apply(ret, params, param_count);
+	// Call the actual function, or capture it into the active command list.
+	bool record = fn->recordable && REF_Recording();
+	if (record) {
+		REF_CommandListRecord(REF_Recording(), fn, params, param_count);
+	} else {
+		REF_TraceScope trace(fn->name(), "C");
+		fn->apply(ret, params, param_count);
+	}
 
 	// Cleanup any temporary storage (curse you, c-style strings).
 	for (int i = 0; i < param_count; ++i) {
@@ -1063,8 +1958,10 @@ int REF_LuaCFunction(lua_State* L)
 		}
 	}
 
-	// Pass return value(s) back to Lua.
-	if (ret.type->size() > 0) {
+	// Pass return value(s) back to Lua. Recorded calls have nothing to return.
+	if (record) {
+		return 0;
+	} else if (ret.type->size() > 0) {
 		ret.type->lua_set(L, ret.v);
 		return ret.type->flattened_count();
 	} else {
@@ -1142,8 +2039,16 @@ int REF_CallLuaFunctionHelper(lua_State* L, const char* fn_name, const REF_Varia
 		}
 	}
 
-	// Call the actual Lua function.
-	if (lua_pcall(L, flattened_param_count, LUA_MULTRET, base) != LUA_OK) {
+	// Call the actual Lua function. Traced names are interned, as callers often pass temporaries.
+	int status;
+	{
+		REF_TraceScope trace(REF_Tracing() ? sintern(fn_name) : fn_name, "Lua");
+		status = lua_pcall(L, flattened_param_count, LUA_MULTRET, base);
+	}
+	if (status != LUA_OK) {
+		// An error between draw_record_begin and draw_record_end would otherwise leave the list
+		// recording, swallowing every later draw. The list stays invalid until re-recorded.
+		REF_Recording() = NULL;
 		REF_CallLuaFunction(L, "REF_ErrorHandler", { }, lua_tostring(L, -1));
 		return 0;
 	}
@@ -1221,6 +2126,50 @@ int REF_CallLuaFunction(lua_State* L, const char* fn_name)
 #define REF_FUNCTION_EX(name, F, ...) \
 	REF_Function g_##name##_REF_Function(#name, F, { __VA_ARGS__ })
 
+// Mark a bound function as recordable into a REF_CommandList.
+struct REF_Recordable
+{
+	REF_Recordable(REF_Function* fn) { fn->recordable = true; }
+	REF_Recordable(REF_Function* fn, const REF_Type* copy_type, int copy_size) : REF_Recordable(fn)
+	{
+		fn->record_copy_type = copy_type;
+		fn->record_copy_size = copy_size;
+	}
+};
+
+#undef REF_RECORDABLE
+#define REF_RECORDABLE(name) \
+	REF_Recordable g_##name##_REF_Recordable(&g_##name##_REF_Function)
+
+#undef REF_RECORDABLE_COPY
+#define REF_RECORDABLE_COPY(name, T) \
+	REF_Recordable g_##name##_REF_Recordable(&g_##name##_REF_Function, REF_GetType<T*>(), (int)sizeof(T))
+
+// Opens or closes a scope of worker safe functions.
+struct REF_ScopeToggle
+{
+	REF_ScopeToggle(bool& scope, bool on) { scope = on; }
+};
+
+#define REF_CONCAT_IMPL(a, b) a##b
+#define REF_CONCAT(a, b) REF_CONCAT_IMPL(a, b)
+
+#undef REF_WORKER_SAFE_BEGIN
+#define REF_WORKER_SAFE_BEGIN() \
+	REF_ScopeToggle REF_CONCAT(g_REF_WorkerSafeBegin, __LINE__)(REF_WorkerSafeScope(), true)
+
+#undef REF_WORKER_SAFE_END
+#define REF_WORKER_SAFE_END() \
+	REF_ScopeToggle REF_CONCAT(g_REF_WorkerSafeEnd, __LINE__)(REF_WorkerSafeScope(), false)
+
+#undef REF_HEADLESS_NOOP_BEGIN
+#define REF_HEADLESS_NOOP_BEGIN() \
+	REF_ScopeToggle REF_CONCAT(g_REF_HeadlessNoopBegin, __LINE__)(REF_HeadlessNoopScope(), true)
+
+#undef REF_HEADLESS_NOOP_END
+#define REF_HEADLESS_NOOP_END() \
+	REF_ScopeToggle REF_CONCAT(g_REF_HeadlessNoopEnd, __LINE__)(REF_HeadlessNoopScope(), false)
+
 // Automatically bind a constant to Lua.
 #undef REF_CONSTANT
 #define REF_CONSTANT(C) \
@@ -1278,6 +2227,27 @@ int REF_CallLuaFunction(lua_State* L, const char* fn_name)
 	REF_PTR_TYPE(T); \
 	REF_PTR_PTR_TYPE(T)
 
+#undef REF_VECTOR
+#define REF_VECTOR(T) \
+	struct T##_Type : public REF_Type \
+	{ \
+		static_assert(sizeof(T) == sizeof(float) * 2, "REF_VECTOR is for structs of two floats."); \
+		virtual const char* name() const override { return #T; } \
+		virtual int size() const override { return sizeof(T); } \
+		virtual double to_number(void* v) const override { return 0; } \
+		virtual String to_string(void* v) const override { return String(); } \
+		virtual void cast(void* to, void* from, const REF_Type* from_type) const override { assert(from_type == REF_GetType<T>()); *(T*)to = *(T*)from; } \
+		virtual void cleanup(void* v) const override { } \
+		virtual bool is_pointer() const override { return false; } \
+		virtual const REF_Type* dereference_type() const override { return NULL; } \
+		virtual const REF_Type* address_type() const override { return REF_GetType<T*>(); } \
+		virtual void lua_set(lua_State* L, void* v) const override { lua_pushvector(L, ((float*)v)[0], ((float*)v)[1]); } \
+		virtual void lua_get(lua_State* L, int index, void* v) const override { if (!lua_tovector(L, index, (float*)v, (float*)v + 1)) zero(v); } \
+	} g_##T##_Type; \
+	template <> struct REF_TypeGetter<T> { static const REF_Type* get() { return &g_##T##_Type; } }; \
+	REF_PTR_TYPE(T); \
+	REF_PTR_PTR_TYPE(T)
+
 #undef REF_FLAT_INTS
 #define REF_FLAT_INTS(T) \
 	struct T##_Type : public REF_Type \
@@ -1313,7 +2283,8 @@ int REF_CallLuaFunction(lua_State* L, const char* fn_name)
 #undef REF_MEMBER_ARRAY
 #define REF_MEMBER_ARRAY(m, count) \
 	{ #m, CF_OFFSET_OF(Type, m), REF_GetType<decltype(((Type*)0)->m)>(), \
-	  #count, CF_OFFSET_OF(Type, count), REF_GetType<decltype(((Type*)0)->count)>(), !std::is_array<decltype(((Type*)0)->m)>::value }
+	  #count, CF_OFFSET_OF(Type, count), REF_GetType<decltype(((Type*)0)->count)>(), !std::is_array<decltype(((Type*)0)->m)>::value, \
+	  (int)std::extent<decltype(((Type*)0)->m)>::value }
 
 // Represents a global variable, to be automatically bound to Lua, and sync'd
 // whenever REF_SyncGlobals is called.
@@ -1371,10 +2342,18 @@ struct REF_WrapBinder : REF_List<REF_WrapBinder>
 	}
 	const char* name;
 	int (*fn)(lua_State*);
+	bool worker_safe = REF_WorkerSafeScope();
+	bool headless_noop = REF_HeadlessNoopScope();
 };
 
+// Stands in for functions marked by REF_HEADLESS_NOOP_BEGIN when running headless.
+int REF_HeadlessNoop(lua_State* L)
+{
+	return 0;
+}
+
 // Bind everything to Lua.
-void REF_BindLua(lua_State* L)
+void REF_BindLua(lua_State* L, bool headless)
 {
 	// Bind all constants.
 	for (const REF_Constant* c = REF_Constant::head(); c; c = c->next) {
@@ -1384,14 +2363,18 @@ void REF_BindLua(lua_State* L)
 
 	// Bind all functions.
 	for (const REF_Function* fn = REF_Function::head(); fn; fn = fn->next) {
-		lua_pushlightuserdata(L, (void*)fn);
-		lua_pushcclosure(L, REF_LuaCFunction, 1);
+		if (headless && fn->headless_noop) {
+			lua_pushcfunction(L, REF_HeadlessNoop);
+		} else {
+			lua_pushlightuserdata(L, (void*)fn);
+			lua_pushcclosure(L, REF_LuaCFunction, 1);
+		}
 		lua_setglobal(L, fn->name());
 	}
 
 	// Bind all manually wrapped functions.
 	for (const REF_WrapBinder* w = REF_WrapBinder::head(); w; w = w->next) {
-		lua_pushcfunction(L, w->fn);
+		lua_pushcfunction(L, headless && w->headless_noop ? REF_HeadlessNoop : w->fn);
 		lua_setglobal(L, w->name);
 	}
 
@@ -1400,7 +2383,839 @@ void REF_BindLua(lua_State* L)
 
 	// Bind all globals.
 	REF_SyncGlobals(L);
+
+	REF_FoldConstants(L);
+	lua_setgchook(L, REF_TraceGCHook);
+}
+
+// Bind the worker safe subset to a worker state.
+void REF_BindLuaWorker(lua_State* L)
+{
+	for (const REF_Constant* c = REF_Constant::head(); c; c = c->next) {
+		c->type->lua_set(L, (void*)&c->constant);
+		lua_setglobal(L, c->name);
+	}
+
+	for (const REF_Function* fn = REF_Function::head(); fn; fn = fn->next) {
+		if (!fn->worker_safe) continue;
+		lua_pushlightuserdata(L, (void*)fn);
+		lua_pushcclosure(L, REF_LuaCFunction, 1);
+		lua_setglobal(L, fn->name());
+	}
+
+	for (const REF_WrapBinder* w = REF_WrapBinder::head(); w; w = w->next) {
+		if (!w->worker_safe) continue;
+		lua_pushcfunction(L, w->fn);
+		lua_setglobal(L, w->name);
+	}
+
+	// Workers report errors without killing the whole process.
+	luaL_dostring(L, "function REF_ErrorHandler(error_text) print(error_text) end");
+
+	REF_FoldConstants(L);
+	lua_setgchook(L, REF_TraceGCHook);
+}
+
+void REF_FoldConstants(lua_State* L, bool strict)
+{
+	lua_createtable(L, 0, 1024);
+	for (const REF_Constant* c = REF_Constant::head(); c; c = c->next) {
+		c->type->lua_set(L, (void*)&c->constant);
+		lua_setfield(L, -2, c->name);
+	}
+	lua_setconstants(L, -1, strict);
+	lua_pop(L, 1);
 }
 
 // Make this callable from Lua.
 REF_WRAP_MANUAL(REF_SyncGlobals);
+
+// -------------------------------------------------------------------------------------------------
+// State images
+
+// An image holds every value reachable from the registry and the basic type metatables. Objects that
+// already existed right after binding (library tables, bound functions, io's files, the main thread)
+// are "permanent": REF_ImageMark gives each one a path, such as a chain of keys from the registry,
+// and the image refers to them by that path, so loading finds the same objects in a freshly bound
+// state. Permanent tables also have their current contents saved, which replace the fresh ones.
+// Everything else is written out in full: Lua functions as bytecode with their upvalues (shared
+// upvalues stay shared), REF_WRAP_MANUAL functions and light userdata pointing at a REF_Function by
+// name. Other C functions are written by name too, see REF_ImagePushCFunctions, and any C function
+// without one can't be saved, nor can coroutines and userdata other than buffers.
+enum REF_ImageTag : uint8_t
+{
+	REF_IMAGE_PERMANENT = 64,
+	REF_IMAGE_OBJECT_REF,
+	REF_IMAGE_TABLE,
+	REF_IMAGE_LUA_FUNCTION,
+	REF_IMAGE_C_FUNCTION,
+	REF_IMAGE_C_CLOSURE,
+	REF_IMAGE_WRAP_FUNCTION,
+	REF_IMAGE_REF_FUNCTION,
+	REF_IMAGE_UPVALUE_JOIN,
+};
+
+#define REF_IMAGE_MAGIC "REFIMG02"
+
+// Pushes a value of `type` to get at the metatable shared by all values of that type. Returns false
+// for tables and full userdata, which have one metatable each.
+bool REF_ImagePushSample(lua_State* L, int type)
+{
+	switch (type) {
+	case LUA_TNIL: lua_pushnil(L); return true;
+	case LUA_TBOOLEAN: lua_pushboolean(L, 0); return true;
+	case LUA_TLIGHTUSERDATA: lua_pushlightuserdata(L, NULL); return true;
+	case LUA_TNUMBER: lua_pushinteger(L, 0); return true;
+	case LUA_TSTRING: lua_pushliteral(L, ""); return true;
+	case LUA_TFUNCTION: lua_pushcfunction(L, REF_HeadlessNoop); return true;
+	case LUA_TTHREAD: lua_pushthread(L); return true;
+	case LUA_TVECTOR: lua_pushvector(L, 0, 0); return true;
+	default: return false;
+	}
+}
+
+// C functions an image can name besides the permanent ones. Names start with '#', which no path does.
+struct REF_ImageCFunction
+{
+	const char* name;
+	lua_CFunction fn;
+};
+
+static const REF_ImageCFunction REF_IMAGE_C_FUNCTIONS[] = {
+	{ "#REF_LuaCFunction", REF_LuaCFunction },
+	{ "#REF_HeadlessNoop", REF_HeadlessNoop },
+};
+
+// Identifies the Lua version and the bindings, as functions are saved by their names.
+uint64_t REF_ImageStamp()
+{
+	uint64_t h = 14695981039346656037ull;
+	auto mix = [&](const void* data, size_t size) {
+		for (size_t i = 0; i < size; ++i) h = (h ^ ((const uint8_t*)data)[i]) * 1099511628211ull;
+	};
+	int64_t values[] = {
+		LUA_VERSION_NUM,
+		(int64_t)sizeof(void*),
+	};
+	mix(values, sizeof(values));
+	for (const REF_ImageCFunction& c : REF_IMAGE_C_FUNCTIONS) mix(c.name, strlen(c.name) + 1);
+	for (const REF_Function* fn = REF_Function::head(); fn; fn = fn->next) mix(fn->name(), strlen(fn->name()) + 1);
+	for (const REF_WrapBinder* w = REF_WrapBinder::head(); w; w = w->next) mix(w->name, strlen(w->name) + 1);
+	return h;
+}
+
+struct REF_ImageKey
+{
+	const char* step;
+	size_t size;
+	int index;
+};
+
+static int REF_ImageCompareKeys(const void* a, const void* b)
+{
+	const REF_ImageKey* x = (const REF_ImageKey*)a;
+	const REF_ImageKey* y = (const REF_ImageKey*)b;
+	int c = memcmp(x->step, y->step, min(x->size, y->size));
+	return c ? c : (x->size < y->size ? -1 : (x->size > y->size ? 1 : 0));
+}
+
+// Pushes a table giving each object reachable from the registry and the basic type metatables a path.
+// The walk is breadth first with keys in a fixed order, so identically bound states get identical
+// paths. Only tables (through keys that aren't objects) and metatables are followed.
+void REF_ImageWalk(lua_State* L)
+{
+	// The buffer metatable is made on first use, make sure it's there to be permanent. The same goes
+	// for the metatable of lauxlib's boxes, made when a luaL_Buffer first outgrows the stack.
+	REF_LuaPushBuffer(L, 0);
+	lua_pop(L, 1);
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	luaL_prepbuffsize(&b, LUAL_BUFFERSIZE + 1);
+	luaL_pushresult(&b);
+	lua_pop(L, 1);
+
+	lua_newtable(L);
+	int paths = lua_gettop(L);
+	lua_newtable(L);
+	int queue = lua_gettop(L);
+	int tail = 0;
+	auto visit = [&](int value, const char* path, size_t size) {
+		value = lua_absindex(L, value);
+		int type = lua_type(L, value);
+		if (type != LUA_TTABLE && type != LUA_TFUNCTION && type != LUA_TUSERDATA && type != LUA_TTHREAD) return;
+		lua_pushvalue(L, value);
+		if (lua_rawget(L, paths) == LUA_TNIL) {
+			lua_pushvalue(L, value);
+			lua_pushlstring(L, path, size);
+			lua_rawset(L, paths);
+			lua_pushvalue(L, value);
+			lua_rawseti(L, queue, ++tail);
+		}
+		lua_pop(L, 1);
+	};
+
+	lua_pushvalue(L, LUA_REGISTRYINDEX);
+	visit(-1, "R", 1);
+	lua_pop(L, 1);
+	for (int type = 0; type < LUA_NUMTYPES; ++type) {
+		if (!REF_ImagePushSample(L, type)) continue;
+		char path[2] = { 'T', (char)type };
+		if (lua_getmetatable(L, -1)) {
+			visit(-1, path, 2);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+
+	Array<uint8_t> step;
+	Array<REF_ImageKey> keys;
+	for (int head = 1; head <= tail; ++head) {
+		luaL_checkstack(L, 8, NULL);
+		lua_rawgeti(L, queue, head);
+		int object = lua_gettop(L);
+		lua_pushvalue(L, object);
+		lua_rawget(L, paths);
+		int path = lua_gettop(L);
+		if (lua_getmetatable(L, object)) {
+			lua_pushvalue(L, path);
+			lua_pushliteral(L, "m");
+			lua_concat(L, 2);
+			size_t size;
+			const char* s = lua_tolstring(L, -1, &size);
+			visit(-2, s, size);
+			lua_pop(L, 2);
+		}
+		if (lua_type(L, object) == LUA_TTABLE) {
+			// Each key's step is its path with the encoded key appended, and the steps give the order.
+			lua_newtable(L);
+			int steps = lua_gettop(L);
+			lua_newtable(L);
+			int key_values = lua_gettop(L);
+			keys.clear();
+			lua_pushnil(L);
+			while (lua_next(L, object)) {
+				lua_pop(L, 1);
+				int type = lua_type(L, -1);
+				if (type == LUA_TSTRING || type == LUA_TNUMBER || type == LUA_TBOOLEAN || type == LUA_TVECTOR) {
+					size_t size;
+					const char* s = lua_tolstring(L, path, &size);
+					step.clear();
+					REF_EncodeBytes(&step, s, (int)size);
+					step.add('k');
+					REF_LuaEncode(L, -1, 0, &step, false, true);
+					lua_pushlstring(L, (const char*)step.data(), step.count());
+					lua_rawseti(L, steps, keys.count() + 1);
+					lua_pushvalue(L, -1);
+					lua_rawseti(L, key_values, keys.count() + 1);
+					keys.add({ NULL, 0, keys.count() + 1 });
+				}
+			}
+			for (int i = 0; i < keys.count(); ++i) {
+				lua_rawgeti(L, steps, keys[i].index);
+				keys[i].step = lua_tolstring(L, -1, &keys[i].size); // Kept alive by `steps`.
+				lua_pop(L, 1);
+			}
+			qsort(keys.data(), keys.count(), sizeof(REF_ImageKey), REF_ImageCompareKeys);
+			for (int i = 0; i < keys.count(); ++i) {
+				lua_rawgeti(L, key_values, keys[i].index);
+				lua_rawget(L, object);
+				visit(-1, keys[i].step, keys[i].size);
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 2);
+		}
+		lua_pop(L, 2);
+	}
+	lua_pop(L, 1);
+}
+
+// Pushes a table naming the C functions an image can refer to, given the table of paths pushed by
+// REF_ImageWalk at `marks`. A permanent C function is named by its path, the first one in the order
+// of REF_ImageCompareKeys if it has several, and REF_IMAGE_C_FUNCTIONS are named as listed there. With
+// `by_name` the table maps every name to its function as light userdata, otherwise each function to
+// one name.
+void REF_ImagePushCFunctions(lua_State* L, int marks, bool by_name)
+{
+	marks = lua_absindex(L, marks);
+	lua_newtable(L);
+	int names = lua_gettop(L);
+	auto add = [&](lua_CFunction fn, const char* name, size_t size) {
+		if (by_name) {
+			lua_pushlstring(L, name, size);
+			lua_pushlightuserdata(L, (void*)(uintptr_t)fn);
+			lua_rawset(L, names);
+			return;
+		}
+		lua_pushlightuserdata(L, (void*)(uintptr_t)fn);
+		if (lua_rawget(L, names) == LUA_TSTRING) {
+			REF_ImageKey old, key = { name, size, 0 };
+			old.step = lua_tolstring(L, -1, &old.size);
+			if (old.step[0] == '#' || REF_ImageCompareKeys(&old, &key) <= 0) {
+				lua_pop(L, 1);
+				return;
+			}
+		}
+		lua_pop(L, 1);
+		lua_pushlightuserdata(L, (void*)(uintptr_t)fn);
+		lua_pushlstring(L, name, size);
+		lua_rawset(L, names);
+	};
+	for (const REF_ImageCFunction& c : REF_IMAGE_C_FUNCTIONS) add(c.fn, c.name, strlen(c.name));
+	lua_pushnil(L);
+	while (lua_next(L, marks)) {
+		if (lua_CFunction fn = lua_tocfunction(L, -2)) {
+			size_t size;
+			const char* path = lua_tolstring(L, -1, &size);
+			add(fn, path, size);
+		}
+		lua_pop(L, 1);
+	}
+}
+
+// Call right after binding a state that will be saved with REF_ImageSave.
+void REF_ImageMark(lua_State* L)
+{
+	REF_ImageWalk(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, "REF_ImageMarks");
+}
+
+struct REF_ImageWriter
+{
+	int marks;
+	int cfunctions; // C function -> name, see REF_ImagePushCFunctions.
+	int seen;       // Object -> index in order of first appearance.
+	int upvalues;   // Upvalue id -> index of the first function holding it * 256 + upvalue number.
+	int count = 0;
+	Array<uint8_t> paths; // Paths of the permanent objects used, in order.
+	int path_count = 0;
+	Array<uint8_t> out;
+};
+
+static int REF_ImageDumpWriter(lua_State* L, const void* p, size_t size, void* ud)
+{
+	if (size) REF_EncodeBytes((Array<uint8_t>*)ud, p, (int)size);
+	return 0;
+}
+
+void REF_ImageWrite(lua_State* L, REF_ImageWriter* w, int index, int depth = 0);
+
+// Writes the table's sizes, its metatable (or nil) and its entries, ended by REF_VALUE_TABLE_END.
+void REF_ImageWriteTable(lua_State* L, REF_ImageWriter* w, int index, int depth)
+{
+	// Sizes up front let the reader allocate each table once instead of growing it entry by entry.
+	uint32_t count = 0;
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		++count;
+		lua_pop(L, 1);
+	}
+	uint32_t array_count = (uint32_t)lua_rawlen(L, index);
+	if (array_count > count) array_count = count;
+	REF_EncodeValue(&w->out, array_count);
+	REF_EncodeValue(&w->out, count - array_count);
+	if (lua_getmetatable(L, index)) {
+		REF_ImageWrite(L, w, -1, depth + 1);
+		lua_pop(L, 1);
+	} else {
+		w->out.add(REF_VALUE_NIL);
+	}
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		if (!lua_rawequal(L, -1, w->marks)) {
+			REF_ImageWrite(L, w, -2, depth + 1);
+			REF_ImageWrite(L, w, -1, depth + 1);
+		}
+		lua_pop(L, 1);
+	}
+	w->out.add(REF_VALUE_TABLE_END);
+}
+
+void REF_ImageWrite(lua_State* L, REF_ImageWriter* w, int index, int depth)
+{
+	index = lua_absindex(L, index);
+	int type = lua_type(L, index);
+	if (type == LUA_TLIGHTUSERDATA) {
+		void* p = lua_touserdata(L, index);
+		for (const REF_Function* fn = REF_Function::head(); fn; fn = fn->next) {
+			if (fn != p) continue;
+			w->out.add(REF_IMAGE_REF_FUNCTION);
+			REF_EncodeValue(&w->out, (uint32_t)strlen(fn->name()));
+			REF_EncodeBytes(&w->out, fn->name(), (int)strlen(fn->name()));
+			return;
+		}
+		luaL_error(L, "Can not save light userdata in a state image.");
+	}
+	if (type != LUA_TSTRING && type != LUA_TTABLE && type != LUA_TFUNCTION && type != LUA_TUSERDATA && type != LUA_TTHREAD) {
+		REF_LuaEncode(L, index, 0, &w->out, false, true);
+		return;
+	}
+
+	// Objects (and strings, to store each only once) seen before are written as their index.
+	lua_pushvalue(L, index);
+	if (lua_rawget(L, w->seen) == LUA_TNUMBER) {
+		w->out.add(REF_IMAGE_OBJECT_REF);
+		REF_EncodeValue(&w->out, (uint32_t)lua_tointeger(L, -1));
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pop(L, 1);
+	if (depth >= REF_LUA_ENCODE_MAX_DEPTH) luaL_error(L, "Values nested too deeply to save in a state image.");
+	luaL_checkstack(L, 8, "Values nested too deeply to save in a state image.");
+	int id = ++w->count;
+	lua_pushvalue(L, index);
+	lua_pushinteger(L, id);
+	lua_rawset(L, w->seen);
+
+	if (type == LUA_TSTRING) {
+		REF_LuaEncode(L, index, 0, &w->out, false, true);
+		return;
+	}
+
+	lua_pushvalue(L, index);
+	if (lua_rawget(L, w->marks) == LUA_TSTRING) {
+		size_t size;
+		const char* path = lua_tolstring(L, -1, &size);
+		REF_EncodeValue(&w->paths, (uint32_t)size);
+		REF_EncodeBytes(&w->paths, path, (int)size);
+		lua_pop(L, 1);
+		w->out.add(REF_IMAGE_PERMANENT);
+		REF_EncodeValue(&w->out, (uint32_t)w->path_count++);
+		w->out.add(type == LUA_TTABLE);
+		if (type == LUA_TTABLE) REF_ImageWriteTable(L, w, index, depth);
+		return;
+	}
+	lua_pop(L, 1);
+
+	switch (type) {
+	case LUA_TTABLE:
+		w->out.add(REF_IMAGE_TABLE);
+		REF_ImageWriteTable(L, w, index, depth);
+		break;
+	case LUA_TFUNCTION:
+	{
+		int upvalue_count = 0;
+		while (lua_getupvalue(L, index, upvalue_count + 1)) {
+			lua_pop(L, 1);
+			++upvalue_count;
+		}
+		if (lua_CFunction fn = lua_tocfunction(L, index)) {
+			if (!upvalue_count) {
+				for (const REF_WrapBinder* b = REF_WrapBinder::head(); b; b = b->next) {
+					if (b->fn != fn) continue;
+					w->out.add(REF_IMAGE_WRAP_FUNCTION);
+					REF_EncodeValue(&w->out, (uint32_t)strlen(b->name));
+					REF_EncodeBytes(&w->out, b->name, (int)strlen(b->name));
+					return;
+				}
+			}
+			lua_pushlightuserdata(L, (void*)(uintptr_t)fn);
+			if (lua_rawget(L, w->cfunctions) != LUA_TSTRING) {
+				luaL_error(L, "Can not save a C function in a state image unless it's bound or was reachable when the state was marked.");
+			}
+			size_t size;
+			const char* name = lua_tolstring(L, -1, &size);
+			w->out.add(upvalue_count ? REF_IMAGE_C_CLOSURE : REF_IMAGE_C_FUNCTION);
+			REF_EncodeValue(&w->out, (uint32_t)size);
+			REF_EncodeBytes(&w->out, name, (int)size);
+			lua_pop(L, 1);
+			if (upvalue_count) {
+				w->out.add((uint8_t)upvalue_count);
+				for (int i = 1; i <= upvalue_count; ++i) {
+					lua_getupvalue(L, index, i);
+					REF_ImageWrite(L, w, -1, depth + 1);
+					lua_pop(L, 1);
+				}
+			}
+			break;
+		}
+		w->out.add(REF_IMAGE_LUA_FUNCTION);
+		int at = w->out.count();
+		REF_EncodeValue(&w->out, (uint32_t)0);
+		lua_pushvalue(L, index);
+		lua_dump(L, REF_ImageDumpWriter, &w->out, 0);
+		lua_pop(L, 1);
+		uint32_t size = (uint32_t)(w->out.count() - at - sizeof(uint32_t));
+		CF_MEMCPY(w->out.data() + at, &size, sizeof(size));
+		w->out.add((uint8_t)upvalue_count);
+		for (int i = 1; i <= upvalue_count; ++i) {
+			lua_pushlightuserdata(L, lua_upvalueid(L, index, i));
+			lua_pushvalue(L, -1);
+			if (lua_rawget(L, w->upvalues) == LUA_TNUMBER) {
+				lua_Integer shared = lua_tointeger(L, -1);
+				w->out.add(REF_IMAGE_UPVALUE_JOIN);
+				REF_EncodeValue(&w->out, (uint32_t)(shared / 256));
+				w->out.add((uint8_t)(shared % 256));
+				lua_pop(L, 2);
+				continue;
+			}
+			lua_pop(L, 1);
+			lua_pushinteger(L, (lua_Integer)id * 256 + i);
+			lua_rawset(L, w->upvalues);
+			lua_getupvalue(L, index, i);
+			REF_ImageWrite(L, w, -1, depth + 1);
+			lua_pop(L, 1);
+		}
+	} break;
+	case LUA_TUSERDATA:
+		if (!REF_LuaToBuffer(L, index)) luaL_error(L, "Can not save userdata in a state image (only buffers).");
+		REF_LuaEncode(L, index, 0, &w->out, false, true);
+		break;
+	default: luaL_error(L, "Can not save a %s in a state image.", luaL_typename(L, index));
+	}
+}
+
+static int REF_ImageSaveHelper(lua_State* L)
+{
+	REF_ImageWriter* w = (REF_ImageWriter*)lua_touserdata(L, 1);
+	if (lua_getfield(L, LUA_REGISTRYINDEX, "REF_ImageMarks") != LUA_TTABLE) {
+		return luaL_error(L, "Call REF_ImageMark right after binding a state that will be saved.");
+	}
+	w->marks = lua_gettop(L);
+	REF_ImagePushCFunctions(L, w->marks, false);
+	w->cfunctions = lua_gettop(L);
+	lua_newtable(L);
+	w->seen = lua_gettop(L);
+	lua_newtable(L);
+	w->upvalues = lua_gettop(L);
+	lua_pushvalue(L, LUA_REGISTRYINDEX);
+	REF_ImageWrite(L, w, -1);
+	lua_pop(L, 1);
+	for (int type = 0; type < LUA_NUMTYPES; ++type) {
+		if (!REF_ImagePushSample(L, type)) continue;
+		if (!lua_getmetatable(L, -1)) lua_pushnil(L);
+		REF_ImageWrite(L, w, -1);
+		lua_pop(L, 2);
+	}
+	return 0;
+}
+
+static const char* REF_ImageError(lua_State* L)
+{
+	static char error[256];
+	snprintf(error, sizeof(error), "%s", lua_tostring(L, -1) ? lua_tostring(L, -1) : "Unknown error.");
+	lua_pop(L, 1);
+	return error;
+}
+
+// Saves every value reachable from the registry of `L` to the file at `path`. The state should be
+// idle, e.g. after the main chunk ran. Returns NULL on success, otherwise an error message.
+const char* REF_ImageSave(lua_State* L, const char* path)
+{
+	REF_ImageWriter w;
+	int running = lua_gc(L, LUA_GCISRUNNING);
+	lua_gc(L, LUA_GCSTOP);
+	lua_pushcfunction(L, REF_ImageSaveHelper);
+	lua_pushlightuserdata(L, &w);
+	int status = lua_pcall(L, 1, 0, 0);
+	if (running) lua_gc(L, LUA_GCRESTART);
+	if (status != LUA_OK) return REF_ImageError(L);
+
+	FILE* fp = fopen(path, "wb");
+	if (!fp) return "Unable to open the image file for writing.";
+	uint64_t stamp = REF_ImageStamp();
+	uint32_t path_count = (uint32_t)w.path_count;
+	fwrite(REF_IMAGE_MAGIC, 1, 8, fp);
+	fwrite(&stamp, sizeof(stamp), 1, fp);
+	fwrite(&path_count, sizeof(path_count), 1, fp);
+	fwrite(w.paths.data(), 1, w.paths.count(), fp);
+	fwrite(w.out.data(), 1, w.out.count(), fp);
+	bool ok = !ferror(fp);
+	if (fclose(fp) != 0 || !ok) return "Unable to write the image file.";
+	return NULL;
+}
+
+struct REF_ImageReader
+{
+	const uint8_t* p;
+	const uint8_t* end;
+	int permanents; // Permanent objects of this state, in the order of the image's paths.
+	int cfunctions; // Name -> C function, see REF_ImagePushCFunctions.
+	int objects;    // Index -> object.
+	int patches;    // A permanent table, a table with its saved contents and its saved metatable, in turn.
+	int count = 0;
+	int patch_count = 0;
+};
+
+static void REF_ImageReadName(lua_State* L, REF_ImageReader* r)
+{
+	uint32_t size;
+	REF_LuaDecodeBytes(L, &r->p, r->end, &size, sizeof(size));
+	if ((uint32_t)(r->end - r->p) < size) luaL_error(L, "State image is truncated.");
+	lua_pushlstring(L, (const char*)r->p, size);
+	r->p += size;
+}
+
+static void REF_ImageRegister(lua_State* L, REF_ImageReader* r)
+{
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, r->objects, ++r->count);
+}
+
+void REF_ImageRead(lua_State* L, REF_ImageReader* r, int depth = 0);
+
+// Pushes a new table sized as written by REF_ImageWriteTable.
+static void REF_ImageNewTable(lua_State* L, REF_ImageReader* r)
+{
+	uint32_t array_count, hash_count;
+	REF_LuaDecodeBytes(L, &r->p, r->end, &array_count, sizeof(array_count));
+	REF_LuaDecodeBytes(L, &r->p, r->end, &hash_count, sizeof(hash_count));
+	// Each entry takes at least two bytes, which keeps a corrupt size from allocating wildly.
+	size_t left = (size_t)(r->end - r->p) / 2;
+	lua_createtable(L, (int)(array_count < left ? array_count : left), (int)(hash_count < left ? hash_count : left));
+}
+
+// Reads entries into the table on top of the stack, then pushes its metatable (or nil).
+void REF_ImageReadTable(lua_State* L, REF_ImageReader* r, int depth)
+{
+	int table = lua_gettop(L);
+	REF_ImageRead(L, r, depth + 1);
+	int metatable = lua_gettop(L);
+	if (!lua_isnil(L, metatable) && !lua_istable(L, metatable)) luaL_error(L, "State image has a bad metatable.");
+	while (true) {
+		if (r->p == r->end) luaL_error(L, "State image is truncated.");
+		if (*r->p == REF_VALUE_TABLE_END) break;
+		REF_ImageRead(L, r, depth + 1);
+		REF_ImageRead(L, r, depth + 1);
+		if (lua_isnil(L, -2)) luaL_error(L, "State image has a nil key.");
+		lua_rawset(L, table);
+	}
+	++r->p;
+}
+
+void REF_ImageRead(lua_State* L, REF_ImageReader* r, int depth)
+{
+	if (r->p == r->end) luaL_error(L, "State image is truncated.");
+	if (depth >= REF_LUA_ENCODE_MAX_DEPTH) luaL_error(L, "State image is nested too deeply.");
+	luaL_checkstack(L, 8, "State image is nested too deeply.");
+	uint8_t tag = *r->p;
+	switch (tag) {
+	case REF_VALUE_NIL:
+	case REF_VALUE_FALSE:
+	case REF_VALUE_TRUE:
+	case REF_VALUE_INTEGER:
+	case REF_VALUE_NUMBER:
+	case REF_VALUE_VECTOR:
+		REF_LuaDecode(L, &r->p, r->end, 0, false);
+		break;
+	case REF_VALUE_STRING:
+	case REF_VALUE_BUFFER:
+		REF_LuaDecode(L, &r->p, r->end, 0, false);
+		REF_ImageRegister(L, r);
+		break;
+	case REF_IMAGE_OBJECT_REF:
+	{
+		uint32_t i;
+		++r->p;
+		REF_LuaDecodeBytes(L, &r->p, r->end, &i, sizeof(i));
+		if (i < 1 || i > (uint32_t)r->count) luaL_error(L, "State image reference is out of range.");
+		if (lua_rawgeti(L, r->objects, i) == LUA_TBOOLEAN) luaL_error(L, "State image has a C closure holding itself.");
+	} break;
+	case REF_IMAGE_PERMANENT:
+	{
+		uint32_t i;
+		uint8_t has_contents;
+		++r->p;
+		REF_LuaDecodeBytes(L, &r->p, r->end, &i, sizeof(i));
+		REF_LuaDecodeBytes(L, &r->p, r->end, &has_contents, 1);
+		if (lua_rawgeti(L, r->permanents, (lua_Integer)i + 1) == LUA_TNIL) luaL_error(L, "State image permanent is out of range.");
+		REF_ImageRegister(L, r);
+		if (has_contents) {
+			if (!lua_istable(L, -1)) luaL_error(L, "State image doesn't match the bindings.");
+			// The contents go into a plain table, as a metatable with __gc would make it finalized.
+			// Reserve the slots up front, as the contents may hold permanent tables of their own.
+			int patch = r->patch_count;
+			r->patch_count += 3;
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, r->patches, patch + 1);
+			REF_ImageNewTable(L, r);
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, r->patches, patch + 2);
+			REF_ImageReadTable(L, r, depth);
+			lua_rawseti(L, r->patches, patch + 3);
+			lua_pop(L, 1);
+		}
+	} break;
+	case REF_IMAGE_TABLE:
+		++r->p;
+		REF_ImageNewTable(L, r);
+		REF_ImageRegister(L, r);
+		REF_ImageReadTable(L, r, depth);
+		lua_setmetatable(L, -2);
+		break;
+	case REF_IMAGE_LUA_FUNCTION:
+	{
+		uint32_t size;
+		++r->p;
+		REF_LuaDecodeBytes(L, &r->p, r->end, &size, sizeof(size));
+		if ((uint32_t)(r->end - r->p) < size) luaL_error(L, "State image is truncated.");
+		if (luaL_loadbufferx(L, (const char*)r->p, size, "=image", "b") != LUA_OK) lua_error(L);
+		r->p += size;
+		int fn = lua_gettop(L);
+		REF_ImageRegister(L, r);
+		uint8_t upvalue_count;
+		REF_LuaDecodeBytes(L, &r->p, r->end, &upvalue_count, 1);
+		for (int i = 1; i <= upvalue_count; ++i) {
+			if (r->p < r->end && *r->p == REF_IMAGE_UPVALUE_JOIN) {
+				uint32_t other;
+				uint8_t n;
+				++r->p;
+				REF_LuaDecodeBytes(L, &r->p, r->end, &other, sizeof(other));
+				REF_LuaDecodeBytes(L, &r->p, r->end, &n, 1);
+				if (other < 1 || other > (uint32_t)r->count || lua_rawgeti(L, r->objects, other) != LUA_TFUNCTION || lua_iscfunction(L, -1) || !lua_getupvalue(L, -1, n)) {
+					luaL_error(L, "State image has a bad shared upvalue.");
+				}
+				lua_pop(L, 1);
+				if (!lua_getupvalue(L, fn, i)) luaL_error(L, "State image has a bad upvalue.");
+				lua_pop(L, 1);
+				lua_upvaluejoin(L, fn, i, -1, n);
+				lua_pop(L, 1);
+			} else {
+				REF_ImageRead(L, r, depth + 1);
+				if (!lua_setupvalue(L, fn, i)) luaL_error(L, "State image has a bad upvalue.");
+			}
+		}
+	} break;
+	case REF_IMAGE_C_FUNCTION:
+	case REF_IMAGE_C_CLOSURE:
+	{
+		++r->p;
+		REF_ImageReadName(L, r);
+		if (lua_rawget(L, r->cfunctions) != LUA_TLIGHTUSERDATA) luaL_error(L, "State image refers to a C function that isn't bound.");
+		lua_CFunction fn = (lua_CFunction)(uintptr_t)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		if (tag == REF_IMAGE_C_FUNCTION) {
+			lua_pushcfunction(L, fn);
+			REF_ImageRegister(L, r);
+			break;
+		}
+		int id = ++r->count;
+		lua_pushboolean(L, 0); // Placeholder until the upvalues are read.
+		lua_rawseti(L, r->objects, id);
+		uint8_t upvalue_count;
+		REF_LuaDecodeBytes(L, &r->p, r->end, &upvalue_count, 1);
+		luaL_checkstack(L, upvalue_count, "State image has too many upvalues.");
+		for (int i = 0; i < upvalue_count; ++i) REF_ImageRead(L, r, depth + 1);
+		lua_pushcclosure(L, fn, upvalue_count);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, r->objects, id);
+	} break;
+	case REF_IMAGE_WRAP_FUNCTION:
+	case REF_IMAGE_REF_FUNCTION:
+	{
+		++r->p;
+		REF_ImageReadName(L, r);
+		const char* name = lua_tostring(L, -1);
+		bool found = false;
+		if (tag == REF_IMAGE_WRAP_FUNCTION) {
+			for (const REF_WrapBinder* b = REF_WrapBinder::head(); b && !found; b = b->next) {
+				if (strcmp(b->name, name)) continue;
+				lua_pushcfunction(L, b->fn);
+				found = true;
+			}
+		} else {
+			for (const REF_Function* fn = REF_Function::head(); fn && !found; fn = fn->next) {
+				if (strcmp(fn->name(), name)) continue;
+				lua_pushlightuserdata(L, (void*)fn);
+				found = true;
+			}
+		}
+		if (!found) luaL_error(L, "State image refers to %s, which isn't bound.", name);
+		lua_remove(L, -2);
+		if (tag == REF_IMAGE_WRAP_FUNCTION) REF_ImageRegister(L, r);
+	} break;
+	default: luaL_error(L, "State image has an unknown tag (%d).", (int)tag); break;
+	}
+}
+
+static int REF_ImageLoadHelper(lua_State* L)
+{
+	REF_ImageReader* r = (REF_ImageReader*)lua_touserdata(L, 1);
+
+	// Find this state's permanent objects by the paths the image uses.
+	REF_ImageWalk(L);
+	int by_object = lua_gettop(L);
+	lua_newtable(L);
+	int by_path = lua_gettop(L);
+	lua_pushnil(L);
+	while (lua_next(L, by_object)) {
+		lua_pushvalue(L, -2);
+		lua_rawset(L, by_path);
+	}
+	lua_newtable(L);
+	r->permanents = lua_gettop(L);
+	uint32_t path_count;
+	REF_LuaDecodeBytes(L, &r->p, r->end, &path_count, sizeof(path_count));
+	for (uint32_t i = 0; i < path_count; ++i) {
+		REF_ImageReadName(L, r);
+		if (lua_rawget(L, by_path) == LUA_TNIL) luaL_error(L, "State image doesn't match the bindings.");
+		lua_rawseti(L, r->permanents, (lua_Integer)i + 1);
+	}
+	REF_ImagePushCFunctions(L, by_object, true);
+	r->cfunctions = lua_gettop(L);
+	lua_newtable(L);
+	r->objects = lua_gettop(L);
+	lua_newtable(L);
+	r->patches = lua_gettop(L);
+
+	// Read and check everything before changing anything, so a bad image leaves the state as it was.
+	// Each type's metatable is kept on the stack above a sample value to set it on.
+	REF_ImageRead(L, r);
+	lua_pop(L, 1);
+	int metatables = lua_gettop(L) + 1;
+	for (int type = 0; type < LUA_NUMTYPES; ++type) {
+		if (!REF_ImagePushSample(L, type)) continue;
+		REF_ImageRead(L, r);
+		if (!lua_isnil(L, -1) && !lua_istable(L, -1)) luaL_error(L, "State image has a bad metatable.");
+	}
+	if (r->p != r->end) luaL_error(L, "State image has trailing bytes.");
+	luaL_checkstack(L, 4, NULL);
+
+	// Nothing below can fail: permanent tables swap entries with their saved contents rather than
+	// being cleared and refilled, which could run out of memory halfway.
+	for (int i = 1; i < r->patch_count; i += 3) {
+		lua_rawgeti(L, r->patches, i);
+		lua_rawgeti(L, r->patches, i + 1);
+		lua_swaptables(L, -2, -1);
+		lua_rawgeti(L, r->patches, i + 2);
+		lua_setmetatable(L, -3);
+		lua_pop(L, 2);
+	}
+	for (int top = lua_gettop(L), at = metatables; at < top; at += 2) {
+		lua_pushvalue(L, at + 1);
+		lua_setmetatable(L, at);
+	}
+	return 0;
+}
+
+// Restores a state saved by REF_ImageSave into `L`, which must be bound exactly like the saved state
+// was when REF_ImageMark was called. Returns NULL on success, otherwise an error message, leaving `L`
+// as it was.
+const char* REF_ImageLoad(lua_State* L, const char* path)
+{
+	FILE* fp = fopen(path, "rb");
+	if (!fp) return "Unable to open the image file.";
+	Array<uint8_t> data;
+	uint8_t chunk[4096];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) REF_EncodeBytes(&data, chunk, (int)n);
+	fclose(fp);
+
+	uint64_t stamp;
+	const uint8_t* p = data.data();
+	const uint8_t* end = p + data.count();
+	if (end - p < 8 || memcmp(p, REF_IMAGE_MAGIC, 8)) return "Not a state image.";
+	p += 8;
+	if (!REF_DecodeBytes(&p, end, &stamp, sizeof(stamp)) || stamp != REF_ImageStamp()) return "State image was saved with other bindings.";
+
+	REF_ImageReader r;
+	r.p = p;
+	r.end = end;
+	int running = lua_gc(L, LUA_GCISRUNNING);
+	lua_gc(L, LUA_GCSTOP);
+	lua_pushcfunction(L, REF_ImageLoadHelper);
+	lua_pushlightuserdata(L, &r);
+	int status = lua_pcall(L, 1, 0, 0);
+	if (running) lua_gc(L, LUA_GCRESTART);
+	if (status != LUA_OK) return REF_ImageError(L);
+	return NULL;
+}
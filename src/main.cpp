@@ -91,23 +91,85 @@ int main(int argc, char* argv[])
 	b2SetAssertFcn(b2_assert_override);
 	cf_set_assert_handler(cf_assert_override);
 
+	// Optional flags: `--headless` runs without a window, GPU or audio, and `--fast` steps headless
+	// runs and replays as fast as possible instead of in real time. `--record file` and
+	// `--replay file` capture or play back input and timing, quitting when a replay is done.
+	// `--trace file` records a timeline of the whole run and writes it out as Chrome trace JSON.
+	// `--strict-constants` folds bound constants into every chunk, making assigning to one a compile
+	// error (see REF_FoldConstants).
+	// `--optimize` runs every compiled chunk through the bytecode optimizer (see lua_setoptimize).
+	// `--save-image file` writes the state left by running main.lua's top level to a file, and
+	// `--load-image file` restores it instead of running main.lua again (see REF_ImageSave).
+	const char* path_to_main_lua = NULL;
+	const char* record_path = NULL;
+	const char* replay_path = NULL;
+	const char* trace_path = NULL;
+	const char* save_image_path = NULL;
+	const char* load_image_path = NULL;
+	bool strict_constants = false;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--headless")) g_headless = true;
+		else if (!strcmp(argv[i], "--fast")) g_headless_fast = true;
+		else if (!strcmp(argv[i], "--record") && i + 1 < argc) record_path = argv[++i];
+		else if (!strcmp(argv[i], "--replay") && i + 1 < argc) replay_path = argv[++i];
+		else if (!strcmp(argv[i], "--trace") && i + 1 < argc) trace_path = argv[++i];
+		else if (!strcmp(argv[i], "--strict-constants")) strict_constants = true;
+		else if (!strcmp(argv[i], "--optimize")) g_optimize = true;
+		else if (!strcmp(argv[i], "--save-image") && i + 1 < argc) save_image_path = argv[++i];
+		else if (!strcmp(argv[i], "--load-image") && i + 1 < argc) load_image_path = argv[++i];
+		else if (!path_to_main_lua) path_to_main_lua = argv[i];
+	}
+
+	REF_TraceThreadName("Main");
+	if (trace_path) REF_TraceStart();
+
 	::L = luaL_newstate();
+	lua_setoptimize(L, g_optimize);
 	luaL_openlibs(L);
-	REF_BindLua(L);
+	REF_BindLua(L, g_headless);
+	if (strict_constants) REF_FoldConstants(L, true);
+	if (save_image_path) REF_ImageMark(L);
 
-	if (argc < 2) {
+	if (!path_to_main_lua) {
 		printf("You should supply the path to your `main.lua` file as the first command line parameter.\n");
 		printf("Now assuming you've run from MSVC's Debug/Release folder for testing CF_Lua development.\n");
+		path_to_main_lua = "../../src/main.lua";
 	}
 
-	const char* path_to_main_lua = argc < 2 ? "../../src/main.lua" : argv[1];
-	if (luaL_dofile(L, path_to_main_lua)) {
-		fprintf(stderr, lua_tostring(L, -1));
+	if (record_path && !input_record_start(record_path)) {
+		fprintf(stderr, "Unable to record to %s.\n", record_path);
 		return -1;
 	}
+	if (replay_path) {
+		if (const char* error = input_replay_begin(replay_path, true)) {
+			fprintf(stderr, "%s (%s)\n", error, replay_path);
+			return -1;
+		}
+	}
+
+	const char* image_error = load_image_path ? REF_ImageLoad(L, load_image_path) : "";
+	if (image_error) {
+		if (*image_error) fprintf(stderr, "%s (%s) Running %s instead.\n", image_error, load_image_path, path_to_main_lua);
+		if (luaL_dofile(L, path_to_main_lua)) {
+			fprintf(stderr, lua_tostring(L, -1));
+			return -1;
+		}
+	}
+	if (save_image_path) {
+		if (const char* error = REF_ImageSave(L, save_image_path)) {
+			fprintf(stderr, "%s (%s)\n", error, save_image_path);
+		}
+	}
 
 	REF_CallLuaFunction(L, "main");
+	input_record_stop();
+	fs_write_async_flush();
+	worker_pool_stop();
 	lua_close(L);
 
+	if (trace_path && !REF_TraceDump(trace_path)) {
+		fprintf(stderr, "Unable to write the trace to %s.\n", trace_path);
+	}
+
 	return 0;
 }
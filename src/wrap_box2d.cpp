@@ -27,7 +27,7 @@ REF_CONSTANT(b2_defaultMaskBits);
 
 REF_CONSTANT(b2_maxPolygonVertices);
 
-REF_FLAT_FLOATS(b2Vec2);
+REF_VECTOR(b2Vec2);
 REF_FLAT_FLOATS(b2AABB);
 REF_FLAT_FLOATS(b2Transform);
 REF_FLAT_FLOATS(b2Circle);
@@ -1161,6 +1161,7 @@ void wrap_DrawPointFn(b2Vec2 point, float size, b2HexColor color, void* context)
 	REF_CallLuaFunction(L, lua_fn_name, { }, point, size, make_color(color));
 }
 
+REF_HEADLESS_NOOP_BEGIN();
 int wrap_b2World_Draw(lua_State* L)
 {
 	int base = lua_gettop(L);
@@ -1194,3 +1195,4 @@ int wrap_b2World_Draw(lua_State* L)
 	return 0;
 }
 REF_WRAP_MANUAL(wrap_b2World_Draw);
+REF_HEADLESS_NOOP_END();
@@ -24,9 +24,12 @@ REF_OPAQUE_PTR_TYPE(CF_File);
 // -------------------------------------------------------------------------------------------------
 // Math
 
+// Math, collision and buffer functions are all pure, so they're bound into worker states too.
+REF_WORKER_SAFE_BEGIN();
+
 CF_SHAPE_TYPE_DEFS
 
-REF_FLAT_FLOATS(v2);
+REF_VECTOR(v2);
 REF_FLAT_FLOATS(CF_M2x2);
 REF_FLAT_FLOATS(CF_M3x2);
 REF_FLAT_FLOATS(CF_Aabb);
@@ -140,9 +143,480 @@ REF_FUNCTION(cast_capsule_to_capsule);
 REF_FUNCTION(cast_capsule_to_poly);
 REF_FUNCTION(cast_poly_to_poly);
 
+// -------------------------------------------------------------------------------------------------
+// Buffers
+
+// Packed byte buffers (see REF_Buffer). Element accessors take 1-based element indices.
+
+int wrap_make_buffer(lua_State* L)
+{
+	lua_Integer size = luaL_optinteger(L, 1, 0);
+	luaL_argcheck(L, size >= 0 && size <= INT_MAX, 1, "size out of range");
+	lua_settop(L, 0);
+	REF_LuaPushBuffer(L, (int)size);
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_make_buffer);
+
+int wrap_buffer_size(lua_State* L)
+{
+	REF_Buffer* buf = (REF_Buffer*)luaL_checkudata(L, 1, "REF_Buffer");
+	lua_pushinteger(L, buf->size);
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_buffer_size);
+
+int wrap_buffer_resize(lua_State* L)
+{
+	REF_Buffer* buf = (REF_Buffer*)luaL_checkudata(L, 1, "REF_Buffer");
+	lua_Integer size = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, size >= 0 && size <= INT_MAX, 2, "size out of range");
+	REF_BufferResize(buf, (int)size);
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_buffer_resize);
+
+// Sets the size to zero, but keeps the memory around for reuse.
+int wrap_buffer_clear(lua_State* L)
+{
+	REF_Buffer* buf = (REF_Buffer*)luaL_checkudata(L, 1, "REF_Buffer");
+	buf->size = 0;
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_buffer_clear);
+
+#define WRAP_BUFFER_ACCESSORS(T, name, push, check) \
+	int wrap_buffer_get_##name(lua_State* L) \
+	{ \
+		REF_Buffer* buf = (REF_Buffer*)luaL_checkudata(L, 1, "REF_Buffer"); \
+		int i = (int)luaL_checkinteger(L, 2) - 1; \
+		luaL_argcheck(L, i >= 0 && (i + 1) * (int)sizeof(T) <= buf->size, 2, "index out of range"); \
+		push(L, ((T*)buf->data)[i]); \
+		return 1; \
+	} \
+	REF_WRAP_MANUAL(wrap_buffer_get_##name); \
+	int wrap_buffer_set_##name(lua_State* L) \
+	{ \
+		REF_Buffer* buf = (REF_Buffer*)luaL_checkudata(L, 1, "REF_Buffer"); \
+		int i = (int)luaL_checkinteger(L, 2) - 1; \
+		luaL_argcheck(L, i >= 0 && (i + 1) * (int)sizeof(T) <= buf->size, 2, "index out of range"); \
+		((T*)buf->data)[i] = (T)check(L, 3); \
+		return 0; \
+	} \
+	REF_WRAP_MANUAL(wrap_buffer_set_##name); \
+	int wrap_buffer_push_##name(lua_State* L) \
+	{ \
+		REF_Buffer* buf = (REF_Buffer*)luaL_checkudata(L, 1, "REF_Buffer"); \
+		int n = lua_gettop(L) - 1; \
+		int at = buf->size; \
+		REF_BufferResize(buf, at + n * (int)sizeof(T)); \
+		T* v = (T*)(buf->data + at); \
+		for (int i = 0; i < n; ++i) v[i] = (T)check(L, i + 2); \
+		return 0; \
+	} \
+	REF_WRAP_MANUAL(wrap_buffer_push_##name)
+WRAP_BUFFER_ACCESSORS(float, f32, lua_pushnumber, luaL_checknumber);
+WRAP_BUFFER_ACCESSORS(int, i32, lua_pushinteger, luaL_checkinteger);
+WRAP_BUFFER_ACCESSORS(uint8_t, u8, lua_pushinteger, luaL_checkinteger);
+
+// Replaces the contents with a flat table of numbers, stored as floats.
+int wrap_buffer_set_f32s(lua_State* L)
+{
+	REF_Buffer* buf = (REF_Buffer*)luaL_checkudata(L, 1, "REF_Buffer");
+	int n = (int)luaL_len(L, 2);
+	REF_BufferResize(buf, n * (int)sizeof(float));
+	float* v = (float*)buf->data;
+	for (int i = 0; i < n; ++i) {
+		lua_rawgeti(L, 2, i + 1);
+		v[i] = (float)lua_tonumber(L, -1);
+		lua_pop(L, 1);
+	}
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_buffer_set_f32s);
+
+int wrap_buffer_get_f32s(lua_State* L)
+{
+	REF_Buffer* buf = (REF_Buffer*)luaL_checkudata(L, 1, "REF_Buffer");
+	int n = buf->size / (int)sizeof(float);
+	lua_createtable(L, n, 0);
+	REF_LuaSetArray(L, (float*)buf->data, n);
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_buffer_get_f32s);
+
+// Copies the raw bytes into a Lua string.
+int wrap_buffer_to_string(lua_State* L)
+{
+	REF_Buffer* buf = (REF_Buffer*)luaL_checkudata(L, 1, "REF_Buffer");
+	lua_pushlstring(L, (const char*)buf->data, buf->size);
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_buffer_to_string);
+
+REF_WORKER_SAFE_END();
+
+// -------------------------------------------------------------------------------------------------
+// Worker threads
+
+// A shared pool of worker threads for splitting up bulk work, created on first use.
+CF_Threadpool* g_worker_pool;
+int g_worker_count;
+
+CF_Threadpool* worker_pool()
+{
+	if (!g_worker_pool) {
+		g_worker_count = max(1, cf_core_count() - 1);
+		g_worker_pool = cf_make_threadpool(g_worker_count);
+	}
+	return g_worker_pool;
+}
+
+// Splits [0, count) into chunks, calls fn(begin, end) for each chunk on the worker pool, and
+// waits for all of them to finish.
+template <typename F>
+void parallel_for(int count, const F& fn)
+{
+	struct Task { const F* fn; int begin, end; };
+	CF_Threadpool* pool = worker_pool();
+	int chunks = min(count, g_worker_count * 4);
+	if (chunks <= 1) {
+		fn(0, count);
+		return;
+	}
+	Task* tasks = (Task*)alloca(sizeof(Task) * chunks);
+	for (int i = 0; i < chunks; ++i) {
+		tasks[i] = { &fn, (int)((int64_t)count * i / chunks), (int)((int64_t)count * (i + 1) / chunks) };
+		cf_threadpool_add_task(pool, [](void* param) { Task* t = (Task*)param; (*t->fn)(t->begin, t->end); }, tasks + i);
+	}
+	cf_threadpool_kick_and_wait(pool);
+}
+
+// -------------------------------------------------------------------------------------------------
+// Worker states
+
+// A pool of extra lua_States, each running on its own thread, for scripts like pathfinding or
+// procedural generation. Workers are bound with only the worker safe subset of the API (see
+// REF_WORKER_SAFE_BEGIN) and all load the same script. Jobs call a global function from that script
+// by name on whichever worker is free. Arguments and results are deep copied between states (see
+// REF_LuaEncode), so no table is ever shared. `worker_call_transfer` moves buffers rather than
+// copying them, leaving the caller's buffers empty.
+//
+//     worker_pool_start("pathfinding.lua" [, count])
+//     future = worker_call("find_path", grid, x0, y0, x1, y1)
+//     ...
+//     if future_ready(future) then
+//         ok, path = future_get(future) -- ok is false and path the error message upon failure.
+//     end
+//     ok, path = future_wait(future) -- Blocks until done.
+
+struct WorkerJob
+{
+	uint64_t id = 0;
+	String fn_name;
+	Array<uint8_t> message; // Encoded arguments on the way in, results or the error on the way out.
+	bool failed = false;
+	bool released = false; // Guarded by g_worker_mutex, the job is deleted as soon as it's done.
+	CF_AtomicInt done = { };
+};
+
+struct WorkerState
+{
+	lua_State* L;
+	CF_Thread* thread;
+};
+
+CF_Mutex g_worker_mutex;
+CF_ConditionVariable g_worker_cv;      // Signaled when jobs are queued or the pool stops.
+CF_ConditionVariable g_worker_done_cv; // Signaled when a job finishes.
+Array<WorkerJob*> g_worker_queue;
+int g_worker_queue_head;
+bool g_worker_running;
+bool g_worker_sync_created;
+Array<WorkerState> g_worker_states;
+Map<uint64_t, WorkerJob*> g_worker_jobs;
+uint64_t g_worker_next_job_id = 1;
+bool g_optimize; // Set by `--optimize`, workers then compile their script through the optimizer too.
+
+// Runs inside lua_pcall on a worker: decodes arguments, calls the function, encodes the results.
+static int worker_run_job(lua_State* L)
+{
+	WorkerJob* job = (WorkerJob*)lua_touserdata(L, 1);
+	lua_newtable(L);
+	int seen = lua_gettop(L);
+	if (lua_getglobal(L, job->fn_name.c_str()) != LUA_TFUNCTION) {
+		return luaL_error(L, "Function %s not found in the worker script.", job->fn_name.c_str());
+	}
+	const uint8_t* p = job->message.data();
+	const uint8_t* end = p + job->message.count();
+	int arg_count = 0;
+	while (p < end) {
+		luaL_checkstack(L, 1, "Too many arguments.");
+		REF_LuaDecode(L, &p, end, seen, true);
+		++arg_count;
+	}
+	int base = seen + 1;
+	lua_call(L, arg_count, LUA_MULTRET);
+	lua_newtable(L);
+	int result_seen = lua_gettop(L);
+	job->message.clear();
+	for (int i = base; i < result_seen; ++i) {
+		REF_LuaEncode(L, i, result_seen, &job->message, false);
+	}
+	return 0;
+}
+
+static int worker_state_thread(void* udata)
+{
+	lua_State* L = ((WorkerState*)udata)->L;
+	REF_TraceThreadName("Lua worker");
+	while (true) {
+		cf_mutex_lock(&g_worker_mutex);
+		while (g_worker_running && g_worker_queue_head == g_worker_queue.count()) {
+			cf_cv_wait(&g_worker_cv, &g_worker_mutex);
+		}
+		if (!g_worker_running) {
+			cf_mutex_unlock(&g_worker_mutex);
+			return 0;
+		}
+		WorkerJob* job = g_worker_queue[g_worker_queue_head++];
+		if (g_worker_queue_head == g_worker_queue.count()) {
+			g_worker_queue.clear();
+			g_worker_queue_head = 0;
+		}
+		cf_mutex_unlock(&g_worker_mutex);
+
+		lua_pushcfunction(L, worker_run_job);
+		lua_pushlightuserdata(L, job);
+		int status;
+		{
+			REF_TraceScope trace("worker_call", "Lua");
+			status = lua_pcall(L, 1, 0, 0);
+		}
+		if (status != LUA_OK) {
+			size_t len = 0;
+			const char* error = lua_tolstring(L, -1, &len);
+			job->failed = true;
+			job->message.clear();
+			if (error) REF_EncodeBytes(&job->message, error, (int)len);
+		}
+		lua_settop(L, 0);
+
+		cf_mutex_lock(&g_worker_mutex);
+		if (job->released) {
+			delete job;
+		} else {
+			cf_atomic_set(&job->done, 1);
+			cf_cv_wake_all(&g_worker_done_cv);
+		}
+		cf_mutex_unlock(&g_worker_mutex);
+	}
+}
+
+void worker_pool_stop()
+{
+	if (!g_worker_states.count()) return;
+	cf_mutex_lock(&g_worker_mutex);
+	g_worker_running = false;
+	cf_cv_wake_all(&g_worker_cv);
+	cf_mutex_unlock(&g_worker_mutex);
+	for (int i = 0; i < g_worker_states.count(); ++i) {
+		cf_thread_wait(g_worker_states[i].thread);
+		lua_close(g_worker_states[i].L);
+	}
+	g_worker_states.clear();
+
+	// Jobs that never ran fail, so nobody waits on them forever.
+	for (int i = g_worker_queue_head; i < g_worker_queue.count(); ++i) {
+		WorkerJob* job = g_worker_queue[i];
+		if (job->released) {
+			delete job;
+			continue;
+		}
+		const char* error = "Worker pool stopped.";
+		job->failed = true;
+		job->message.clear();
+		REF_EncodeBytes(&job->message, error, (int)strlen(error));
+		cf_atomic_set(&job->done, 1);
+	}
+	g_worker_queue.clear();
+	g_worker_queue_head = 0;
+}
+REF_FUNCTION(worker_pool_stop);
+
+// Starts `count` workers (defaults to one per core, minus the main thread), each running `script`.
+// Returns the number of workers started.
+//
+//     count = worker_pool_start(script [, count])
+int wrap_worker_pool_start(lua_State* L)
+{
+	const char* script = luaL_checkstring(L, 1);
+	int count = (int)luaL_optinteger(L, 2, max(1, cf_core_count() - 1));
+	worker_pool_stop();
+	if (!g_worker_sync_created) {
+		g_worker_mutex = cf_make_mutex();
+		g_worker_cv = cf_make_cv();
+		g_worker_done_cv = cf_make_cv();
+		g_worker_sync_created = true;
+	}
+	g_worker_states.ensure_capacity(count); // States are handed to threads by pointer, so never reallocate.
+	for (int i = 0; i < count; ++i) {
+		lua_State* WL = luaL_newstate();
+		lua_setoptimize(WL, g_optimize);
+		luaL_openlibs(WL);
+		REF_BindLuaWorker(WL);
+		g_worker_states.add({ WL, NULL });
+		if (luaL_dofile(WL, script)) {
+			lua_pushstring(L, lua_tostring(WL, -1));
+			for (int j = 0; j < g_worker_states.count(); ++j) lua_close(g_worker_states[j].L);
+			g_worker_states.clear();
+			return lua_error(L);
+		}
+	}
+	g_worker_running = true;
+	for (int i = 0; i < count; ++i) {
+		g_worker_states[i].thread = cf_thread_create(worker_state_thread, "Lua worker", &g_worker_states[i]);
+	}
+	lua_settop(L, 0);
+	lua_pushinteger(L, count);
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_worker_pool_start);
+
+static int worker_call_impl(lua_State* L, bool transfer)
+{
+	const char* fn_name = luaL_checkstring(L, 1);
+	if (!g_worker_states.count()) return luaL_error(L, "Call worker_pool_start before worker_call.");
+	// Encoding errors long jump out of here, so encode before allocating the job.
+	static Array<uint8_t> scratch;
+	scratch.clear();
+	int arg_count = lua_gettop(L);
+	lua_newtable(L);
+	int seen = lua_gettop(L);
+	for (int i = 2; i <= arg_count; ++i) {
+		REF_LuaEncode(L, i, seen, &scratch, transfer);
+	}
+	if (transfer) REF_LuaFinishMove(L, seen);
+	WorkerJob* job = new WorkerJob;
+	job->id = g_worker_next_job_id++;
+	job->fn_name = fn_name;
+	REF_EncodeBytes(&job->message, scratch.data(), scratch.count());
+	g_worker_jobs.add(job->id, job);
+
+	cf_mutex_lock(&g_worker_mutex);
+	g_worker_queue.add(job);
+	cf_cv_wake_one(&g_worker_cv);
+	cf_mutex_unlock(&g_worker_mutex);
+
+	lua_settop(L, 0);
+	lua_pushinteger(L, job->id);
+	return 1;
+}
+
+// future = worker_call(fn_name, ...)
+int wrap_worker_call(lua_State* L) { return worker_call_impl(L, false); }
+REF_WRAP_MANUAL(wrap_worker_call);
+
+// future = worker_call_transfer(fn_name, ...)
+int wrap_worker_call_transfer(lua_State* L) { return worker_call_impl(L, true); }
+REF_WRAP_MANUAL(wrap_worker_call_transfer);
+
+// ready = future_ready(future)
+int wrap_future_ready(lua_State* L)
+{
+	uint64_t id = (uint64_t)lua_tointeger(L, 1);
+	lua_settop(L, 0);
+	WorkerJob** job = g_worker_jobs.try_find(id);
+	lua_pushboolean(L, job && cf_atomic_get(&(*job)->done));
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_future_ready);
+
+// Pushes `true, results...` or `false, error` and forgets about the job.
+static int future_push_results(lua_State* L, WorkerJob* job)
+{
+	g_worker_jobs.remove(job->id);
+	lua_settop(L, 0);
+	int count = 1;
+	if (job->failed) {
+		lua_pushboolean(L, 0);
+		lua_pushlstring(L, (const char*)job->message.data(), job->message.count());
+		count = 2;
+	} else {
+		lua_pushboolean(L, 1);
+		lua_newtable(L);
+		int seen = lua_gettop(L);
+		const uint8_t* p = job->message.data();
+		const uint8_t* end = p + job->message.count();
+		while (p < end) {
+			luaL_checkstack(L, 1, "Too many results.");
+			REF_LuaDecode(L, &p, end, seen, true);
+			++count;
+		}
+		lua_remove(L, seen);
+	}
+	delete job;
+	return count;
+}
+
+// Returns nothing while the job is still running.
+//
+//     ok, ... = future_get(future)
+int wrap_future_get(lua_State* L)
+{
+	uint64_t id = (uint64_t)lua_tointeger(L, 1);
+	WorkerJob** job = g_worker_jobs.try_find(id);
+	if (!job || !cf_atomic_get(&(*job)->done)) {
+		lua_settop(L, 0);
+		return 0;
+	}
+	return future_push_results(L, *job);
+}
+REF_WRAP_MANUAL(wrap_future_get);
+
+// ok, ... = future_wait(future)
+int wrap_future_wait(lua_State* L)
+{
+	uint64_t id = (uint64_t)lua_tointeger(L, 1);
+	WorkerJob** found = g_worker_jobs.try_find(id);
+	if (!found) {
+		lua_settop(L, 0);
+		return 0;
+	}
+	WorkerJob* job = *found;
+	cf_mutex_lock(&g_worker_mutex);
+	while (!cf_atomic_get(&job->done)) {
+		cf_cv_wait(&g_worker_done_cv, &g_worker_mutex);
+	}
+	cf_mutex_unlock(&g_worker_mutex);
+	return future_push_results(L, job);
+}
+REF_WRAP_MANUAL(wrap_future_wait);
+
+// Forgets about a future without waiting on its results.
+//
+//     future_release(future)
+int wrap_future_release(lua_State* L)
+{
+	uint64_t id = (uint64_t)lua_tointeger(L, 1);
+	lua_settop(L, 0);
+	WorkerJob** found = g_worker_jobs.try_find(id);
+	if (!found) return 0;
+	WorkerJob* job = *found;
+	g_worker_jobs.remove(id);
+	cf_mutex_lock(&g_worker_mutex);
+	if (cf_atomic_get(&job->done)) delete job;
+	else job->released = true;
+	cf_mutex_unlock(&g_worker_mutex);
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_future_release);
+
 // -------------------------------------------------------------------------------------------------
 // Graphics
 
+REF_HEADLESS_NOOP_BEGIN();
+
 CF_BACKEND_TYPE_DEFS
 CF_PIXEL_FORMAT_DEFS
 CF_PIXELFORMAT_OP_DEFS
@@ -226,8 +700,22 @@ REF_STRUCT(CF_RenderState,
 
 REF_FUNCTION(query_backend);
 REF_FUNCTION(texture_defaults);
-REF_FUNCTION(make_texture);
-REF_FUNCTION(destroy_texture);
+// Textures remember the params they were made with, so functions writing a whole texture from a
+// w*h grid can check it fits (see noise_check_grid).
+Map<uint64_t, CF_TextureParams> g_texture_params;
+CF_Texture wrap_make_texture(CF_TextureParams params)
+{
+	CF_Texture tex = cf_make_texture(params);
+	g_texture_params.add(tex.id, params);
+	return tex;
+}
+void wrap_destroy_texture(CF_Texture tex)
+{
+	g_texture_params.remove(tex.id);
+	cf_destroy_texture(tex);
+}
+REF_FUNCTION_EX(make_texture, wrap_make_texture);
+REF_FUNCTION_EX(destroy_texture, wrap_destroy_texture);
 REF_FUNCTION(texture_update);
 REF_FUNCTION(make_shader);
 REF_FUNCTION(shader_directory);
@@ -275,6 +763,8 @@ REF_FUNCTION(draw_elements);
 REF_FUNCTION(commit);
 REF_FUNCTION_EX(clear_color, cf_clear_color);
 
+REF_HEADLESS_NOOP_END();
+
 // -------------------------------------------------------------------------------------------------
 // App
 
@@ -302,12 +792,36 @@ REF_FUNCTION(display_bounds);
 REF_FUNCTION(display_name);
 REF_FUNCTION(display_orientation);
 
-REF_FUNCTION(make_app);
+// Headless mode runs scripts with no window, GPU device or audio, e.g. for server side simulations.
+// It's turned on by the `--headless` command line flag before REF_BindLua, so draw, sprite, ImGui and
+// audio functions are bound as no-ops (see REF_HEADLESS_NOOP_BEGIN). `app_update` then steps time by
+// itself, see headless_app_update.
+bool g_headless;
+bool g_headless_fast;
+bool is_headless() { return g_headless; }
+REF_FUNCTION(is_headless);
+
+CF_Result wrap_make_app(const char* window_title, CF_DisplayID display_id, int x, int y, int w, int h, int options, const char* argv0)
+{
+	if (g_headless) {
+		// SDL's dummy video driver still provides events and input, without a real window.
+#ifdef _WIN32
+		_putenv_s("SDL_VIDEO_DRIVER", "dummy");
+#else
+		setenv("SDL_VIDEO_DRIVER", "dummy", 1);
+#endif
+		options |= APP_OPTIONS_NO_GFX_BIT | APP_OPTIONS_NO_AUDIO_BIT | APP_OPTIONS_HIDDEN_BIT;
+	}
+	return make_app(window_title, display_id, x, y, w, h, options, argv0);
+}
+REF_FUNCTION_EX(make_app, wrap_make_app);
 REF_FUNCTION(destroy_app);
 REF_FUNCTION(app_is_running);
 REF_FUNCTION(app_signal_shutdown);
 // app_update -- Wrapped explicitly below.
+REF_HEADLESS_NOOP_BEGIN();
 REF_FUNCTION(app_draw_onto_screen);
+REF_HEADLESS_NOOP_END();
 REF_FUNCTION(app_get_width);
 REF_FUNCTION(app_get_height);
 v2 wrap_app_get_position() { int x, y; app_get_position(&x, &y); return V2((float)x, (float)y); }
@@ -335,11 +849,13 @@ REF_FUNCTION(app_mouse_exited);
 REF_FUNCTION(app_mouse_inside);
 REF_FUNCTION(app_get_canvas_width);
 REF_FUNCTION(app_get_canvas_height);
+REF_HEADLESS_NOOP_BEGIN();
 REF_FUNCTION(app_set_vsync);
 REF_FUNCTION(app_get_vsync);
 REF_FUNCTION(app_init_imgui);
 REF_FUNCTION(app_get_canvas);
 REF_FUNCTION(app_set_canvas_size);
+REF_HEADLESS_NOOP_END();
 REF_FUNCTION(app_set_windowed_mode);
 REF_FUNCTION(app_set_borderless_fullscreen_mode);
 REF_FUNCTION(app_set_fullscreen_mode);
@@ -354,6 +870,8 @@ REF_FUNCTION(app_get_power_percentage_left);
 // -------------------------------------------------------------------------------------------------
 // Audio
 
+REF_HEADLESS_NOOP_BEGIN();
+
 REF_HANDLE_TYPE(CF_Audio);
 REF_FUNCTION_EX(audio_cull_duplicates, cf_audio_cull_duplicates);
 REF_FUNCTION(audio_load_ogg);
@@ -410,28 +928,102 @@ REF_FUNCTION(sound_set_pitch);
 REF_FUNCTION(sound_set_sample_index);
 REF_FUNCTION(sound_stop);
 
+// Finish callbacks fire on CF's mixer thread, where calling into Lua would race the main thread.
+// Instead they push small events into a lock-free single-producer/single-consumer ring, and the
+// main thread drains it into Lua once per frame (inside app_update, or audio_dispatch_callbacks).
+// The mixer never waits on Lua; if the ring is ever full, events are dropped and counted.
+enum AudioEventKind
+{
+	AUDIO_EVENT_SOUND_FINISHED,
+	AUDIO_EVENT_MUSIC_FINISHED,
+};
+
+struct AudioEvent
+{
+	AudioEventKind kind;
+	CF_Sound snd;
+};
+
+#define AUDIO_EVENT_QUEUE_CAPACITY 1024
+
+struct AudioEventQueue
+{
+	AudioEvent events[AUDIO_EVENT_QUEUE_CAPACITY];
+	CF_AtomicInt head; // Next event to read, only written by the consumer.
+	CF_AtomicInt tail; // Next event to write, only written by the producer.
+	CF_AtomicInt dropped;
+
+	bool push(AudioEvent e)
+	{
+		int tail_index = cf_atomic_get(&tail);
+		int next = (tail_index + 1) % AUDIO_EVENT_QUEUE_CAPACITY;
+		if (next == cf_atomic_get(&head)) {
+			cf_atomic_add(&dropped, 1);
+			return false;
+		}
+		events[tail_index] = e;
+		cf_atomic_set(&tail, next); // Publishes the event written above.
+		return true;
+	}
+
+	bool pop(AudioEvent* e)
+	{
+		int head_index = cf_atomic_get(&head);
+		if (head_index == cf_atomic_get(&tail)) return false;
+		*e = events[head_index];
+		cf_atomic_set(&head, (head_index + 1) % AUDIO_EVENT_QUEUE_CAPACITY);
+		return true;
+	}
+};
+
+AudioEventQueue g_audio_events;
+const char* g_sound_finish_lua_fn_name;
+const char* g_music_finish_lua_fn_name;
+
 void wrap_on_sound_finish(CF_Sound snd, void* udata)
 {
-	const char* lua_fn_name = (const char*)udata;
-	REF_CallLuaFunction(L, lua_fn_name, { }, snd);
+	g_audio_events.push({ AUDIO_EVENT_SOUND_FINISHED, snd });
 }
 void wrap_sound_set_on_finish(const char* lua_fn_name)
 {
-	cf_sound_set_on_finish_callback(wrap_on_sound_finish, (void*)lua_fn_name, true);
+	g_sound_finish_lua_fn_name = lua_fn_name;
+	cf_sound_set_on_finish_callback(wrap_on_sound_finish, NULL, false);
 }
 REF_FUNCTION_EX(sound_set_on_finish, wrap_sound_set_on_finish);
 
 void wrap_on_music_finish(void* udata)
 {
-	const char* lua_fn_name = (const char*)udata;
-	REF_CallLuaFunction(L, lua_fn_name);
+	g_audio_events.push({ AUDIO_EVENT_MUSIC_FINISHED, { } });
 }
 void wrap_music_set_on_finish(const char* lua_fn_name)
 {
-	cf_music_set_on_finish_callback(wrap_on_music_finish, (void*)lua_fn_name, true);
+	g_music_finish_lua_fn_name = lua_fn_name;
+	cf_music_set_on_finish_callback(wrap_on_music_finish, NULL, false);
 }
 REF_FUNCTION_EX(music_set_on_finish, wrap_music_set_on_finish);
 
+// Main thread only. Called automatically by app_update, returns how many events were dispatched.
+int audio_dispatch_callbacks()
+{
+	int count = 0;
+	AudioEvent e;
+	while (g_audio_events.pop(&e)) {
+		switch (e.kind) {
+		case AUDIO_EVENT_SOUND_FINISHED: if (g_sound_finish_lua_fn_name) REF_CallLuaFunction(L, g_sound_finish_lua_fn_name, { }, e.snd); break;
+		case AUDIO_EVENT_MUSIC_FINISHED: if (g_music_finish_lua_fn_name) REF_CallLuaFunction(L, g_music_finish_lua_fn_name); break;
+		}
+		++count;
+	}
+	return count;
+}
+REF_FUNCTION(audio_dispatch_callbacks);
+
+// Number of events dropped because the ring was full, handy for tuning AUDIO_EVENT_QUEUE_CAPACITY.
+int audio_dropped_callbacks() { return cf_atomic_get(&g_audio_events.dropped); }
+REF_FUNCTION(audio_dropped_callbacks);
+
+REF_HEADLESS_NOOP_END();
+
 // -------------------------------------------------------------------------------------------------
 // Clipboard
 
@@ -441,6 +1033,8 @@ REF_FUNCTION(clipboard_set);
 // -------------------------------------------------------------------------------------------------
 // Draw
 
+REF_HEADLESS_NOOP_BEGIN();
+
 REF_FLAT_INTS(CF_Pixel);
 
 REF_FUNCTION_EX(draw_sprite, cf_draw_sprite);
@@ -507,6 +1101,116 @@ REF_FUNCTION(draw_polygon_fill_simple, {0,1});
 REF_FUNCTION_EX(draw_bezier_line, cf_draw_bezier_line2);
 REF_FUNCTION(draw_arrow);
 
+// Batched primitives. Each takes a packed run of floats (buffer, packed string or flat table)
+// and loops over it in C, so thousands of shapes cost a single call from Lua. Items are laid out
+// back to back as the shape's flattened floats, optionally followed by a per-item thickness (for
+// outlines) and then a per-item color, as selected by the `flags` parameter.
+#define DRAW_BATCH_THICKNESS 1
+#define DRAW_BATCH_COLOR 2
+REF_CONSTANT(DRAW_BATCH_THICKNESS);
+REF_CONSTANT(DRAW_BATCH_COLOR);
+
+template <typename T, typename F>
+void draw_batch(lua_State* L, int index, int flags, F draw_fn)
+{
+	static_assert(sizeof(T) % sizeof(float) == 0, "Batched shapes must be made of floats.");
+	const int shape_n = sizeof(T) / sizeof(float);
+	const int thickness_n = (flags & DRAW_BATCH_THICKNESS) ? 1 : 0;
+	const int color_n = (flags & DRAW_BATCH_COLOR) ? 4 : 0;
+	const int stride = shape_n + thickness_n + color_n;
+	Array<float> scratch;
+	int count = 0;
+	const float* v = REF_LuaGetFloats(L, index, &count, &scratch);
+	for (int i = 0; i + stride <= count; i += stride) {
+		T shape;
+		CF_MEMCPY(&shape, v + i, sizeof(T));
+		float thickness = thickness_n ? v[i + shape_n] : -1.0f;
+		if (color_n) {
+			const float* c = v + i + shape_n + thickness_n;
+			draw_push_color(make_color(c[0], c[1], c[2], c[3]));
+		}
+		draw_fn(shape, thickness);
+		if (color_n) draw_pop_color();
+	}
+}
+
+// draw_circles_fill(circles, flags) -- circles are {x,y,r}
+int wrap_draw_circles_fill(lua_State* L)
+{
+	int flags = (int)lua_tointeger(L, 2);
+	draw_batch<CF_Circle>(L, 1, flags & ~DRAW_BATCH_THICKNESS, [](CF_Circle c, float) { cf_draw_circle_fill(c); });
+	lua_settop(L, 0);
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_draw_circles_fill);
+
+// draw_circles(circles, thickness, flags)
+int wrap_draw_circles(lua_State* L)
+{
+	float thickness = (float)lua_tonumber(L, 2);
+	int flags = (int)lua_tointeger(L, 3);
+	draw_batch<CF_Circle>(L, 1, flags, [=](CF_Circle c, float t) { cf_draw_circle(c, t < 0 ? thickness : t); });
+	lua_settop(L, 0);
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_draw_circles);
+
+// draw_quads_fill(quads, chubbiness, flags) -- quads are aabbs {min_x,min_y,max_x,max_y}
+int wrap_draw_quads_fill(lua_State* L)
+{
+	float chubbiness = (float)lua_tonumber(L, 2);
+	int flags = (int)lua_tointeger(L, 3);
+	draw_batch<CF_Aabb>(L, 1, flags & ~DRAW_BATCH_THICKNESS, [=](CF_Aabb bb, float) { cf_draw_quad_fill(bb, chubbiness); });
+	lua_settop(L, 0);
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_draw_quads_fill);
+
+// draw_quads(quads, thickness, chubbiness, flags)
+int wrap_draw_quads(lua_State* L)
+{
+	float thickness = (float)lua_tonumber(L, 2);
+	float chubbiness = (float)lua_tonumber(L, 3);
+	int flags = (int)lua_tointeger(L, 4);
+	draw_batch<CF_Aabb>(L, 1, flags, [=](CF_Aabb bb, float t) { cf_draw_quad(bb, t < 0 ? thickness : t, chubbiness); });
+	lua_settop(L, 0);
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_draw_quads);
+
+// draw_lines(lines, thickness, flags) -- lines are {x0,y0,x1,y1}
+struct DrawBatchLine { v2 p0, p1; };
+int wrap_draw_lines(lua_State* L)
+{
+	float thickness = (float)lua_tonumber(L, 2);
+	int flags = (int)lua_tointeger(L, 3);
+	draw_batch<DrawBatchLine>(L, 1, flags, [=](DrawBatchLine l, float t) { draw_line(l.p0, l.p1, t < 0 ? thickness : t); });
+	lua_settop(L, 0);
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_draw_lines);
+
+// draw_capsules_fill(capsules, flags) -- capsules are {ax,ay,bx,by,r}
+int wrap_draw_capsules_fill(lua_State* L)
+{
+	int flags = (int)lua_tointeger(L, 2);
+	draw_batch<CF_Capsule>(L, 1, flags & ~DRAW_BATCH_THICKNESS, [](CF_Capsule c, float) { cf_draw_capsule_fill(c); });
+	lua_settop(L, 0);
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_draw_capsules_fill);
+
+// draw_capsules(capsules, thickness, flags)
+int wrap_draw_capsules(lua_State* L)
+{
+	float thickness = (float)lua_tonumber(L, 2);
+	int flags = (int)lua_tointeger(L, 3);
+	draw_batch<CF_Capsule>(L, 1, flags, [=](CF_Capsule c, float t) { cf_draw_capsule(c, t < 0 ? thickness : t); });
+	lua_settop(L, 0);
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_draw_capsules);
+
 REF_FUNCTION(draw_push_layer);
 REF_FUNCTION(draw_pop_layer);
 REF_FUNCTION(draw_peek_layer);
@@ -594,6 +1298,185 @@ int wrap_text_effect_register(lua_State* L)
 }
 REF_WRAP_MANUAL(wrap_text_effect_register);
 
+// Native text effects. These run per-glyph entirely in C and are configured once from Lua, e.g.
+// `text_effect_register_wave("wave", 5, 5, 0.5)`. Any param can still be overridden from markup,
+// e.g. "<wave height=3>hello</wave>".
+enum TextFxKind
+{
+	TEXT_FX_WAVE,
+	TEXT_FX_SHAKE,
+	TEXT_FX_FADE,
+	TEXT_FX_COLOR_CYCLE,
+	TEXT_FX_TYPEWRITER,
+};
+
+struct TextFxNative
+{
+	TextFxKind kind;
+	float a, b, c;
+};
+
+Map<const char*, TextFxNative> g_fx_native;
+
+static void text_fx_offset(TextEffect* fx, float x, float y)
+{
+	fx->q0.x += x; fx->q0.y += y;
+	fx->q1.x += x; fx->q1.y += y;
+	fx->center.x += x; fx->center.y += y;
+}
+
+// Cheap deterministic noise in [-1, 1], so shaking glyphs don't need any state.
+static float text_fx_hash(int a, int b)
+{
+	uint32_t h = (uint32_t)a * 0x9E3779B1u ^ (uint32_t)b * 0x85EBCA77u;
+	h ^= h >> 15;
+	h *= 0x2C1B3C6Du;
+	h ^= h >> 12;
+	return (float)(h & 0xFFFF) / 32767.5f - 1.0f;
+}
+
+bool wrap_text_fx_native_fn(TextEffect* fx)
+{
+	const TextFxNative& p = g_fx_native.find(sintern(fx->effect_name));
+	float t = (float)fx->elapsed;
+	float i = (float)fx->index_into_effect;
+	switch (p.kind) {
+	case TEXT_FX_WAVE: {
+		float height = (float)fx->get_number("height", p.a);
+		float speed = (float)fx->get_number("speed", p.b);
+		float offset = (float)fx->get_number("offset", p.c);
+		text_fx_offset(fx, 0, height * sinf(i * offset + t * speed));
+		break;
+	}
+	case TEXT_FX_SHAKE: {
+		float strength = (float)fx->get_number("strength", p.a);
+		float frequency = (float)fx->get_number("frequency", p.b);
+		int step = (int)(t * frequency);
+		text_fx_offset(fx, strength * text_fx_hash(fx->index_into_string, step), strength * text_fx_hash(step, fx->index_into_string));
+		break;
+	}
+	case TEXT_FX_FADE: {
+		// Fades each glyph in over `duration` seconds, starting `stagger` seconds after the previous one.
+		float duration = (float)fx->get_number("duration", p.a);
+		float stagger = (float)fx->get_number("stagger", p.b);
+		float local = t - i * stagger;
+		float k = duration > 0 ? local / duration : 1.0f;
+		fx->opacity *= k < 0 ? 0 : (k > 1 ? 1 : k);
+		break;
+	}
+	case TEXT_FX_COLOR_CYCLE: {
+		float speed = (float)fx->get_number("speed", p.a);
+		float spread = (float)fx->get_number("spread", p.b);
+		float phase = t * speed + i * spread;
+		fx->color.r = 0.5f + 0.5f * sinf(phase);
+		fx->color.g = 0.5f + 0.5f * sinf(phase + 2.0943951f);
+		fx->color.b = 0.5f + 0.5f * sinf(phase + 4.1887902f);
+		break;
+	}
+	case TEXT_FX_TYPEWRITER: {
+		float chars_per_second = (float)fx->get_number("speed", p.a);
+		fx->visible = fx->visible && i < t * chars_per_second;
+		break;
+	}
+	}
+	return true;
+}
+
+void text_effect_register_native(const char* fx_name, TextFxNative params)
+{
+	fx_name = sintern(fx_name);
+	g_fx_native.add(fx_name, params);
+	text_effect_register(fx_name, wrap_text_fx_native_fn);
+}
+void text_effect_register_wave(const char* fx_name, float height, float speed, float offset) { text_effect_register_native(fx_name, { TEXT_FX_WAVE, height, speed, offset }); }
+void text_effect_register_shake(const char* fx_name, float strength, float frequency) { text_effect_register_native(fx_name, { TEXT_FX_SHAKE, strength, frequency }); }
+void text_effect_register_fade(const char* fx_name, float duration, float stagger) { text_effect_register_native(fx_name, { TEXT_FX_FADE, duration, stagger }); }
+void text_effect_register_color_cycle(const char* fx_name, float speed, float spread) { text_effect_register_native(fx_name, { TEXT_FX_COLOR_CYCLE, speed, spread }); }
+void text_effect_register_typewriter(const char* fx_name, float chars_per_second) { text_effect_register_native(fx_name, { TEXT_FX_TYPEWRITER, chars_per_second }); }
+REF_FUNCTION(text_effect_register_wave);
+REF_FUNCTION(text_effect_register_shake);
+REF_FUNCTION(text_effect_register_fade);
+REF_FUNCTION(text_effect_register_color_cycle);
+REF_FUNCTION(text_effect_register_typewriter);
+
+// Batched text effects call Lua once per run of glyphs instead of once per glyph. The Lua function
+// is called on the first glyph of the effect as fn(buffer, glyph_count, elapsed), and fills in a
+// packed buffer of TextFxBatchGlyph, one per glyph. Offsets start at zero, and the other fields at -1,
+// which keeps the glyph's own value, so Lua only needs to write what it changes. Each glyph then reads
+// its own entry back in C.
+struct TextFxBatchGlyph
+{
+	float dx, dy;
+	float r, g, b, a;
+	float opacity;
+	float visible;
+};
+
+struct TextFxBatch
+{
+	const char* lua_fn_name;
+	REF_Buffer* buffer;
+	int buffer_ref;
+};
+
+Map<const char*, TextFxBatch> g_fx_batches;
+
+bool wrap_text_fx_batch_fn(TextEffect* fx)
+{
+	TextFxBatch& batch = g_fx_batches.find(sintern(fx->effect_name));
+	if (fx->index_into_effect == 0) {
+		REF_BufferResize(batch.buffer, fx->glyph_count * (int)sizeof(TextFxBatchGlyph));
+		TextFxBatchGlyph* glyphs = (TextFxBatchGlyph*)batch.buffer->data;
+		TextFxBatchGlyph init = { 0, 0, -1, -1, -1, -1, -1, -1 };
+		for (int i = 0; i < fx->glyph_count; ++i) glyphs[i] = init;
+
+		lua_getglobal(L, batch.lua_fn_name);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, batch.buffer_ref);
+		lua_pushinteger(L, fx->glyph_count);
+		lua_pushnumber(L, fx->elapsed);
+		if (lua_pcall(L, 3, 0, 0) != LUA_OK) {
+			REF_CallLuaFunction(L, "REF_ErrorHandler", { }, lua_tostring(L, -1));
+			return false;
+		}
+	}
+
+	int i = fx->index_into_effect;
+	if (i < 0 || (i + 1) * (int)sizeof(TextFxBatchGlyph) > batch.buffer->size) return true;
+	const TextFxBatchGlyph& g = ((TextFxBatchGlyph*)batch.buffer->data)[i];
+	text_fx_offset(fx, g.dx, g.dy);
+	if (g.r >= 0) fx->color.r = g.r;
+	if (g.g >= 0) fx->color.g = g.g;
+	if (g.b >= 0) fx->color.b = g.b;
+	if (g.a >= 0) fx->color.a = g.a;
+	if (g.opacity >= 0) fx->opacity = g.opacity;
+	if (g.visible >= 0) fx->visible = g.visible != 0;
+	return true;
+}
+
+// text_effect_register_batched(fx_name, lua_fn_name)
+int wrap_text_effect_register_batched(lua_State* L)
+{
+	const char* fx_name = sintern(lua_tostring(L, -2));
+	const char* lua_fn_name = sintern(lua_tostring(L, -1));
+	lua_pop(L, 2);
+
+	// Registering a name again just switches its Lua function, keeping the buffer.
+	if (TextFxBatch* existing = g_fx_batches.try_find(fx_name)) {
+		existing->lua_fn_name = lua_fn_name;
+		return 0;
+	}
+
+	// The buffer is kept alive by a reference in the registry.
+	TextFxBatch batch;
+	batch.lua_fn_name = lua_fn_name;
+	batch.buffer = REF_LuaPushBuffer(L, 0);
+	batch.buffer_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	g_fx_batches.add(fx_name, batch);
+	text_effect_register(fx_name, wrap_text_fx_batch_fn);
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_text_effect_register_batched);
+
 REF_FUNCTION(draw_push_viewport);
 REF_FUNCTION(draw_pop_viewport);
 REF_FUNCTION(draw_peek_viewport);
@@ -634,6 +1517,140 @@ REF_FUNCTION(screen_to_world);
 REF_FUNCTION(screen_bounds_to_world);
 REF_FUNCTION_EX(draw_canvas, cf_draw_canvas);
 
+// Draw command lists. Calls to the functions below made between `draw_record_begin` and
+// `draw_record_end` are captured into a native command list instead of drawing. `draw_replay`
+// then re-issues them straight from C, which takes static layers (level art, backgrounds) off
+// the Lua hot path. Invalidate a list to rebuild just that piece of the scene.
+REF_RECORDABLE_COPY(draw_sprite, CF_Sprite);
+REF_RECORDABLE(draw_quad);
+REF_RECORDABLE(draw_quad_fill);
+REF_RECORDABLE(draw_box);
+REF_RECORDABLE(draw_box_fill);
+REF_RECORDABLE(draw_box_rounded);
+REF_RECORDABLE(draw_box_rounded_fill);
+REF_RECORDABLE(draw_circle);
+REF_RECORDABLE(draw_circle_fill);
+REF_RECORDABLE(draw_capsule);
+REF_RECORDABLE(draw_capsule_fill);
+REF_RECORDABLE(draw_tri);
+REF_RECORDABLE(draw_tri_fill);
+REF_RECORDABLE(draw_line);
+REF_RECORDABLE(draw_polyline);
+REF_RECORDABLE(draw_polygon_fill);
+REF_RECORDABLE(draw_polygon_fill_simple);
+REF_RECORDABLE(draw_bezier_line);
+REF_RECORDABLE(draw_arrow);
+REF_RECORDABLE(draw_text);
+REF_RECORDABLE(draw_push_layer);
+REF_RECORDABLE(draw_pop_layer);
+REF_RECORDABLE(draw_push_color);
+REF_RECORDABLE(draw_pop_color);
+REF_RECORDABLE(draw_push_antialias);
+REF_RECORDABLE(draw_pop_antialias);
+REF_RECORDABLE(draw_mul);
+REF_RECORDABLE(draw_scale);
+REF_RECORDABLE(draw_translate);
+REF_RECORDABLE(draw_rotate);
+REF_RECORDABLE(draw_TSR);
+REF_RECORDABLE(draw_TSR_absolute);
+REF_RECORDABLE(draw_push);
+REF_RECORDABLE(draw_pop);
+
+REF_OPAQUE_PTR_TYPE(REF_CommandList);
+
+// Drops all recorded commands so the list can be rebuilt with `draw_record_begin(list)`.
+void draw_list_invalidate(REF_CommandList* list) { list->bytes.clear(); list->command_count = 0; list->valid = false; }
+REF_FUNCTION(draw_list_invalidate);
+
+// Starts recording into a new list, or re-records into an existing one if passed in. A list left
+// recording by an error caught in Lua is dropped, staying invalid until it's recorded again.
+int wrap_draw_record_begin(lua_State* L)
+{
+	REF_CommandList* list;
+	if (lua_isnoneornil(L, 1)) {
+		lua_settop(L, 0);
+		list = REF_LuaPushCommandList(L);
+	} else {
+		list = (REF_CommandList*)luaL_checkudata(L, 1, "REF_CommandList");
+		lua_settop(L, 1);
+	}
+	draw_list_invalidate(list);
+	REF_Recording() = list;
+
+	// Keep the list alive while it's recording, even if the script drops it.
+	lua_pushvalue(L, 1);
+	lua_setfield(L, LUA_REGISTRYINDEX, "REF_Recording");
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_draw_record_begin);
+
+int wrap_draw_record_end(lua_State* L)
+{
+	REF_CommandList* list = REF_Recording();
+	if (!list) return luaL_error(L, "draw_record_end called without draw_record_begin.");
+	list->valid = true;
+	REF_Recording() = NULL;
+	lua_getfield(L, LUA_REGISTRYINDEX, "REF_Recording");
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, "REF_Recording");
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_draw_record_end);
+
+// Records the draw calls made by `fn(...)` into `list` (or a new list if nil) and returns the list.
+// Recording is stopped even if `fn` errors, and the error is then passed on.
+int wrap_draw_record(lua_State* L)
+{
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_pushcfunction(L, wrap_draw_record_begin);
+	lua_pushvalue(L, 1);
+	lua_call(L, 1, 1);
+	lua_replace(L, 1);
+	if (lua_pcall(L, lua_gettop(L) - 2, 0, 0) != LUA_OK) {
+		REF_Recording() = NULL;
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, "REF_Recording");
+		return lua_error(L);
+	}
+	return wrap_draw_record_end(L);
+}
+REF_WRAP_MANUAL(wrap_draw_record);
+
+static REF_CommandList* draw_replay_check(lua_State* L)
+{
+	REF_CommandList* list = (REF_CommandList*)luaL_checkudata(L, 1, "REF_CommandList");
+	if (REF_Recording()) luaL_error(L, "Can not replay a draw list while recording.");
+	return list;
+}
+
+// Replays a list.
+int wrap_draw_replay(lua_State* L)
+{
+	REF_CommandListReplay(draw_replay_check(L));
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_draw_replay);
+
+// Replays a list transformed by a CF_M3x2 (six floats).
+int wrap_draw_replay_transformed(lua_State* L)
+{
+	REF_CommandList* list = draw_replay_check(L);
+	for (int i = 2; i <= 7; ++i) luaL_checknumber(L, i);
+	CF_M3x2 m;
+	REF_LuaGet(L, 2, &m);
+	draw_push();
+	draw_mul(m);
+	REF_CommandListReplay(list);
+	draw_pop();
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_draw_replay_transformed);
+
+bool draw_list_is_valid(REF_CommandList* list) { return list->valid; }
+int draw_list_command_count(REF_CommandList* list) { return list->command_count; }
+REF_FUNCTION(draw_list_is_valid);
+REF_FUNCTION(draw_list_command_count);
+
 REF_FUNCTION(render_to);
 
 REF_STRUCT(CF_TemporaryImage,
@@ -658,6 +1675,8 @@ REF_STRUCT(CF_AtlasSubImage,
 
 REF_FUNCTION(register_premade_atlas, {2,1});
 
+REF_HEADLESS_NOOP_END();
+
 // -------------------------------------------------------------------------------------------------
 // File I/O
 
@@ -721,50 +1740,258 @@ REF_WRAP_MANUAL(wrap_fs_enumerate_directory);
 
 REF_FUNCTION(fs_file_exists);
 
-int wrap_fs_read(lua_State* L)
+static int fs_check_read_size(lua_State* L, int index)
 {
-	CF_File* file = (CF_File*)lua_touserdata(L, -2);
-	size_t size = lua_tointeger(L, -1);
-	char* buffer = (char*)cf_alloc(size + 1);
-	buffer[size] = 0;
-	size_t read = fs_read(file, buffer, size);
-	lua_pop(L, 2);
-	lua_pushstring(L, buffer);
-	lua_pushinteger(L, read);
-	cf_free(buffer);
-	return 2;
+	lua_Integer size = luaL_checkinteger(L, index);
+	luaL_argcheck(L, size >= 0 && size <= INT_MAX, index, "size out of range");
+	return (int)size;
 }
-REF_WRAP_MANUAL(wrap_fs_read);
 
-int wrap_fs_write(lua_State* L)
+// Reads are binary safe. Pass in a buffer to read into it instead of creating a new string,
+// which lets streaming code reuse the same memory every call. Returns nil if the buffer
+// can't grow to `size`.
+// 
+//     data, read = fs_read(file, size)
+//     read = fs_read(file, size, buffer)
+static int fs_read_impl(lua_State* L, CF_File* file, int size, int buffer_index)
 {
-	CF_File* file = (CF_File*)lua_touserdata(L, -3);
-	const char* data = lua_tostring(L, -2);
-	size_t size = lua_tointeger(L, -1);
-	size_t written = fs_write(file, data, size);
-	lua_pop(L, 3);
-	lua_pushinteger(L, written);
-	return 1;
+	if (REF_Buffer* buf = REF_LuaToBuffer(L, buffer_index)) {
+		if (!REF_BufferResize(buf, size)) {
+			lua_settop(L, 0);
+			return 0;
+		}
+		size_t read = fs_read(file, buf->data, size);
+		buf->size = (int)read;
+		lua_settop(L, 0);
+		lua_pushinteger(L, read);
+		return 1;
+	} else {
+		lua_settop(L, 0);
+		luaL_Buffer b;
+		char* data = luaL_buffinitsize(L, &b, size);
+		size_t read = fs_read(file, data, size);
+		luaL_pushresultsize(&b, read);
+		lua_pushinteger(L, read);
+		return 2;
+	}
 }
-REF_WRAP_MANUAL(wrap_fs_write);
 
-REF_FUNCTION(fs_eof);
-REF_FUNCTION(fs_tell);
+int wrap_fs_read(lua_State* L)
+{
+	CF_File* file = (CF_File*)lua_touserdata(L, 1);
+	int size = fs_check_read_size(L, 2);
+	return fs_read_impl(L, file, size, 3);
+}
+REF_WRAP_MANUAL(wrap_fs_read);
+
+// Seeks to `offset` and then reads, for chunked streaming of large files.
+// 
+//     data, read = fs_read_at(file, offset, size)
+//     read = fs_read_at(file, offset, size, buffer)
+int wrap_fs_read_at(lua_State* L)
+{
+	CF_File* file = (CF_File*)lua_touserdata(L, 1);
+	size_t offset = lua_tointeger(L, 2);
+	int size = fs_check_read_size(L, 3);
+	if (is_error(fs_seek(file, offset))) {
+		lua_settop(L, 0);
+		return 0;
+	}
+	return fs_read_impl(L, file, size, 4);
+}
+REF_WRAP_MANUAL(wrap_fs_read_at);
+
+// Writes a string or buffer. `size` is optional and defaults to the whole string/buffer.
+// 
+//     written = fs_write(file, data [, size])
+int wrap_fs_write(lua_State* L)
+{
+	CF_File* file = (CF_File*)lua_touserdata(L, 1);
+	const void* data = NULL;
+	size_t len = 0;
+	if (REF_Buffer* buf = REF_LuaToBuffer(L, 2)) {
+		data = buf->data;
+		len = buf->size;
+	} else {
+		data = lua_tolstring(L, 2, &len);
+	}
+	size_t size = lua_isnoneornil(L, 3) ? len : min((size_t)lua_tointeger(L, 3), len);
+	size_t written = fs_write(file, data, size);
+	lua_settop(L, 0);
+	lua_pushinteger(L, written);
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_fs_write);
+
+REF_FUNCTION(fs_eof);
+REF_FUNCTION(fs_tell);
+REF_FUNCTION(fs_seek);
 REF_FUNCTION(fs_size);
 
+// data, size = fs_read_entire_file(path)
 int wrap_fs_read_entire_file(lua_State* L)
 {
 	const char* path = lua_tostring(L, -1);
-	lua_pop(L, 1);
 	size_t sz = 0;
-	char* data = (char*)fs_read_entire_file_to_memory_and_nul_terminate(path, &sz);
+	void* data = fs_read_entire_file_to_memory(path, &sz);
+	lua_pop(L, 1);
 	if (!data) return 0;
-	lua_pushstring(L, data);
+	lua_pushlstring(L, (const char*)data, sz);
 	lua_pushinteger(L, sz);
+	cf_free(data);
 	return 2;
 }
 REF_WRAP_MANUAL(wrap_fs_read_entire_file);
 
+// Reads a whole file into a reusable buffer, returns the size read or nil on failure (including
+// files too large for a buffer).
+// 
+//     size = fs_read_entire_file_into(path, buffer)
+int wrap_fs_read_entire_file_into(lua_State* L)
+{
+	const char* path = lua_tostring(L, 1);
+	REF_Buffer* buf = (REF_Buffer*)luaL_checkudata(L, 2, "REF_Buffer");
+	CF_File* file = fs_open_file_for_read(path);
+	if (!file) {
+		lua_settop(L, 0);
+		return 0;
+	}
+	size_t size = fs_size(file);
+	if (size > INT_MAX || !REF_BufferResize(buf, (int)size)) {
+		fs_close(file);
+		lua_settop(L, 0);
+		return 0;
+	}
+	size_t read = fs_read(file, buf->data, size);
+	buf->size = (int)read;
+	fs_close(file);
+	lua_settop(L, 0);
+	lua_pushinteger(L, read);
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_fs_read_entire_file_into);
+
+#ifdef _WIN32
+	#ifndef WIN32_LEAN_AND_MEAN
+		#define WIN32_LEAN_AND_MEAN
+	#endif
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <Windows.h>
+#else
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+static size_t fs_page_size()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#else
+	return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// Maps an entire file read-only. Returns NULL for failure or empty files.
+static void* fs_map_native(const char* actual_path, size_t* size)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(actual_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return NULL;
+	LARGE_INTEGER sz;
+	void* data = NULL;
+	if (GetFileSizeEx(file, &sz) && sz.QuadPart > 0) {
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping) {
+			data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping); // The view keeps the mapping alive.
+		}
+		*size = (size_t)sz.QuadPart;
+	}
+	CloseHandle(file);
+	return data;
+#else
+	int fd = open(actual_path, O_RDONLY);
+	if (fd < 0) return NULL;
+	struct stat st;
+	void* data = NULL;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) data = NULL;
+		*size = (size_t)st.st_size;
+	}
+	close(fd);
+	return data;
+#endif
+}
+
+static void fs_unmap_native(void* data, size_t size)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap(data, size);
+#endif
+}
+
+// Called by Lua's GC once the external string dies, `osize` is the string length plus the NUL.
+static void* fs_unmap_string(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+	fs_unmap_native(ptr, osize - 1);
+	return NULL;
+}
+
+// Memory-maps a file and returns its contents as a Lua string pointing straight at the mapping,
+// with no copy. The file is unmapped when the string is garbage collected. Files that can't be
+// mapped, such as those inside of archives, fall back to a regular read. Returns nil on failure.
+//
+//     data = fs_map_file(path)
+int wrap_fs_map_file(lua_State* L)
+{
+	const char* path = lua_tostring(L, 1);
+	const char* dir = fs_get_actual_path(path);
+	if (!dir) {
+		lua_settop(L, 0);
+		return 0;
+	}
+	// fs_get_actual_path gives the real directory (or archive) the virtual path was found in.
+	size_t dir_len = strlen(dir);
+	bool has_slash = dir_len && (dir[dir_len - 1] == '/' || dir[dir_len - 1] == '\\');
+	String actual_path = String::fmt("%s%s%s", dir, has_slash || *path == '/' ? "" : "/", has_slash && *path == '/' ? path + 1 : path);
+	size_t size = 0;
+	void* data = fs_map_native(actual_path.c_str(), &size);
+	if (!data) {
+		// Not mappable (empty, in an archive, or mmap failed), so read it the regular way.
+		data = fs_read_entire_file_to_memory(path, &size);
+		bool exists = data || fs_file_exists(path);
+		lua_settop(L, 0);
+		if (!data) {
+			if (!exists) return 0;
+			lua_pushliteral(L, "");
+			return 1;
+		}
+		lua_pushlstring(L, (const char*)data, size);
+		cf_free(data);
+		return 1;
+	}
+	lua_settop(L, 0);
+	// Lua requires external strings to be NUL terminated. The tail of the last page past the end of
+	// the file is zero-filled, so it's free unless the file ends exactly on a page boundary.
+	if (size % fs_page_size()) {
+		lua_pushextlstring(L, (const char*)data, size, fs_unmap_string, NULL);
+	} else {
+		lua_pushlstring(L, (const char*)data, size);
+		fs_unmap_native(data, size);
+	}
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_fs_map_file);
+
 REF_FUNCTION(fs_get_backend_specific_error_message);
 REF_FUNCTION(fs_get_actual_path);
 const char* normalize_path(const char* path) { Path p = path; p.normalize(); return sintern(p.c_str()); } // @JANK "leaks" the intern'd string, oh well.
@@ -802,32 +2029,121 @@ REF_FUNCTION(https_response_headers);
 CF_KEY_BUTTON_DEFS
 CF_MOUSE_BUTTON_DEFS
 
-REF_FUNCTION(key_down);
-REF_FUNCTION(key_just_pressed);
-REF_FUNCTION(key_just_released);
-REF_FUNCTION(key_repeating);
-REF_FUNCTION(key_ctrl);
-REF_FUNCTION(key_shift);
-REF_FUNCTION(key_alt);
-REF_FUNCTION(key_gui);
+#define INPUT_MAX_JOYPADS 8
+#define INPUT_BITSET_WORDS(n) (((n) + 63) / 64)
+
+// Everything the input functions report for one frame, plus the timing globals. Filled from CF
+// while recording and from the file while replaying (see "Input recording"). Kept as plain data
+// so frames can be stored as bytewise deltas.
+struct InputFrame
+{
+	double seconds;
+	double prev_seconds;
+	double pause_time_left;
+	uint64_t ticks;
+	uint64_t prev_ticks;
+	float delta_time;
+	float delta_time_fixed;
+	float delta_time_interpolant;
+	int update_count; // Times app_update ran the update callback.
+	float mouse_x;
+	float mouse_y;
+	float wheel;
+	int joypad_count;
+	uint64_t down[INPUT_BITSET_WORDS(CF_KEY_COUNT)];
+	uint64_t pressed[INPUT_BITSET_WORDS(CF_KEY_COUNT)];
+	uint64_t released[INPUT_BITSET_WORDS(CF_KEY_COUNT)];
+	uint64_t repeating[INPUT_BITSET_WORDS(CF_KEY_COUNT)];
+	uint64_t mouse_down[1];
+	uint64_t mouse_pressed[1];
+	uint64_t mouse_released[1];
+	uint64_t double_clicked[1];
+	uint64_t double_click_held[1];
+	uint64_t joypad_down[INPUT_MAX_JOYPADS][INPUT_BITSET_WORDS(CF_JOYPAD_BUTTON_COUNT)];
+	uint64_t joypad_pressed[INPUT_MAX_JOYPADS][INPUT_BITSET_WORDS(CF_JOYPAD_BUTTON_COUNT)];
+	uint64_t joypad_released[INPUT_MAX_JOYPADS][INPUT_BITSET_WORDS(CF_JOYPAD_BUTTON_COUNT)];
+	int16_t axes[INPUT_MAX_JOYPADS][CF_JOYPAD_AXIS_COUNT];
+};
+
+bool g_input_replaying;
+InputFrame g_input_frame;
+InputFrame g_input_prev_frame;
+Array<int> g_input_text;  // Codepoints popped by the script, while recording or replaying.
+int g_input_text_head;
+
+static bool input_frame_bit(const uint64_t* bits, int i, int count)
+{
+	return i >= 0 && i < count && ((bits[i >> 6] >> (i & 63)) & 1);
+}
+
+static void input_frame_set_bit(uint64_t* bits, int i, bool on)
+{
+	if (on) bits[i >> 6] |= 1ull << (i & 63);
+}
+
+// The input functions below read from the replayed frame while a replay is running.
+
+bool wrap_key_down(CF_KeyButton key) { return g_input_replaying ? input_frame_bit(g_input_frame.down, key, CF_KEY_COUNT) : cf_key_down(key); }
+REF_FUNCTION_EX(key_down, wrap_key_down);
+bool wrap_key_just_pressed(CF_KeyButton key) { return g_input_replaying ? input_frame_bit(g_input_frame.pressed, key, CF_KEY_COUNT) : cf_key_just_pressed(key); }
+REF_FUNCTION_EX(key_just_pressed, wrap_key_just_pressed);
+bool wrap_key_just_released(CF_KeyButton key) { return g_input_replaying ? input_frame_bit(g_input_frame.released, key, CF_KEY_COUNT) : cf_key_just_released(key); }
+REF_FUNCTION_EX(key_just_released, wrap_key_just_released);
+bool wrap_key_repeating(CF_KeyButton key) { return g_input_replaying ? input_frame_bit(g_input_frame.repeating, key, CF_KEY_COUNT) : cf_key_repeating(key); }
+REF_FUNCTION_EX(key_repeating, wrap_key_repeating);
+bool wrap_key_ctrl() { return g_input_replaying ? wrap_key_down(CF_KEY_LCTRL) || wrap_key_down(CF_KEY_RCTRL) : cf_key_ctrl(); }
+REF_FUNCTION_EX(key_ctrl, wrap_key_ctrl);
+bool wrap_key_shift() { return g_input_replaying ? wrap_key_down(CF_KEY_LSHIFT) || wrap_key_down(CF_KEY_RSHIFT) : cf_key_shift(); }
+REF_FUNCTION_EX(key_shift, wrap_key_shift);
+bool wrap_key_alt() { return g_input_replaying ? wrap_key_down(CF_KEY_LALT) || wrap_key_down(CF_KEY_RALT) : cf_key_alt(); }
+REF_FUNCTION_EX(key_alt, wrap_key_alt);
+bool wrap_key_gui() { return g_input_replaying ? wrap_key_down(CF_KEY_LGUI) || wrap_key_down(CF_KEY_RGUI) : cf_key_gui(); }
+REF_FUNCTION_EX(key_gui, wrap_key_gui);
 REF_FUNCTION(clear_key_states);
 
-REF_FUNCTION(mouse_x);
-REF_FUNCTION(mouse_y);
-REF_FUNCTION(mouse_down);
-REF_FUNCTION(mouse_just_pressed);
-REF_FUNCTION(mouse_just_released);
-REF_FUNCTION(mouse_wheel_motion);
-REF_FUNCTION(mouse_double_click_held);
-REF_FUNCTION(mouse_double_clicked);
+float wrap_mouse_x() { return g_input_replaying ? g_input_frame.mouse_x : (float)cf_mouse_x(); }
+REF_FUNCTION_EX(mouse_x, wrap_mouse_x);
+float wrap_mouse_y() { return g_input_replaying ? g_input_frame.mouse_y : (float)cf_mouse_y(); }
+REF_FUNCTION_EX(mouse_y, wrap_mouse_y);
+bool wrap_mouse_down(CF_MouseButton button) { return g_input_replaying ? input_frame_bit(g_input_frame.mouse_down, button, CF_MOUSE_BUTTON_COUNT) : cf_mouse_down(button); }
+REF_FUNCTION_EX(mouse_down, wrap_mouse_down);
+bool wrap_mouse_just_pressed(CF_MouseButton button) { return g_input_replaying ? input_frame_bit(g_input_frame.mouse_pressed, button, CF_MOUSE_BUTTON_COUNT) : cf_mouse_just_pressed(button); }
+REF_FUNCTION_EX(mouse_just_pressed, wrap_mouse_just_pressed);
+bool wrap_mouse_just_released(CF_MouseButton button) { return g_input_replaying ? input_frame_bit(g_input_frame.mouse_released, button, CF_MOUSE_BUTTON_COUNT) : cf_mouse_just_released(button); }
+REF_FUNCTION_EX(mouse_just_released, wrap_mouse_just_released);
+float wrap_mouse_wheel_motion() { return g_input_replaying ? g_input_frame.wheel : (float)cf_mouse_wheel_motion(); }
+REF_FUNCTION_EX(mouse_wheel_motion, wrap_mouse_wheel_motion);
+bool wrap_mouse_double_click_held(CF_MouseButton button) { return g_input_replaying ? input_frame_bit(g_input_frame.double_click_held, button, CF_MOUSE_BUTTON_COUNT) : cf_mouse_double_click_held(button); }
+REF_FUNCTION_EX(mouse_double_click_held, wrap_mouse_double_click_held);
+bool wrap_mouse_double_clicked(CF_MouseButton button) { return g_input_replaying ? input_frame_bit(g_input_frame.double_clicked, button, CF_MOUSE_BUTTON_COUNT) : cf_mouse_double_clicked(button); }
+REF_FUNCTION_EX(mouse_double_clicked, wrap_mouse_double_clicked);
 REF_FUNCTION(mouse_hide);
 REF_FUNCTION(mouse_hidden);
 REF_FUNCTION(mouse_lock_inside_window);
 
+// Text input is recorded as the codepoints the script actually pops, so replays see the same text
+// no matter how SDL batched the events.
+bool g_input_recording;
+
 REF_FUNCTION(input_text_add_utf8);
-REF_FUNCTION(input_text_pop_utf32);
-REF_FUNCTION(input_text_has_data);
-REF_FUNCTION(input_text_clear);
+int wrap_input_text_pop_utf32()
+{
+	if (g_input_replaying) {
+		return g_input_text_head < g_input_text.count() ? g_input_text[g_input_text_head++] : 0;
+	}
+	int cp = cf_input_text_pop_utf32();
+	if (g_input_recording && cp) g_input_text.add(cp);
+	return cp;
+}
+REF_FUNCTION_EX(input_text_pop_utf32, wrap_input_text_pop_utf32);
+bool wrap_input_text_has_data() { return g_input_replaying ? g_input_text_head < g_input_text.count() : cf_input_text_has_data(); }
+REF_FUNCTION_EX(input_text_has_data, wrap_input_text_has_data);
+void wrap_input_text_clear()
+{
+	if (g_input_replaying) g_input_text_head = g_input_text.count();
+	else cf_input_text_clear();
+}
+REF_FUNCTION_EX(input_text_clear, wrap_input_text_clear);
 
 REF_FUNCTION(input_enable_ime);
 REF_FUNCTION(input_disable_ime);
@@ -888,8 +2204,10 @@ CF_JOYPAD_BUTTON_DEFS
 CF_JOYPAD_AXIS_DEFS
 
 REF_FUNCTION(joypad_add_mapping);
-REF_FUNCTION(joypad_count);
-REF_FUNCTION(joypad_is_connected);
+int wrap_joypad_count() { return g_input_replaying ? g_input_frame.joypad_count : cf_joypad_count(); }
+REF_FUNCTION_EX(joypad_count, wrap_joypad_count);
+bool wrap_joypad_is_connected(int index) { return g_input_replaying ? index >= 0 && index < g_input_frame.joypad_count : cf_joypad_is_connected(index); }
+REF_FUNCTION_EX(joypad_is_connected, wrap_joypad_is_connected);
 REF_FUNCTION(joypad_power_level);
 REF_FUNCTION(joypad_name);
 REF_FUNCTION(joypad_type);
@@ -898,63 +2216,804 @@ REF_FUNCTION(joypad_product_id);
 REF_FUNCTION(joypad_serial_number);
 REF_FUNCTION(joypad_firmware_version);
 REF_FUNCTION(joypad_product_version);
-REF_FUNCTION(joypad_button_down);
-REF_FUNCTION(joypad_button_just_pressed);
-REF_FUNCTION(joypad_button_just_released);
-REF_FUNCTION(joypad_axis);
-REF_FUNCTION(joypad_axis_prev);
+bool wrap_joypad_button_down(int index, CF_JoypadButton button) { return g_input_replaying ? wrap_joypad_is_connected(index) && input_frame_bit(g_input_frame.joypad_down[index], button, CF_JOYPAD_BUTTON_COUNT) : cf_joypad_button_down(index, button); }
+REF_FUNCTION_EX(joypad_button_down, wrap_joypad_button_down);
+bool wrap_joypad_button_just_pressed(int index, CF_JoypadButton button) { return g_input_replaying ? wrap_joypad_is_connected(index) && input_frame_bit(g_input_frame.joypad_pressed[index], button, CF_JOYPAD_BUTTON_COUNT) : cf_joypad_button_just_pressed(index, button); }
+REF_FUNCTION_EX(joypad_button_just_pressed, wrap_joypad_button_just_pressed);
+bool wrap_joypad_button_just_released(int index, CF_JoypadButton button) { return g_input_replaying ? wrap_joypad_is_connected(index) && input_frame_bit(g_input_frame.joypad_released[index], button, CF_JOYPAD_BUTTON_COUNT) : cf_joypad_button_just_released(index, button); }
+REF_FUNCTION_EX(joypad_button_just_released, wrap_joypad_button_just_released);
+int16_t wrap_joypad_axis(int index, CF_JoypadAxis axis)
+{
+	if (!g_input_replaying) return cf_joypad_axis(index, axis);
+	return wrap_joypad_is_connected(index) && axis >= 0 && axis < CF_JOYPAD_AXIS_COUNT ? g_input_frame.axes[index][axis] : 0;
+}
+REF_FUNCTION_EX(joypad_axis, wrap_joypad_axis);
+int16_t wrap_joypad_axis_prev(int index, CF_JoypadAxis axis)
+{
+	if (!g_input_replaying) return cf_joypad_axis_prev(index, axis);
+	return index >= 0 && index < g_input_prev_frame.joypad_count && axis >= 0 && axis < CF_JOYPAD_AXIS_COUNT ? g_input_prev_frame.axes[index][axis] : 0;
+}
+REF_FUNCTION_EX(joypad_axis_prev, wrap_joypad_axis_prev);
 REF_FUNCTION(joypad_rumble);
 
+// -------------------------------------------------------------------------------------------------
+// Input snapshots
+
+// One call per frame fetches all input state into a single table, reused every frame, so scripts
+// index plain Lua tables instead of making dozens of bound calls. C remembers what it wrote last
+// time and only touches entries that changed. Flag tables hold `true` or nil, keyed by the usual
+// KEY_*, MOUSE_BUTTON_* and JOYPAD_BUTTON_* constants.
+//
+//     snap = input_snapshot()
+//     snap.time                                            -- CF_SECONDS when taken.
+//     snap.down[k], snap.pressed[k], snap.released[k], snap.repeating[k]
+//     snap.mouse_x, snap.mouse_y, snap.wheel
+//     snap.mouse_down[b], snap.mouse_pressed[b], snap.mouse_released[b], snap.double_clicked[b]
+//     snap.touches[i]                                      -- { id, x, y, pressure }
+//     snap.joypad_count
+//     snap.joypads[i].down[b], .pressed[b], .released[b], .axes[a] -- i starts at 1, a is JOYPAD_AXIS_* + 1.
+
+struct InputJoypadBits
+{
+	uint64_t down[INPUT_BITSET_WORDS(CF_JOYPAD_BUTTON_COUNT)];
+	uint64_t pressed[INPUT_BITSET_WORDS(CF_JOYPAD_BUTTON_COUNT)];
+	uint64_t released[INPUT_BITSET_WORDS(CF_JOYPAD_BUTTON_COUNT)];
+};
+
+struct InputSnapshotBits
+{
+	uint64_t down[INPUT_BITSET_WORDS(CF_KEY_COUNT)];
+	uint64_t pressed[INPUT_BITSET_WORDS(CF_KEY_COUNT)];
+	uint64_t released[INPUT_BITSET_WORDS(CF_KEY_COUNT)];
+	uint64_t repeating[INPUT_BITSET_WORDS(CF_KEY_COUNT)];
+	uint64_t mouse_down[1];
+	uint64_t mouse_pressed[1];
+	uint64_t mouse_released[1];
+	uint64_t double_clicked[1];
+	InputJoypadBits joypads[INPUT_MAX_JOYPADS];
+};
+
+InputSnapshotBits g_input_bits;
+int g_input_snapshot_ref = LUA_NOREF;
+int g_input_touch_count;
+
+// Writes `true`/nil into the table field `field` (of the table at the stack top) for each index
+// whose flag changed since the last snapshot.
+template <typename F>
+static void input_snapshot_flags(lua_State* L, const char* field, uint64_t* bits, int count, const F& is_set)
+{
+	lua_getfield(L, -1, field);
+	for (int i = 0; i < count; ++i) {
+		bool now = is_set(i);
+		uint64_t mask = 1ull << (i & 63);
+		if (now == !!(bits[i >> 6] & mask)) continue;
+		bits[i >> 6] ^= mask;
+		if (now) lua_pushboolean(L, 1);
+		else lua_pushnil(L);
+		lua_rawseti(L, -2, i);
+	}
+	lua_pop(L, 1);
+}
+
+static void input_snapshot_new_table(lua_State* L, const char* field)
+{
+	lua_newtable(L);
+	lua_setfield(L, -2, field);
+}
+
+static void input_snapshot_create(lua_State* L)
+{
+	lua_newtable(L);
+	const char* fields[] = { "down", "pressed", "released", "repeating", "mouse_down", "mouse_pressed", "mouse_released", "double_clicked", "touches" };
+	for (int i = 0; i < (int)(sizeof(fields) / sizeof(*fields)); ++i) input_snapshot_new_table(L, fields[i]);
+	lua_createtable(L, INPUT_MAX_JOYPADS, 0);
+	for (int i = 0; i < INPUT_MAX_JOYPADS; ++i) {
+		lua_newtable(L);
+		input_snapshot_new_table(L, "down");
+		input_snapshot_new_table(L, "pressed");
+		input_snapshot_new_table(L, "released");
+		input_snapshot_new_table(L, "axes");
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "joypads");
+	CF_MEMSET(&g_input_bits, 0, sizeof(g_input_bits));
+	g_input_touch_count = 0;
+}
+
+int wrap_input_snapshot(lua_State* L)
+{
+	lua_settop(L, 0);
+	if (g_input_snapshot_ref == LUA_NOREF) {
+		input_snapshot_create(L);
+		lua_pushvalue(L, -1);
+		g_input_snapshot_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	} else {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, g_input_snapshot_ref);
+	}
+
+	lua_pushnumber(L, CF_SECONDS);
+	lua_setfield(L, -2, "time");
+
+	input_snapshot_flags(L, "down", g_input_bits.down, CF_KEY_COUNT, [](int i) { return wrap_key_down((CF_KeyButton)i); });
+	input_snapshot_flags(L, "pressed", g_input_bits.pressed, CF_KEY_COUNT, [](int i) { return wrap_key_just_pressed((CF_KeyButton)i); });
+	input_snapshot_flags(L, "released", g_input_bits.released, CF_KEY_COUNT, [](int i) { return wrap_key_just_released((CF_KeyButton)i); });
+	input_snapshot_flags(L, "repeating", g_input_bits.repeating, CF_KEY_COUNT, [](int i) { return wrap_key_repeating((CF_KeyButton)i); });
+
+	lua_pushnumber(L, wrap_mouse_x());
+	lua_setfield(L, -2, "mouse_x");
+	lua_pushnumber(L, wrap_mouse_y());
+	lua_setfield(L, -2, "mouse_y");
+	lua_pushnumber(L, wrap_mouse_wheel_motion());
+	lua_setfield(L, -2, "wheel");
+	input_snapshot_flags(L, "mouse_down", g_input_bits.mouse_down, CF_MOUSE_BUTTON_COUNT, [](int i) { return wrap_mouse_down((CF_MouseButton)i); });
+	input_snapshot_flags(L, "mouse_pressed", g_input_bits.mouse_pressed, CF_MOUSE_BUTTON_COUNT, [](int i) { return wrap_mouse_just_pressed((CF_MouseButton)i); });
+	input_snapshot_flags(L, "mouse_released", g_input_bits.mouse_released, CF_MOUSE_BUTTON_COUNT, [](int i) { return wrap_mouse_just_released((CF_MouseButton)i); });
+	input_snapshot_flags(L, "double_clicked", g_input_bits.double_clicked, CF_MOUSE_BUTTON_COUNT, [](int i) { return wrap_mouse_double_clicked((CF_MouseButton)i); });
+
+	// Touch tables are reused, and trailing entries dropped when fingers lift.
+	CF_Touch* touches = NULL;
+	int touch_count = cf_touch_get_all(&touches);
+	lua_getfield(L, -1, "touches");
+	for (int i = 0; i < touch_count; ++i) {
+		if (lua_rawgeti(L, -1, i + 1) != LUA_TTABLE) {
+			lua_pop(L, 1);
+			lua_createtable(L, 0, 4);
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, -3, i + 1);
+		}
+		lua_pushinteger(L, (lua_Integer)touches[i].id);
+		lua_setfield(L, -2, "id");
+		lua_pushnumber(L, touches[i].x);
+		lua_setfield(L, -2, "x");
+		lua_pushnumber(L, touches[i].y);
+		lua_setfield(L, -2, "y");
+		lua_pushnumber(L, touches[i].pressure);
+		lua_setfield(L, -2, "pressure");
+		lua_pop(L, 1);
+	}
+	for (int i = touch_count; i < g_input_touch_count; ++i) {
+		lua_pushnil(L);
+		lua_rawseti(L, -2, i + 1);
+	}
+	g_input_touch_count = touch_count;
+	lua_pop(L, 1);
+
+	// Disconnected joypads report nothing held and zeroed axes.
+	int joypad_count = min(wrap_joypad_count(), INPUT_MAX_JOYPADS);
+	lua_pushinteger(L, joypad_count);
+	lua_setfield(L, -2, "joypad_count");
+	lua_getfield(L, -1, "joypads");
+	for (int j = 0; j < INPUT_MAX_JOYPADS; ++j) {
+		bool connected = j < joypad_count;
+		InputJoypadBits* bits = g_input_bits.joypads + j;
+		lua_rawgeti(L, -1, j + 1);
+		input_snapshot_flags(L, "down", bits->down, CF_JOYPAD_BUTTON_COUNT, [=](int i) { return connected && wrap_joypad_button_down(j, (CF_JoypadButton)i); });
+		input_snapshot_flags(L, "pressed", bits->pressed, CF_JOYPAD_BUTTON_COUNT, [=](int i) { return connected && wrap_joypad_button_just_pressed(j, (CF_JoypadButton)i); });
+		input_snapshot_flags(L, "released", bits->released, CF_JOYPAD_BUTTON_COUNT, [=](int i) { return connected && wrap_joypad_button_just_released(j, (CF_JoypadButton)i); });
+		lua_getfield(L, -1, "axes");
+		for (int i = 0; i < CF_JOYPAD_AXIS_COUNT; ++i) {
+			lua_pushnumber(L, connected ? (lua_Number)wrap_joypad_axis(j, (CF_JoypadAxis)i) : 0);
+			lua_rawseti(L, -2, i + 1);
+		}
+		lua_pop(L, 2);
+	}
+	lua_pop(L, 1);
+
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_input_snapshot);
+
+// A ring of timestamped press/release events, recorded once per frame by app_update, for buffered
+// input such as "attack was pressed within the last 150ms". Timestamps are CF_SECONDS of the frame
+// the event was seen on.
+//
+//     t = input_buffered(INPUT_EVENT_KEY_PRESSED, KEY_X, 0.15 [, consume [, device]])
+//     events = input_events(since_seconds) -- { { time=, kind=, code=, device= }, ... } oldest first.
+
+enum InputEventKind
+{
+	INPUT_EVENT_KEY_PRESSED,
+	INPUT_EVENT_KEY_RELEASED,
+	INPUT_EVENT_MOUSE_PRESSED,
+	INPUT_EVENT_MOUSE_RELEASED,
+	INPUT_EVENT_JOYPAD_PRESSED,
+	INPUT_EVENT_JOYPAD_RELEASED,
+};
+REF_CONSTANT(INPUT_EVENT_KEY_PRESSED);
+REF_CONSTANT(INPUT_EVENT_KEY_RELEASED);
+REF_CONSTANT(INPUT_EVENT_MOUSE_PRESSED);
+REF_CONSTANT(INPUT_EVENT_MOUSE_RELEASED);
+REF_CONSTANT(INPUT_EVENT_JOYPAD_PRESSED);
+REF_CONSTANT(INPUT_EVENT_JOYPAD_RELEASED);
+
+struct InputEvent
+{
+	double time;
+	InputEventKind kind;
+	int code;
+	int device; // Joypad index, or zero for keyboard/mouse.
+	bool consumed;
+};
+
+#define INPUT_EVENT_RING_CAPACITY 256
+
+InputEvent g_input_events[INPUT_EVENT_RING_CAPACITY];
+int g_input_event_total; // Events ever recorded, the ring holds the last INPUT_EVENT_RING_CAPACITY of them.
+
+static void input_push_event(InputEventKind kind, int code, int device)
+{
+	InputEvent* e = g_input_events + (g_input_event_total++ % INPUT_EVENT_RING_CAPACITY);
+	e->time = CF_SECONDS;
+	e->kind = kind;
+	e->code = code;
+	e->device = device;
+	e->consumed = false;
+}
+
+// Called from app_update after CF has polled input for the frame.
+static void input_record_events()
+{
+	for (int i = 0; i < CF_KEY_COUNT; ++i) {
+		if (wrap_key_just_pressed((CF_KeyButton)i)) input_push_event(INPUT_EVENT_KEY_PRESSED, i, 0);
+		if (wrap_key_just_released((CF_KeyButton)i)) input_push_event(INPUT_EVENT_KEY_RELEASED, i, 0);
+	}
+	for (int i = 0; i < CF_MOUSE_BUTTON_COUNT; ++i) {
+		if (wrap_mouse_just_pressed((CF_MouseButton)i)) input_push_event(INPUT_EVENT_MOUSE_PRESSED, i, 0);
+		if (wrap_mouse_just_released((CF_MouseButton)i)) input_push_event(INPUT_EVENT_MOUSE_RELEASED, i, 0);
+	}
+	int joypad_count = wrap_joypad_count();
+	for (int j = 0; j < joypad_count; ++j) {
+		for (int i = 0; i < CF_JOYPAD_BUTTON_COUNT; ++i) {
+			if (wrap_joypad_button_just_pressed(j, (CF_JoypadButton)i)) input_push_event(INPUT_EVENT_JOYPAD_PRESSED, i, j);
+			if (wrap_joypad_button_just_released(j, (CF_JoypadButton)i)) input_push_event(INPUT_EVENT_JOYPAD_RELEASED, i, j);
+		}
+	}
+}
+
+// Returns the time of the newest unconsumed matching event within `window` seconds, or nil.
+int wrap_input_buffered(lua_State* L)
+{
+	InputEventKind kind = (InputEventKind)luaL_checkinteger(L, 1);
+	int code = (int)luaL_checkinteger(L, 2);
+	double window = luaL_checknumber(L, 3);
+	bool consume = lua_toboolean(L, 4);
+	int device = (int)luaL_optinteger(L, 5, 0);
+	lua_settop(L, 0);
+	int oldest = max(0, g_input_event_total - INPUT_EVENT_RING_CAPACITY);
+	for (int i = g_input_event_total - 1; i >= oldest; --i) {
+		InputEvent* e = g_input_events + (i % INPUT_EVENT_RING_CAPACITY);
+		if (CF_SECONDS - e->time > window) break;
+		if (e->consumed || e->kind != kind || e->code != code || e->device != device) continue;
+		if (consume) e->consumed = true;
+		lua_pushnumber(L, e->time);
+		return 1;
+	}
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_input_buffered);
+
+int wrap_input_events(lua_State* L)
+{
+	double since = luaL_optnumber(L, 1, 0);
+	lua_settop(L, 0);
+	int first = g_input_event_total;
+	int oldest = max(0, g_input_event_total - INPUT_EVENT_RING_CAPACITY);
+	while (first > oldest && g_input_events[(first - 1) % INPUT_EVENT_RING_CAPACITY].time >= since) --first;
+	lua_createtable(L, g_input_event_total - first, 0);
+	for (int i = first; i < g_input_event_total; ++i) {
+		InputEvent* e = g_input_events + (i % INPUT_EVENT_RING_CAPACITY);
+		lua_createtable(L, 0, 4);
+		lua_pushnumber(L, e->time);
+		lua_setfield(L, -2, "time");
+		lua_pushinteger(L, e->kind);
+		lua_setfield(L, -2, "kind");
+		lua_pushinteger(L, e->code);
+		lua_setfield(L, -2, "code");
+		lua_pushinteger(L, e->device);
+		lua_setfield(L, -2, "device");
+		lua_rawseti(L, -2, i - first + 1);
+	}
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_input_events);
+
+void input_clear_events() { g_input_event_total = 0; }
+REF_FUNCTION(input_clear_events);
+
+// -------------------------------------------------------------------------------------------------
+// Input recording
+
+// Records every frame's input and timing globals to a file, then replays them so performance runs
+// are repeatable. While replaying, app_update takes input and time from the file instead of CF. It
+// also runs the update callback as many times as it ran during recording, so replays can run
+// headless and as fast as possible (`--headless --fast --replay session.bin`). Frame times are
+// collected while recording or replaying, to compare the distributions of different builds.
+//
+//     input_record_start("session.bin")
+//     input_record_stop()
+//     ok, error = input_replay_start("session.bin" [, quit_when_done])
+//     stats = frame_time_stats()    -- { count=, mean=, min=, max=, p50=, p90=, p99=, p999= } in milliseconds.
+//     times = frame_times([buffer]) -- f32 milliseconds, one per frame.
+//
+// A file is a header followed by one record per frame. Each record is the InputFrame XOR'd against
+// the previous frame, written as runs of (u16 unchanged bytes, u16 changed bytes, changed bytes).
+// After that come the popped text codepoints. Paths are OS paths, not virtual file system paths, so
+// they can come straight from the command line.
+
+#define INPUT_RECORDING_MAGIC 0x52494643 // "CFIR"
+#define INPUT_RECORDING_VERSION 1
+
+struct InputRecordingHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t frame_size;
+};
+
+FILE* g_input_record_file;
+bool g_input_record_pending; // Set once a frame is captured, it's written after the text popped during it.
+Array<uint8_t> g_input_record_bytes;
+Array<uint8_t> g_input_replay_data;
+int g_input_replay_pos;
+bool g_input_replay_quit_when_done;
+uint64_t g_input_replay_start_ticks;
+double g_input_replay_start_seconds;
+int g_input_update_count; // Update callbacks run by the current app_update.
+
+Array<float> g_frame_times;
+bool g_frame_times_enabled;
+uint64_t g_frame_last_ticks;
+
+static void input_frame_capture(InputFrame* f)
+{
+	CF_MEMSET(f, 0, sizeof(*f));
+	f->seconds = CF_SECONDS;
+	f->prev_seconds = CF_PREV_SECONDS;
+	f->pause_time_left = CF_PAUSE_TIME_LEFT;
+	f->ticks = CF_TICKS;
+	f->prev_ticks = CF_PREV_TICKS;
+	f->delta_time = CF_DELTA_TIME;
+	f->delta_time_fixed = CF_DELTA_TIME_FIXED;
+	f->delta_time_interpolant = CF_DELTA_TIME_INTERPOLANT;
+	f->update_count = g_input_update_count;
+	for (int i = 0; i < CF_KEY_COUNT; ++i) {
+		input_frame_set_bit(f->down, i, cf_key_down((CF_KeyButton)i));
+		input_frame_set_bit(f->pressed, i, cf_key_just_pressed((CF_KeyButton)i));
+		input_frame_set_bit(f->released, i, cf_key_just_released((CF_KeyButton)i));
+		input_frame_set_bit(f->repeating, i, cf_key_repeating((CF_KeyButton)i));
+	}
+	f->mouse_x = (float)cf_mouse_x();
+	f->mouse_y = (float)cf_mouse_y();
+	f->wheel = (float)cf_mouse_wheel_motion();
+	for (int i = 0; i < CF_MOUSE_BUTTON_COUNT; ++i) {
+		input_frame_set_bit(f->mouse_down, i, cf_mouse_down((CF_MouseButton)i));
+		input_frame_set_bit(f->mouse_pressed, i, cf_mouse_just_pressed((CF_MouseButton)i));
+		input_frame_set_bit(f->mouse_released, i, cf_mouse_just_released((CF_MouseButton)i));
+		input_frame_set_bit(f->double_clicked, i, cf_mouse_double_clicked((CF_MouseButton)i));
+		input_frame_set_bit(f->double_click_held, i, cf_mouse_double_click_held((CF_MouseButton)i));
+	}
+	f->joypad_count = min(cf_joypad_count(), INPUT_MAX_JOYPADS);
+	for (int j = 0; j < f->joypad_count; ++j) {
+		for (int i = 0; i < CF_JOYPAD_BUTTON_COUNT; ++i) {
+			input_frame_set_bit(f->joypad_down[j], i, cf_joypad_button_down(j, (CF_JoypadButton)i));
+			input_frame_set_bit(f->joypad_pressed[j], i, cf_joypad_button_just_pressed(j, (CF_JoypadButton)i));
+			input_frame_set_bit(f->joypad_released[j], i, cf_joypad_button_just_released(j, (CF_JoypadButton)i));
+		}
+		for (int i = 0; i < CF_JOYPAD_AXIS_COUNT; ++i) {
+			f->axes[j][i] = cf_joypad_axis(j, (CF_JoypadAxis)i);
+		}
+	}
+}
+
+static void input_frame_encode(Array<uint8_t>* out, const InputFrame* frame, const InputFrame* prev)
+{
+	const uint8_t* a = (const uint8_t*)frame;
+	const uint8_t* b = (const uint8_t*)prev;
+	int n = (int)sizeof(InputFrame);
+	for (int i = 0; i < n;) {
+		int start = i;
+		while (i < n && a[i] == b[i] && i - start < 0xFFFF) ++i;
+		REF_EncodeValue(out, (uint16_t)(i - start));
+		start = i;
+		while (i < n && a[i] != b[i] && i - start < 0xFFFF) ++i;
+		REF_EncodeValue(out, (uint16_t)(i - start));
+		for (int j = start; j < i; ++j) out->add(a[j] ^ b[j]);
+	}
+}
+
+// Applies one encoded frame on top of `frame`, which holds the previous frame.
+static bool input_frame_decode(const uint8_t** p, const uint8_t* end, InputFrame* frame)
+{
+	uint8_t* a = (uint8_t*)frame;
+	int n = (int)sizeof(InputFrame);
+	for (int i = 0; i < n;) {
+		uint16_t same, changed;
+		if (!REF_DecodeBytes(p, end, &same, sizeof(same)) || !REF_DecodeBytes(p, end, &changed, sizeof(changed))) return false;
+		if (!same && !changed) return false;
+		if (i + same + changed > n || end - *p < changed) return false;
+		i += same;
+		for (int j = 0; j < changed; ++j) a[i++] ^= *(*p)++;
+	}
+	return true;
+}
+
+static void input_record_write_pending()
+{
+	if (!g_input_record_pending) return;
+	g_input_record_bytes.clear();
+	input_frame_encode(&g_input_record_bytes, &g_input_frame, &g_input_prev_frame);
+	REF_EncodeValue(&g_input_record_bytes, (uint32_t)g_input_text.count());
+	REF_EncodeBytes(&g_input_record_bytes, g_input_text.data(), g_input_text.count() * (int)sizeof(int));
+	fwrite(g_input_record_bytes.data(), 1, g_input_record_bytes.count(), g_input_record_file);
+	g_input_prev_frame = g_input_frame;
+	g_input_text.clear();
+	g_input_record_pending = false;
+}
+
+void frame_times_reset()
+{
+	g_frame_times.clear();
+	g_frame_times_enabled = true;
+	g_frame_last_ticks = 0;
+}
+REF_FUNCTION(frame_times_reset);
+
+// Called at the start of every app_update.
+static void input_recording_frame_begin()
+{
+	uint64_t now = get_ticks();
+	if (g_frame_times_enabled && g_frame_last_ticks) {
+		g_frame_times.add((float)((double)(now - g_frame_last_ticks) * 1000.0 / (double)get_tick_frequency()));
+	}
+	g_frame_last_ticks = now;
+	g_input_update_count = 0;
+	if (g_input_record_file) input_record_write_pending();
+}
+
+// Called at the end of every app_update, after CF polled input and the update callbacks ran.
+static void input_recording_frame_end()
+{
+	if (!g_input_record_file) return;
+	input_frame_capture(&g_input_frame);
+	g_input_record_pending = true;
+}
+
+void input_record_stop()
+{
+	if (!g_input_record_file) return;
+	input_record_write_pending();
+	fclose(g_input_record_file);
+	g_input_record_file = NULL;
+	g_input_recording = false;
+	g_input_text.clear();
+}
+REF_FUNCTION(input_record_stop);
+
+void input_replay_stop()
+{
+	g_input_replaying = false;
+	g_input_replay_data = Array<uint8_t>();
+	g_input_text.clear();
+	g_input_text_head = 0;
+}
+REF_FUNCTION(input_replay_stop);
+
+bool input_replay_is_active() { return g_input_replaying; }
+REF_FUNCTION(input_replay_is_active);
+
+bool input_record_start(const char* path)
+{
+	input_record_stop();
+	input_replay_stop();
+	g_input_record_file = fopen(path, "wb");
+	if (!g_input_record_file) return false;
+	InputRecordingHeader header = { INPUT_RECORDING_MAGIC, INPUT_RECORDING_VERSION, (uint32_t)sizeof(InputFrame) };
+	fwrite(&header, sizeof(header), 1, g_input_record_file);
+	CF_MEMSET(&g_input_frame, 0, sizeof(g_input_frame));
+	CF_MEMSET(&g_input_prev_frame, 0, sizeof(g_input_prev_frame));
+	g_input_record_pending = false;
+	g_input_recording = true;
+	g_input_text.clear();
+	frame_times_reset();
+	return true;
+}
+REF_FUNCTION(input_record_start);
+
+// Returns NULL on success, or an error message.
+const char* input_replay_begin(const char* path, bool quit_when_done)
+{
+	input_record_stop();
+	input_replay_stop();
+	FILE* fp = fopen(path, "rb");
+	if (!fp) return "Unable to open the recording.";
+	Array<uint8_t> data;
+	uint8_t chunk[4096];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) REF_EncodeBytes(&data, chunk, (int)n);
+	fclose(fp);
+	InputRecordingHeader header;
+	const uint8_t* p = data.data();
+	if (!REF_DecodeBytes(&p, p + data.count(), &header, sizeof(header)) || header.magic != INPUT_RECORDING_MAGIC) return "Not an input recording.";
+	if (header.version != INPUT_RECORDING_VERSION || header.frame_size != sizeof(InputFrame)) return "The recording was made by a different version.";
+	g_input_replay_data.steal_from(&data);
+	g_input_replay_pos = sizeof(header);
+	g_input_replay_quit_when_done = quit_when_done;
+	g_input_replay_start_ticks = 0;
+	CF_MEMSET(&g_input_frame, 0, sizeof(g_input_frame));
+	CF_MEMSET(&g_input_prev_frame, 0, sizeof(g_input_prev_frame));
+	g_input_replaying = true;
+	frame_times_reset();
+	return NULL;
+}
+
+int wrap_input_replay_start(lua_State* L)
+{
+	const char* path = luaL_checkstring(L, 1);
+	bool quit_when_done = lua_toboolean(L, 2);
+	const char* error = input_replay_begin(path, quit_when_done);
+	lua_settop(L, 0);
+	lua_pushboolean(L, !error);
+	if (!error) return 1;
+	lua_pushstring(L, error);
+	return 2;
+}
+REF_WRAP_MANUAL(wrap_input_replay_start);
+
+// Loads the next frame, or returns false once the recording runs out.
+static bool input_replay_next_frame()
+{
+	const uint8_t* start = g_input_replay_data.data();
+	const uint8_t* end = start + g_input_replay_data.count();
+	const uint8_t* p = start + g_input_replay_pos;
+	if (p == end) return false;
+	g_input_prev_frame = g_input_frame;
+	uint32_t text_count;
+	if (!input_frame_decode(&p, end, &g_input_frame)) return false;
+	if (!REF_DecodeBytes(&p, end, &text_count, sizeof(text_count)) || (uint32_t)(end - p) / sizeof(int) < text_count) return false;
+	g_input_text.set_count((int)text_count);
+	CF_MEMCPY(g_input_text.data(), p, text_count * sizeof(int));
+	g_input_text_head = 0;
+	g_input_replay_pos = (int)(p + text_count * sizeof(int) - start);
+	return true;
+}
+
+// Stands in for app_update while replaying. Returns false once the replay is over and the frame
+// should run normally instead.
+static bool input_replay_app_update(void (*fn)(void*))
+{
+	if (!g_headless) app_update(NULL); // Keeps the window responsive, its input and time are ignored.
+	if (!input_replay_next_frame()) {
+		input_replay_stop();
+		if (!g_input_replay_quit_when_done) return false;
+		app_signal_shutdown();
+		return true;
+	}
+	const InputFrame* f = &g_input_frame;
+	CF_SECONDS = f->seconds;
+	CF_PREV_SECONDS = f->prev_seconds;
+	CF_PAUSE_TIME_LEFT = f->pause_time_left;
+	CF_TICKS = f->ticks;
+	CF_PREV_TICKS = f->prev_ticks;
+	CF_DELTA_TIME = f->delta_time;
+	CF_DELTA_TIME_FIXED = f->delta_time_fixed;
+	CF_DELTA_TIME_INTERPOLANT = f->delta_time_interpolant;
+	for (int i = 0; fn && i < f->update_count; ++i) {
+		fn(NULL);
+	}
+	if (!g_headless_fast) {
+		// Keep the recorded pace.
+		uint64_t frequency = get_tick_frequency();
+		if (!g_input_replay_start_ticks) {
+			g_input_replay_start_ticks = get_ticks();
+			g_input_replay_start_seconds = f->seconds;
+		}
+		uint64_t target = g_input_replay_start_ticks + (uint64_t)((f->seconds - g_input_replay_start_seconds) * (double)frequency);
+		uint64_t now = get_ticks();
+		if (now < target) cf_sleep((int)((target - now) * 1000 / frequency));
+	}
+	return true;
+}
+
+static int frame_time_compare(const void* a, const void* b)
+{
+	float x = *(const float*)a, y = *(const float*)b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Summarizes the frame times since the last record/replay start or frame_times_reset.
+int wrap_frame_time_stats(lua_State* L)
+{
+	lua_settop(L, 0);
+	int count = g_frame_times.count();
+	Array<float> sorted;
+	sorted.set_count(count);
+	if (count) CF_MEMCPY(sorted.data(), g_frame_times.data(), count * sizeof(float));
+	qsort(sorted.data(), count, sizeof(float), frame_time_compare);
+	double sum = 0;
+	for (int i = 0; i < count; ++i) sum += sorted[i];
+	auto percentile = [&](double p) { return count ? sorted[min(count - 1, (int)(p * count))] : 0.0f; };
+	lua_createtable(L, 0, 8);
+	lua_pushinteger(L, count);
+	lua_setfield(L, -2, "count");
+	lua_pushnumber(L, count ? sum / count : 0);
+	lua_setfield(L, -2, "mean");
+	lua_pushnumber(L, count ? sorted[0] : 0);
+	lua_setfield(L, -2, "min");
+	lua_pushnumber(L, count ? sorted[count - 1] : 0);
+	lua_setfield(L, -2, "max");
+	lua_pushnumber(L, percentile(0.5));
+	lua_setfield(L, -2, "p50");
+	lua_pushnumber(L, percentile(0.9));
+	lua_setfield(L, -2, "p90");
+	lua_pushnumber(L, percentile(0.99));
+	lua_setfield(L, -2, "p99");
+	lua_pushnumber(L, percentile(0.999));
+	lua_setfield(L, -2, "p999");
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_frame_time_stats);
+
+// times = frame_times([buffer])
+int wrap_frame_times(lua_State* L)
+{
+	REF_Buffer* buf = REF_LuaToBuffer(L, 1);
+	if (buf) {
+		lua_settop(L, 1);
+	} else {
+		lua_settop(L, 0);
+		buf = REF_LuaPushBuffer(L, 0);
+	}
+	int size = g_frame_times.count() * (int)sizeof(float);
+	REF_BufferResize(buf, size);
+	if (size) CF_MEMCPY(buf->data, g_frame_times.data(), size);
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_frame_times);
+
+// -------------------------------------------------------------------------------------------------
+// Tracing
+
+// Records a timeline of bound function calls, Lua callbacks, app_update ticks, garbage collector
+// steps and worker jobs on every thread (see REF_TraceStart in bind.h). Scripts mark their own
+// zones with trace_begin/trace_end, which must pair up on the main thread. The dump is Chrome trace
+// event JSON for chrome://tracing or https://ui.perfetto.dev, written to an OS path.
+//
+//     trace_start([events_per_thread])
+//     trace_begin("ai")
+//     trace_end()
+//     trace_stop()
+//     ok = trace_dump("trace.json")
+
+int wrap_trace_start(lua_State* L)
+{
+	int events_per_thread = (int)luaL_optinteger(L, 1, 1 << 16);
+	lua_settop(L, 0);
+	REF_TraceThreadName("Main");
+	REF_TraceStart(events_per_thread);
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_trace_start);
+
+// Zone markers are bound manually, so they don't show up as traced calls themselves.
+int wrap_trace_begin(lua_State* L)
+{
+	const char* name = luaL_checkstring(L, 1);
+	if (REF_Tracing()) REF_TraceBegin(sintern(name));
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_trace_begin);
+
+int wrap_trace_end(lua_State* L)
+{
+	REF_TraceEnd();
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_trace_end);
+
+bool trace_is_active() { return REF_Tracing(); }
+REF_FUNCTION_EX(trace_stop, REF_TraceStop);
+REF_FUNCTION(trace_is_active);
+REF_FUNCTION_EX(trace_dump, REF_TraceDump);
+
 // -------------------------------------------------------------------------------------------------
 // Noise
 
 REF_HANDLE_TYPE(CF_Noise);
 
+REF_WORKER_SAFE_BEGIN();
 REF_FUNCTION(make_noise);
 REF_FUNCTION(make_noise_fbm);
 REF_FUNCTION(destroy_noise);
 REF_FUNCTION_EX(noise2, cf_noise2);
 REF_FUNCTION_EX(noise3, cf_noise3);
 REF_FUNCTION_EX(noise4, cf_noise4);
+REF_WORKER_SAFE_END();
+
+// Checks the w, h arguments at `index` and `index + 1` of a grid with `elem_size` bytes per cell.
+// A texture at `dst` must have been made by make_texture at exactly w by h, and a buffer at `dst`
+// is sized for the grid. Pass 0 for `dst` when there isn't one.
+static void noise_check_grid(lua_State* L, int index, int elem_size, int dst, int* w, int* h)
+{
+	lua_Integer gw = luaL_checkinteger(L, index);
+	lua_Integer gh = luaL_checkinteger(L, index + 1);
+	luaL_argcheck(L, gw > 0 && gw <= INT_MAX / elem_size, index, "width out of range");
+	luaL_argcheck(L, gh > 0 && gh <= INT_MAX / elem_size / gw, index + 1, "height out of range");
+	*w = (int)gw;
+	*h = (int)gh;
+	if (!dst) return;
+	if (REF_Buffer* buf = REF_LuaToBuffer(L, dst)) {
+		if (!REF_BufferResize(buf, *w * *h * elem_size)) luaL_error(L, "Unable to allocate a %dx%d noise buffer.", *w, *h);
+	} else if (!g_headless) {
+		CF_Texture tex;
+		REF_LuaGet(L, dst, &tex);
+		CF_TextureParams* params = g_texture_params.try_find(tex.id);
+		luaL_argcheck(L, params && params->width == *w && params->height == *h, dst, "texture size doesn't match w and h");
+	}
+}
 
-int wrap_noise_pixels(lua_State* L)
+// Noise pixels are returned as a table of ints, or written straight into `dst` (a buffer or a
+// texture) by the `_into` variants, which skips building a Lua table entirely. For example:
+// 
+//     noise_pixels_into(tex, w, h, seed, scale)
+static int noise_pixels_return(lua_State* L, CF_Pixel* pixels, int w, int h, bool into)
 {
-	int w = (int)lua_tointeger(L, -4);
-	int h = (int)lua_tointeger(L, -3);
+	if (into) {
+		if (REF_Buffer* buf = REF_LuaToBuffer(L, -1)) {
+			CF_MEMCPY(buf->data, pixels, buf->size);
+		} else if (!g_headless) {
+			// Textures aren't available headless, like with the functions in REF_HEADLESS_NOOP_BEGIN.
+			CF_Texture tex;
+			REF_LuaGet(L, -1, &tex);
+			texture_update(tex, pixels, w * h * (int)sizeof(CF_Pixel));
+		}
+		lua_pop(L, 1);
+	} else {
+		lua_newtable(L);
+		REF_LuaSetArray(L, (int*)pixels, w * h);
+	}
+	cf_free(pixels);
+	return into ? 0 : 1;
+}
+
+static int noise_pixels_impl(lua_State* L, bool into)
+{
+	int w, h;
+	int top = lua_gettop(L);
+	noise_check_grid(L, top - 3, (int)sizeof(CF_Pixel), into ? top - 4 : 0, &w, &h);
 	uint64_t seed = lua_tointeger(L, -2);
 	float scale = (float)lua_tonumber(L, -1);
 	lua_pop(L, 4);
 	CF_Pixel* pixels = noise_pixels(w, h, seed, scale);
-	int* pix = (int*)pixels;
-	lua_newtable(L);
-	REF_LuaSetArray(L, pix, w * h);
-	cf_free(pix);
-	return 1;
+	return noise_pixels_return(L, pixels, w, h, into);
 }
+int wrap_noise_pixels(lua_State* L) { return noise_pixels_impl(L, false); }
+int wrap_noise_pixels_into(lua_State* L) { return noise_pixels_impl(L, true); }
 REF_WRAP_MANUAL(wrap_noise_pixels);
+REF_WRAP_MANUAL(wrap_noise_pixels_into);
 
-int wrap_noise_pixels_wrapped(lua_State* L)
+static int noise_pixels_wrapped_impl(lua_State* L, bool into)
 {
-	int w = (int)lua_tointeger(L, -6);
-	int h = (int)lua_tointeger(L, -5);
+	int w, h;
+	int top = lua_gettop(L);
+	noise_check_grid(L, top - 5, (int)sizeof(CF_Pixel), into ? top - 6 : 0, &w, &h);
 	uint64_t seed = lua_tointeger(L, -4);
 	float scale = (float)lua_tonumber(L, -3);
 	float time = (float)lua_tonumber(L, -2);
 	float amplitude = (float)lua_tonumber(L, -1);
 	lua_pop(L, 6);
 	CF_Pixel* pixels = noise_pixels_wrapped(w, h, seed, scale, time, amplitude);
-	int* pix = (int*)pixels;
-	lua_newtable(L);
-	REF_LuaSetArray(L, pix, w * h);
-	cf_free(pix);
-	return 1;
+	return noise_pixels_return(L, pixels, w, h, into);
 }
+int wrap_noise_pixels_wrapped(lua_State* L) { return noise_pixels_wrapped_impl(L, false); }
+int wrap_noise_pixels_wrapped_into(lua_State* L) { return noise_pixels_wrapped_impl(L, true); }
 REF_WRAP_MANUAL(wrap_noise_pixels_wrapped);
+REF_WRAP_MANUAL(wrap_noise_pixels_wrapped_into);
 
-int wrap_noise_fbm_pixels(lua_State* L)
+static int noise_fbm_pixels_impl(lua_State* L, bool into)
 {
-	int w = (int)lua_tointeger(L, -7);
-	int h = (int)lua_tointeger(L, -6);
+	int w, h;
+	int top = lua_gettop(L);
+	noise_check_grid(L, top - 6, (int)sizeof(CF_Pixel), into ? top - 7 : 0, &w, &h);
 	uint64_t seed = lua_tointeger(L, -5);
 	float scale = (float)lua_tonumber(L, -4);
 	float lacunarity = (float)lua_tonumber(L, -3);
@@ -962,18 +3021,18 @@ int wrap_noise_fbm_pixels(lua_State* L)
 	float falloff = (float)lua_tonumber(L, -1);
 	lua_pop(L, 7);
 	CF_Pixel* pixels = noise_fbm_pixels(w, h, seed, scale, lacunarity, octaves, falloff);
-	int* pix = (int*)pixels;
-	lua_newtable(L);
-	REF_LuaSetArray(L, pix, w * h);
-	cf_free(pix);
-	return 1;
+	return noise_pixels_return(L, pixels, w, h, into);
 }
+int wrap_noise_fbm_pixels(lua_State* L) { return noise_fbm_pixels_impl(L, false); }
+int wrap_noise_fbm_pixels_into(lua_State* L) { return noise_fbm_pixels_impl(L, true); }
 REF_WRAP_MANUAL(wrap_noise_fbm_pixels);
+REF_WRAP_MANUAL(wrap_noise_fbm_pixels_into);
 
-int wrap_noise_fbm_pixels_wrapped(lua_State* L)
+static int noise_fbm_pixels_wrapped_impl(lua_State* L, bool into)
 {
-	int w = (int)lua_tointeger(L, -9);
-	int h = (int)lua_tointeger(L, -8);
+	int w, h;
+	int top = lua_gettop(L);
+	noise_check_grid(L, top - 8, (int)sizeof(CF_Pixel), into ? top - 9 : 0, &w, &h);
 	uint64_t seed = lua_tointeger(L, -7);
 	float scale = (float)lua_tonumber(L, -6);
 	float lacunarity = (float)lua_tonumber(L, -5);
@@ -983,17 +3042,104 @@ int wrap_noise_fbm_pixels_wrapped(lua_State* L)
 	float time_amplitude = (float)lua_tonumber(L, -1);
 	lua_pop(L, 9);
 	CF_Pixel* pixels = noise_fbm_pixels_wrapped(w, h, seed, scale, lacunarity, octaves, falloff, time, time_amplitude);
-	int* pix = (int*)pixels;
-	lua_newtable(L);
-	REF_LuaSetArray(L, pix, w * h);
-	cf_free(pix);
-	return 1;
+	return noise_pixels_return(L, pixels, w, h, into);
 }
+int wrap_noise_fbm_pixels_wrapped(lua_State* L) { return noise_fbm_pixels_wrapped_impl(L, false); }
+int wrap_noise_fbm_pixels_wrapped_into(lua_State* L) { return noise_fbm_pixels_wrapped_impl(L, true); }
 REF_WRAP_MANUAL(wrap_noise_fbm_pixels_wrapped);
+REF_WRAP_MANUAL(wrap_noise_fbm_pixels_wrapped_into);
+
+// noise_fill(noise, dst, w, h, scale [, time])
+// Samples `noise` over a w*h grid, at `scale` units per pixel. Writes floats into a buffer, or
+// grayscale pixels into a w by h texture from `make_texture` (skipped when headless). Passing
+// `time` samples a 3D slice instead. Rows are split across worker threads. Works for any noise,
+// including from `make_noise_fbm`.
+int wrap_noise_fill(lua_State* L)
+{
+	CF_Noise noise;
+	REF_LuaGet(L, 1, &noise);
+	bool is_buffer = REF_LuaToBuffer(L, 2) != NULL;
+	int w, h;
+	noise_check_grid(L, 3, is_buffer ? (int)sizeof(float) : (int)sizeof(CF_Pixel), 2, &w, &h);
+	float scale = (float)lua_tonumber(L, 5);
+	bool has_time = lua_gettop(L) >= 6;
+	float time = (float)lua_tonumber(L, 6);
+	auto sample = [=](int x, int y) {
+		return has_time ? cf_noise3(noise, x * scale, y * scale, time) : cf_noise2(noise, x * scale, y * scale);
+	};
+
+	if (is_buffer) {
+		float* out = (float*)REF_LuaToBuffer(L, 2)->data;
+		parallel_for(h, [=](int begin, int end) {
+			for (int y = begin; y < end; ++y) {
+				for (int x = 0; x < w; ++x) {
+					out[y * w + x] = sample(x, y);
+				}
+			}
+		});
+	} else if (!g_headless) {
+		CF_Texture tex;
+		REF_LuaGet(L, 2, &tex);
+		CF_Pixel* pixels = (CF_Pixel*)cf_alloc(sizeof(CF_Pixel) * w * h);
+		parallel_for(h, [=](int begin, int end) {
+			for (int y = begin; y < end; ++y) {
+				for (int x = 0; x < w; ++x) {
+					float v = sample(x, y) * 0.5f + 0.5f;
+					uint8_t c = (uint8_t)((v < 0 ? 0 : (v > 1 ? 1 : v)) * 255.0f);
+					CF_Pixel p;
+					p.colors.r = p.colors.g = p.colors.b = c;
+					p.colors.a = 255;
+					pixels[y * w + x] = p;
+				}
+			}
+		});
+		texture_update(tex, pixels, w * h * (int)sizeof(CF_Pixel));
+		cf_free(pixels);
+	}
+	lua_settop(L, 0);
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_noise_fill);
+
+// noise2_many(noise, coords [, out]), also noise3_many and noise4_many.
+// Samples noise at every point in a packed run of coordinates (buffer, packed string or flat
+// table), and returns a buffer with one float per point. Pass in `out` to reuse a buffer.
+template <int N>
+int noise_many(lua_State* L)
+{
+	CF_Noise noise;
+	REF_LuaGet(L, 1, &noise);
+	Array<float> scratch;
+	int count = 0;
+	const float* coords = REF_LuaGetFloats(L, 2, &count, &scratch);
+	int n = count / N;
+	REF_Buffer* out = REF_LuaToBuffer(L, 3);
+	if (!out) out = REF_LuaPushBuffer(L, 0);
+	else lua_pushvalue(L, 3);
+	REF_BufferResize(out, n * (int)sizeof(float));
+	float* v = (float*)out->data;
+	parallel_for(n, [=](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			const float* p = coords + i * N;
+			if constexpr (N == 2) v[i] = cf_noise2(noise, p[0], p[1]);
+			else if constexpr (N == 3) v[i] = cf_noise3(noise, p[0], p[1], p[2]);
+			else v[i] = cf_noise4(noise, p[0], p[1], p[2], p[3]);
+		}
+	});
+	return 1;
+}
+int wrap_noise2_many(lua_State* L) { return noise_many<2>(L); }
+int wrap_noise3_many(lua_State* L) { return noise_many<3>(L); }
+int wrap_noise4_many(lua_State* L) { return noise_many<4>(L); }
+REF_WRAP_MANUAL(wrap_noise2_many);
+REF_WRAP_MANUAL(wrap_noise3_many);
+REF_WRAP_MANUAL(wrap_noise4_many);
 
 // -------------------------------------------------------------------------------------------------
 // Rnd
 
+REF_WORKER_SAFE_BEGIN();
+
 int wrap_rnd_seed(lua_State* L)
 {
 	uint64_t seed = lua_tointeger(L, -1);
@@ -1044,6 +3190,175 @@ int wrap_rnd_range_float(lua_State* L)
 }
 REF_WRAP_MANUAL(wrap_rnd_range_float);
 
+// Bulk fills draw `count` values from one rnd state into a packed buffer, costing a single call.
+// Each takes an optional output buffer as the last parameter to reuse, and returns the buffer.
+// Results are identical to drawing the same values one at a time.
+//
+//     ints = rnd_fill_int(rnd, count, lo, hi [, out])             -- i32, lo/hi inclusive.
+//     floats = rnd_fill_float(rnd, count, lo, hi [, out])         -- f32
+//     floats = rnd_fill_normal(rnd, count, mean, stddev [, out])  -- f32
+//     points = rnd_fill_circle(rnd, count, x, y, radius [, out])  -- f32 x,y pairs, uniform over the area.
+//     points = rnd_fill_box(rnd, count, minx, miny, maxx, maxy [, out])
+//     perm = rnd_permutation(rnd, count [, out])                  -- i32, 1 to count shuffled.
+
+// Checks the count in parameter 2 and sizes the output buffer for that many `elem_size` byte values.
+static void* rnd_fill_output(lua_State* L, int index, int elem_size, int* count)
+{
+	lua_Integer n = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, n >= 0 && n <= INT_MAX / elem_size, 2, "count out of range");
+	REF_Buffer* out = REF_LuaToBuffer(L, index);
+	if (out) lua_pushvalue(L, index);
+	else out = REF_LuaPushBuffer(L, 0);
+	if (!REF_BufferResize(out, (int)n * elem_size)) luaL_error(L, "Unable to allocate a buffer for %d values.", (int)n);
+	*count = (int)n;
+	return out->data;
+}
+
+int wrap_rnd_fill_int(lua_State* L)
+{
+	CF_RndState* s = (CF_RndState*)lua_touserdata(L, 1);
+	int64_t lo = luaL_checkinteger(L, 3);
+	int64_t hi = luaL_checkinteger(L, 4);
+	luaL_argcheck(L, lo <= hi, 4, "hi must be >= lo");
+	int count;
+	int32_t* v = (int32_t*)rnd_fill_output(L, 5, (int)sizeof(int32_t), &count);
+	for (int i = 0; i < count; ++i) {
+		v[i] = (int32_t)(lo + (int64_t)cf_rnd_range_uint64(s, 0, (uint64_t)(hi - lo)));
+	}
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_rnd_fill_int);
+
+int wrap_rnd_fill_float(lua_State* L)
+{
+	CF_RndState* s = (CF_RndState*)lua_touserdata(L, 1);
+	double lo = luaL_checknumber(L, 3);
+	double hi = luaL_checknumber(L, 4);
+	int count;
+	float* v = (float*)rnd_fill_output(L, 5, (int)sizeof(float), &count);
+	for (int i = 0; i < count; ++i) {
+		v[i] = (float)(lo + (hi - lo) * rnd_double(s));
+	}
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_rnd_fill_float);
+
+// Box-Muller, each pair of uniforms makes two normals.
+int wrap_rnd_fill_normal(lua_State* L)
+{
+	CF_RndState* s = (CF_RndState*)lua_touserdata(L, 1);
+	double mean = luaL_checknumber(L, 3);
+	double stddev = luaL_checknumber(L, 4);
+	int count;
+	float* v = (float*)rnd_fill_output(L, 5, (int)sizeof(float), &count);
+	for (int i = 0; i < count; i += 2) {
+		double u = 1.0 - rnd_double(s); // (0, 1], keeps log away from zero.
+		double r = stddev * sqrt(-2.0 * log(u));
+		double theta = 2.0 * CF_PI * rnd_double(s);
+		v[i] = (float)(mean + r * cos(theta));
+		if (i + 1 < count) v[i + 1] = (float)(mean + r * sin(theta));
+	}
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_rnd_fill_normal);
+
+int wrap_rnd_fill_circle(lua_State* L)
+{
+	CF_RndState* s = (CF_RndState*)lua_touserdata(L, 1);
+	double x = luaL_checknumber(L, 3);
+	double y = luaL_checknumber(L, 4);
+	double radius = luaL_checknumber(L, 5);
+	int count;
+	float* v = (float*)rnd_fill_output(L, 6, 2 * (int)sizeof(float), &count);
+	for (int i = 0; i < count; ++i) {
+		double r = radius * sqrt(rnd_double(s));
+		double theta = 2.0 * CF_PI * rnd_double(s);
+		v[i * 2 + 0] = (float)(x + r * cos(theta));
+		v[i * 2 + 1] = (float)(y + r * sin(theta));
+	}
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_rnd_fill_circle);
+
+int wrap_rnd_fill_box(lua_State* L)
+{
+	CF_RndState* s = (CF_RndState*)lua_touserdata(L, 1);
+	double minx = luaL_checknumber(L, 3);
+	double miny = luaL_checknumber(L, 4);
+	double maxx = luaL_checknumber(L, 5);
+	double maxy = luaL_checknumber(L, 6);
+	int count;
+	float* v = (float*)rnd_fill_output(L, 7, 2 * (int)sizeof(float), &count);
+	for (int i = 0; i < count; ++i) {
+		v[i * 2 + 0] = (float)(minx + (maxx - minx) * rnd_double(s));
+		v[i * 2 + 1] = (float)(miny + (maxy - miny) * rnd_double(s));
+	}
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_rnd_fill_box);
+
+// Fisher-Yates shuffle of 1..count, 1-based to match Lua indexing.
+int wrap_rnd_permutation(lua_State* L)
+{
+	CF_RndState* s = (CF_RndState*)lua_touserdata(L, 1);
+	int count;
+	int32_t* v = (int32_t*)rnd_fill_output(L, 3, (int)sizeof(int32_t), &count);
+	for (int i = 0; i < count; ++i) v[i] = i + 1;
+	for (int i = count - 1; i > 0; --i) {
+		int j = (int)cf_rnd_range_uint64(s, 0, (uint64_t)i);
+		int32_t t = v[i];
+		v[i] = v[j];
+		v[j] = t;
+	}
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_rnd_permutation);
+
+// Advances the state by 2^64 draws, the standard xorshift128+ jump. Streams made by jumping never
+// overlap in practice, making them safe to hand out to separate systems or worker threads.
+static void rnd_jump_state(CF_RndState* s)
+{
+	static const uint64_t jump[] = { 0x8a5cd789635d2dffULL, 0x121fd2155c472f96ULL };
+	uint64_t s0 = 0, s1 = 0;
+	for (int i = 0; i < 2; ++i) {
+		for (int b = 0; b < 64; ++b) {
+			if (jump[i] & (1ULL << b)) {
+				s0 ^= s->state[0];
+				s1 ^= s->state[1];
+			}
+			rnd(s);
+		}
+	}
+	s->state[0] = s0;
+	s->state[1] = s1;
+}
+
+// rnd_jump(rnd)
+int wrap_rnd_jump(lua_State* L)
+{
+	CF_RndState* s = (CF_RndState*)lua_touserdata(L, 1);
+	rnd_jump_state(s);
+	lua_settop(L, 0);
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_rnd_jump);
+
+// Returns a new state continuing from `rnd`, then jumps `rnd` ahead. Deterministic: splitting the
+// same seed the same way always produces the same streams.
+//
+//     child = rnd_split(rnd)
+int wrap_rnd_split(lua_State* L)
+{
+	CF_RndState* s = (CF_RndState*)lua_touserdata(L, 1);
+	CF_RndState* child = (CF_RndState*)lua_newuserdata(L, sizeof(CF_RndState));
+	*child = *s;
+	rnd_jump_state(s);
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_rnd_split);
+
+REF_WORKER_SAFE_END();
+
 // -------------------------------------------------------------------------------------------------
 // Time
 
@@ -1056,26 +3371,71 @@ REF_GLOBAL_EX(CF_SECONDS, SECONDS);
 REF_GLOBAL_EX(CF_PREV_SECONDS, PREV_SECONDS);
 REF_GLOBAL_EX(CF_PAUSE_TIME_LEFT, PAUSE_TIME_LEFT);
 
-REF_FUNCTION(set_fixed_timestep);
+int g_fixed_timestep_fps = 60;
+void wrap_set_fixed_timestep(int frames_per_second)
+{
+	g_fixed_timestep_fps = frames_per_second;
+	set_fixed_timestep(frames_per_second);
+}
+REF_FUNCTION_EX(set_fixed_timestep, wrap_set_fixed_timestep);
 REF_FUNCTION(set_fixed_timestep_max_updates);
 REF_FUNCTION(set_target_framerate);
 
 String g_update_name_in_lua;
 static void wrap_app_update_fn(void* udata)
 {
+	++g_input_update_count;
 	REF_CallLuaFunction(L, g_update_name_in_lua);
 }
+
+// Headless stand-in for app_update. Every call advances the time globals by exactly one fixed
+// timestep and runs the update once, so simulations step the same way on every run. Sleeps to keep
+// pace with real time, unless started with `--fast`.
+uint64_t g_headless_start_ticks;
+uint64_t g_headless_frame;
+static void headless_app_update(void (*fn)(void*))
+{
+	double dt = 1.0 / (g_fixed_timestep_fps > 0 ? g_fixed_timestep_fps : 60);
+	uint64_t frequency = get_tick_frequency();
+	if (!g_headless_frame) g_headless_start_ticks = get_ticks();
+	++g_headless_frame;
+	CF_PREV_TICKS = CF_TICKS;
+	CF_PREV_SECONDS = CF_SECONDS;
+	CF_TICKS = (uint64_t)((double)g_headless_frame * dt * (double)frequency);
+	CF_SECONDS = (double)g_headless_frame * dt;
+	CF_DELTA_TIME = (float)dt;
+	CF_DELTA_TIME_FIXED = (float)dt;
+	CF_DELTA_TIME_INTERPOLANT = 0;
+	if (CF_PAUSE_TIME_LEFT > 0) {
+		CF_PAUSE_TIME_LEFT -= dt;
+		if (CF_PAUSE_TIME_LEFT < 0) CF_PAUSE_TIME_LEFT = 0;
+	} else if (fn) {
+		fn(NULL);
+	}
+	if (!g_headless_fast) {
+		uint64_t target = g_headless_start_ticks + CF_TICKS;
+		uint64_t now = get_ticks();
+		if (now < target) cf_sleep((int)((target - now) * 1000 / frequency));
+	}
+}
 int wrap_app_update(lua_State* L)
 {
-	// Update with a callback.
+	void (*fn)(void*) = NULL;
 	if (lua_isstring(L, -1)) {
-		const char* fn_name = lua_tostring(L, -1);
+		// Update with a callback.
+		g_update_name_in_lua = lua_tostring(L, -1);
 		lua_pop(L, 1);
-		g_update_name_in_lua = fn_name;
-		app_update(wrap_app_update_fn);
-	} else {
-		app_update(NULL);
+		fn = wrap_app_update_fn;
+	}
+	REF_TraceScope trace("app_update", "App");
+	input_recording_frame_begin();
+	if (!g_input_replaying || !input_replay_app_update(fn)) {
+		if (g_headless) headless_app_update(fn);
+		else app_update(fn);
 	}
+	input_recording_frame_end();
+	input_record_events();
+	audio_dispatch_callbacks();
 	return 0;
 }
 REF_WRAP_MANUAL(wrap_app_update);
@@ -1099,6 +3459,8 @@ REF_FUNCTION(version_string_linked);
 // -------------------------------------------------------------------------------------------------
 // Manually bind certain, difficult to automate, functions.
 
+REF_HEADLESS_NOOP_BEGIN();
+
 CF_MemoryPool* g_sprite_pool;
 int wrap_make_demo_sprite(lua_State* L)
 {
@@ -1155,6 +3517,8 @@ int wrap_make_premade_sprite(lua_State* L)
 }
 REF_WRAP_MANUAL(wrap_make_premade_sprite);
 
+REF_HEADLESS_NOOP_END();
+
 int wrap_get_png_wh(lua_State* L)
 {
 	const char* path = lua_tostring(L, -1);
@@ -1174,11 +3538,579 @@ int wrap_get_png_wh(lua_State* L)
 }
 REF_WRAP_MANUAL(wrap_get_png_wh);
 
+// -------------------------------------------------------------------------------------------------
+// Async asset loading.
+
+// Loads are split in two halves. File reads and decoding run on a small background threadpool. Any
+// work that touches the GPU or CF's asset caches is finished on the main thread by
+// `asset_load_update`, which stops once its per-frame time budget is spent so big batches stream
+// in over several frames instead of hitching.
+//
+//     handles = load_assets_async({ { ASSET_EASY_SPRITE, "/art/tree.png" }, { ASSET_FONT, "/fonts/big.ttf", "big" } })
+//     function on_asset_loaded(handle, asset) ... end
+//     asset_load_update(2, "on_asset_loaded") -- Once per frame, with a 2ms budget.
+//
+// Aseprite files are read on a worker, but CF only exposes their decode together with sprite
+// creation, so that part runs on the main thread.
+
+enum AssetKind
+{
+	ASSET_SPRITE,
+	ASSET_EASY_SPRITE,
+	ASSET_AUDIO_OGG,
+	ASSET_AUDIO_WAV,
+	ASSET_FONT,
+
+	ASSET_KIND_COUNT
+};
+REF_CONSTANT(ASSET_SPRITE);
+REF_CONSTANT(ASSET_EASY_SPRITE);
+REF_CONSTANT(ASSET_AUDIO_OGG);
+REF_CONSTANT(ASSET_AUDIO_WAV);
+REF_CONSTANT(ASSET_FONT);
+
+enum AssetStatus
+{
+	ASSET_LOADING,
+	ASSET_READY,
+	ASSET_FAILED,
+};
+REF_CONSTANT(ASSET_LOADING);
+REF_CONSTANT(ASSET_READY);
+REF_CONSTANT(ASSET_FAILED);
+
+struct AssetLoad
+{
+	uint64_t id = 0;
+	AssetKind kind = ASSET_SPRITE;
+	String path;
+	String name;
+	CF_AtomicInt decoded = { }; // Set by the worker once it's done touching this load.
+	AssetStatus status = ASSET_LOADING;
+	bool released = false;
+	const char* error = NULL;
+	void* data = NULL;
+	size_t size = 0;
+	CF_Image image = { };
+	CF_Audio audio = { };
+	CF_Sprite* sprite = NULL;
+};
+
+CF_Threadpool* g_asset_pool;
+Map<uint64_t, AssetLoad*> g_asset_loads;
+Array<AssetLoad*> g_asset_pending;
+uint64_t g_asset_next_id = 1;
+
+// Runs on a worker thread.
+static void asset_load_task(void* udata)
+{
+	AssetLoad* load = (AssetLoad*)udata;
+	load->data = fs_read_entire_file_to_memory(load->path.c_str(), &load->size);
+	if (!load->data) {
+		load->error = "Unable to read file.";
+	} else {
+		switch (load->kind) {
+		case ASSET_EASY_SPRITE:
+		{
+			if (is_error(cf_image_load_png_mem(load->data, (int)load->size, &load->image))) load->error = "Unable to decode png.";
+			cf_free(load->data);
+			load->data = NULL;
+		} break;
+
+		case ASSET_AUDIO_OGG:
+		case ASSET_AUDIO_WAV:
+		{
+			load->audio = load->kind == ASSET_AUDIO_OGG ? cf_audio_load_ogg_from_memory(load->data, (int)load->size) : cf_audio_load_wav_from_memory(load->data, (int)load->size);
+			if (!load->audio.id) load->error = "Unable to decode audio.";
+			cf_free(load->data);
+			load->data = NULL;
+		} break;
+
+		default: break; // Finished from the file contents on the main thread.
+		}
+	}
+	cf_atomic_set(&load->decoded, 1);
+}
+
+// Runs on the main thread once the worker is done.
+static void asset_load_finish(AssetLoad* load)
+{
+	if (g_headless && !load->error && load->kind != ASSET_AUDIO_OGG && load->kind != ASSET_AUDIO_WAV) {
+		load->error = "Sprites and fonts are unavailable in headless mode.";
+		if (load->image.pix) cf_image_free(&load->image);
+	}
+	if (!load->error) {
+		switch (load->kind) {
+		case ASSET_SPRITE:
+		case ASSET_EASY_SPRITE:
+		{
+			if (!g_sprite_pool) g_sprite_pool = make_memory_pool(sizeof(CF_Sprite), 1024 * 1024, 8);
+			load->sprite = (CF_Sprite*)memory_pool_alloc(g_sprite_pool);
+			if (load->kind == ASSET_SPRITE) {
+				*load->sprite = cf_make_sprite_from_memory(load->path.c_str(), load->data, (int)load->size);
+			} else {
+				*load->sprite = cf_make_easy_sprite_from_pixels(load->image.pix, load->image.w, load->image.h);
+				cf_image_free(&load->image);
+			}
+		} break;
+
+		case ASSET_FONT:
+		{
+			if (is_error(cf_make_font_from_memory(load->data, (int)load->size, load->name.c_str()))) load->error = "Unable to load font.";
+		} break;
+
+		default: break;
+		}
+	}
+	cf_free(load->data);
+	load->data = NULL;
+	load->status = load->error ? ASSET_FAILED : ASSET_READY;
+}
+
+// Drops a load that was released before it finished, cleaning up whatever the worker produced.
+static void asset_load_discard(AssetLoad* load)
+{
+	cf_free(load->data);
+	if (load->image.pix) cf_image_free(&load->image);
+	if (load->audio.id) cf_audio_destroy(load->audio);
+	delete load;
+}
+
+static uint64_t asset_load_submit(AssetKind kind, const char* path, const char* name)
+{
+	if (!g_asset_pool) g_asset_pool = cf_make_threadpool(2);
+	AssetLoad* load = new AssetLoad;
+	load->id = g_asset_next_id++;
+	load->kind = kind;
+	load->path = path;
+	load->name = name ? name : path;
+	g_asset_loads.add(load->id, load);
+	g_asset_pending.add(load);
+	cf_threadpool_add_task(g_asset_pool, asset_load_task, load);
+	return load->id;
+}
+
+// handle = load_asset_async(kind, path [, font_name])
+int wrap_load_asset_async(lua_State* L)
+{
+	lua_Integer kind = luaL_checkinteger(L, 1);
+	luaL_argcheck(L, kind >= 0 && kind < ASSET_KIND_COUNT, 1, "unknown asset kind");
+	const char* path = luaL_checkstring(L, 2);
+	const char* name = lua_isstring(L, 3) ? lua_tostring(L, 3) : NULL;
+	uint64_t id = asset_load_submit((AssetKind)kind, path, name);
+	cf_threadpool_kick(g_asset_pool);
+	lua_settop(L, 0);
+	lua_pushinteger(L, id);
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_load_asset_async);
+
+// handles = load_assets_async({ { kind, path [, font_name] }, ... })
+int wrap_load_assets_async(lua_State* L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int count = (int)lua_rawlen(L, 1);
+	// Checks every entry before submitting any, so a bad entry doesn't leave earlier ones loading.
+	for (int i = 1; i <= count; ++i) {
+		lua_rawgeti(L, 1, i);
+		if (!lua_istable(L, -1)) return luaL_error(L, "Entry %d of load_assets_async is not a table.", i);
+		lua_rawgeti(L, -1, 1);
+		lua_rawgeti(L, -2, 2);
+		int is_kind = 0;
+		lua_Integer kind = lua_tointegerx(L, -2, &is_kind);
+		if (!is_kind || kind < 0 || kind >= ASSET_KIND_COUNT) return luaL_error(L, "Entry %d of load_assets_async has an unknown asset kind.", i);
+		if (!lua_isstring(L, -1)) return luaL_error(L, "Entry %d of load_assets_async is missing a path.", i);
+		lua_pop(L, 3);
+	}
+	lua_createtable(L, count, 0);
+	for (int i = 1; i <= count; ++i) {
+		lua_rawgeti(L, 1, i);
+		lua_rawgeti(L, -1, 1);
+		lua_rawgeti(L, -2, 2);
+		lua_rawgeti(L, -3, 3);
+		lua_Integer kind = lua_tointeger(L, -3);
+		const char* path = lua_tostring(L, -2);
+		const char* name = lua_isstring(L, -1) ? lua_tostring(L, -1) : NULL;
+		lua_pushinteger(L, asset_load_submit((AssetKind)kind, path, name));
+		lua_rawseti(L, 2, i);
+		lua_pop(L, 4);
+	}
+	if (count) cf_threadpool_kick(g_asset_pool);
+	lua_replace(L, 1);
+	lua_settop(L, 1);
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_load_assets_async);
+
+static int asset_load_push(lua_State* L, AssetLoad* load)
+{
+	if (load->status != ASSET_READY) return 0;
+	switch (load->kind) {
+	case ASSET_SPRITE:
+	case ASSET_EASY_SPRITE: REF_LuaSet(L, &load->sprite); break;
+	case ASSET_AUDIO_OGG:
+	case ASSET_AUDIO_WAV: REF_LuaSet(L, &load->audio); break;
+	case ASSET_FONT: lua_pushstring(L, load->name.c_str()); break;
+	default: return luaL_error(L, "Asset %I has an unknown kind.", (lua_Integer)load->id);
+	}
+	return 1;
+}
+
+// Finishes completed loads on the main thread until `budget_ms` runs out, always finishing at least
+// one if any are ready. The optional callback is called as `callback(handle, asset)` for each load
+// that finished, with a nil asset for failures. Returns the number of loads still pending.
+//
+//     pending = asset_load_update([budget_ms [, callback_name]])
+int wrap_asset_load_update(lua_State* L)
+{
+	double budget_ms = lua_isnoneornil(L, 1) ? 2.0 : lua_tonumber(L, 1);
+	String callback = lua_isstring(L, 2) ? lua_tostring(L, 2) : "";
+	lua_settop(L, 0);
+	uint64_t start = get_ticks();
+	uint64_t budget = (uint64_t)(budget_ms * (double)get_tick_frequency() / 1000.0);
+	for (int i = 0; i < g_asset_pending.count();) {
+		AssetLoad* load = g_asset_pending[i];
+		if (!cf_atomic_get(&load->decoded)) {
+			++i;
+			continue;
+		}
+		g_asset_pending.unordered_remove(i);
+		if (load->released) {
+			asset_load_discard(load);
+			continue;
+		}
+		asset_load_finish(load);
+		if (callback.len()) {
+			switch (load->status == ASSET_READY ? load->kind : (AssetKind)-1) {
+			case ASSET_SPRITE:
+			case ASSET_EASY_SPRITE: REF_CallLuaFunction(L, callback.c_str(), { }, load->id, load->sprite); break;
+			case ASSET_AUDIO_OGG:
+			case ASSET_AUDIO_WAV: REF_CallLuaFunction(L, callback.c_str(), { }, load->id, load->audio); break;
+			case ASSET_FONT: REF_CallLuaFunction(L, callback.c_str(), { }, load->id, load->name.c_str()); break;
+			default: REF_CallLuaFunction(L, callback.c_str(), { }, load->id); break;
+			}
+			lua_settop(L, 0);
+		}
+		if (get_ticks() - start >= budget) break;
+	}
+	lua_pushinteger(L, g_asset_pending.count());
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_asset_load_update);
+
+// status, error = asset_status(handle)
+int wrap_asset_status(lua_State* L)
+{
+	uint64_t id = (uint64_t)lua_tointeger(L, 1);
+	lua_settop(L, 0);
+	AssetLoad** load = g_asset_loads.try_find(id);
+	if (!load) return 0;
+	lua_pushinteger(L, (*load)->status);
+	if ((*load)->error) {
+		lua_pushstring(L, (*load)->error);
+		return 2;
+	}
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_asset_status);
+
+// Returns the loaded asset: a sprite, audio handle, or the font's name. Nil if not ready.
+//
+//     asset = asset_get(handle)
+int wrap_asset_get(lua_State* L)
+{
+	uint64_t id = (uint64_t)lua_tointeger(L, 1);
+	lua_settop(L, 0);
+	AssetLoad** load = g_asset_loads.try_find(id);
+	if (!load) return 0;
+	return asset_load_push(L, *load);
+}
+REF_WRAP_MANUAL(wrap_asset_get);
+
+// Forgets about a handle. Assets that already finished are left alone and owned by the caller, while
+// loads still in flight are thrown away once their worker finishes.
+//
+//     asset_release(handle)
+int wrap_asset_release(lua_State* L)
+{
+	uint64_t id = (uint64_t)lua_tointeger(L, 1);
+	lua_settop(L, 0);
+	AssetLoad** found = g_asset_loads.try_find(id);
+	if (!found) return 0;
+	AssetLoad* load = *found;
+	g_asset_loads.remove(id);
+	if (load->status == ASSET_LOADING) {
+		load->released = true;
+	} else {
+		delete load;
+	}
+	return 0;
+}
+REF_WRAP_MANUAL(wrap_asset_release);
+
+// -------------------------------------------------------------------------------------------------
+// Serialization
+
+// A compact binary encoding for save data. Lua values are encoded by REF_LuaEncode, so tables
+// referenced more than once (or cyclically) come back shared just the same. Any REF_STRUCT type can
+// be encoded by name straight from its members (see REF_Type::encode), which is much smaller than
+// the same data as a keyed table. Everything is appended to a buffer, so many values can be streamed
+// into one buffer and read back in order. Positions are 1-based byte offsets, like string functions.
+//
+//     buf = serialize(state)
+//     serialize_struct("CF_Stat", stat, buf) -- Appends to buf.
+//     state, pos = deserialize(buf)
+//     stat, pos = deserialize_struct("CF_Stat", buf, pos)
+//     handle = fs_write_async("/save.bin", buf)
+
+REF_WORKER_SAFE_BEGIN();
+
+thread_local Array<uint8_t> g_serialize_scratch;
+
+static REF_Buffer* serialize_check_buffer(lua_State* L, int index)
+{
+	return lua_isnoneornil(L, index) ? NULL : (REF_Buffer*)luaL_checkudata(L, index, "REF_Buffer");
+}
+
+// Appends the scratch bytes to `buf`, or a new buffer if NULL, and leaves the buffer on top of the stack.
+static int serialize_push_result(lua_State* L, int buffer_index, REF_Buffer* buf)
+{
+	if (buf) {
+		lua_pushvalue(L, buffer_index);
+	} else {
+		buf = REF_LuaPushBuffer(L, 0);
+	}
+	int at = buf->size;
+	REF_BufferResize(buf, at + g_serialize_scratch.count());
+	CF_MEMCPY(buf->data + at, g_serialize_scratch.data(), g_serialize_scratch.count());
+	return 1;
+}
+
+// Returns the bytes of a buffer or string, starting at the optional 1-based position at `pos_index`.
+static const uint8_t* serialize_check_data(lua_State* L, int index, int pos_index, const uint8_t** end)
+{
+	const uint8_t* data = NULL;
+	size_t size = 0;
+	if (REF_Buffer* buf = REF_LuaToBuffer(L, index)) {
+		data = buf->data;
+		size = buf->size;
+	} else {
+		data = (const uint8_t*)luaL_checklstring(L, index, &size);
+	}
+	lua_Integer pos = luaL_optinteger(L, pos_index, 1);
+	luaL_argcheck(L, pos >= 1 && (size_t)pos <= size + 1, pos_index, "position out of range");
+	*end = data + size;
+	return data + pos - 1;
+}
+
+static const REF_Struct* serialize_check_struct(lua_State* L, int index)
+{
+	const char* name = luaL_checkstring(L, index);
+	for (const REF_Struct* s = REF_Struct::head(); s; s = s->next) {
+		if (!strcmp(s->name(), name)) return s;
+	}
+	luaL_argerror(L, index, lua_pushfstring(L, "%s is not a REF_STRUCT", name));
+	return NULL;
+}
+
+// buf = serialize(value [, buf])
+int wrap_serialize(lua_State* L)
+{
+	luaL_checkany(L, 1);
+	REF_Buffer* buf = serialize_check_buffer(L, 2);
+	lua_settop(L, 2);
+	lua_newtable(L);
+	g_serialize_scratch.clear();
+	REF_LuaEncode(L, 1, 3, &g_serialize_scratch, false, true);
+	return serialize_push_result(L, 2, buf);
+}
+REF_WRAP_MANUAL(wrap_serialize);
+
+// value, next_pos = deserialize(buffer_or_string [, pos])
+int wrap_deserialize(lua_State* L)
+{
+	const uint8_t* end;
+	const uint8_t* start = serialize_check_data(L, 1, 2, &end);
+	const uint8_t* p = start;
+	lua_settop(L, 2);
+	lua_newtable(L);
+	REF_LuaDecode(L, &p, end, 3, false);
+	lua_pushinteger(L, luaL_optinteger(L, 2, 1) + (lua_Integer)(p - start));
+	return 2;
+}
+REF_WRAP_MANUAL(wrap_deserialize);
+
+// buf = serialize_struct(type_name, table [, buf])
+int wrap_serialize_struct(lua_State* L)
+{
+	const REF_Struct* type = serialize_check_struct(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	REF_Buffer* buf = serialize_check_buffer(L, 3);
+	void* v = cf_alloc(type->size());
+	CF_MEMSET(v, 0, type->size());
+	type->lua_get(L, 2, v);
+	g_serialize_scratch.clear();
+	type->encode(&g_serialize_scratch, v);
+	type->cleanup(v);
+	cf_free(v);
+	return serialize_push_result(L, 3, buf);
+}
+REF_WRAP_MANUAL(wrap_serialize_struct);
+
+// table, next_pos = deserialize_struct(type_name, buffer_or_string [, pos])
+int wrap_deserialize_struct(lua_State* L)
+{
+	const REF_Struct* type = serialize_check_struct(L, 1);
+	const uint8_t* end;
+	const uint8_t* start = serialize_check_data(L, 2, 3, &end);
+	const uint8_t* p = start;
+	lua_Integer pos = luaL_optinteger(L, 3, 1);
+	lua_settop(L, 3);
+	void* v = cf_alloc(type->size());
+	CF_MEMSET(v, 0, type->size());
+	bool ok = type->decode(&p, end, v);
+	if (ok) type->lua_set(L, v);
+	type->cleanup(v);
+	cf_free(v);
+	if (!ok) return luaL_error(L, "Serialized %s is truncated or malformed.", type->name());
+	lua_pushinteger(L, pos + (lua_Integer)(p - start));
+	return 2;
+}
+REF_WRAP_MANUAL(wrap_deserialize_struct);
+
+REF_WORKER_SAFE_END();
+
+// Writes happen in order on one background thread, so the frame never waits on the disk. The data is
+// copied when queued, so the buffer can be reused right away. Poll the handle with
+// `fs_write_async_status` until it returns non-nil, which also releases the handle.
+// `fs_write_async_flush` blocks until every queued write is done, and is called before shutdown.
+
+struct AsyncWrite
+{
+	uint64_t id = 0;
+	String path;
+	Array<uint8_t> data;
+	bool done = false;
+	bool failed = false;
+};
+
+CF_Mutex g_write_mutex;
+CF_ConditionVariable g_write_cv;      // Signaled when writes are queued.
+CF_ConditionVariable g_write_done_cv; // Signaled when a write finishes.
+CF_Thread* g_write_thread;
+Array<AsyncWrite*> g_write_queue;
+int g_write_queue_head;
+int g_write_pending; // Queued or in progress.
+Map<uint64_t, AsyncWrite*> g_writes;
+uint64_t g_write_next_id = 1;
+
+static int fs_write_thread(void* udata)
+{
+	REF_TraceThreadName("Async writes");
+	while (true) {
+		cf_mutex_lock(&g_write_mutex);
+		while (g_write_queue_head == g_write_queue.count()) {
+			cf_cv_wait(&g_write_cv, &g_write_mutex);
+		}
+		AsyncWrite* write = g_write_queue[g_write_queue_head++];
+		if (g_write_queue_head == g_write_queue.count()) {
+			g_write_queue.clear();
+			g_write_queue_head = 0;
+		}
+		cf_mutex_unlock(&g_write_mutex);
+
+		CF_File* file = fs_open_file_for_write(write->path.c_str());
+		bool ok = file && fs_write(file, write->data.data(), write->data.count()) == (size_t)write->data.count();
+		if (file && is_error(fs_close(file))) ok = false;
+
+		cf_mutex_lock(&g_write_mutex);
+		write->data = Array<uint8_t>();
+		write->failed = !ok;
+		write->done = true;
+		--g_write_pending;
+		cf_cv_wake_all(&g_write_done_cv);
+		cf_mutex_unlock(&g_write_mutex);
+	}
+}
+
+// handle = fs_write_async(path, buffer_or_string)
+int wrap_fs_write_async(lua_State* L)
+{
+	const char* path = luaL_checkstring(L, 1);
+	const void* data = NULL;
+	size_t size = 0;
+	if (REF_Buffer* buf = REF_LuaToBuffer(L, 2)) {
+		data = buf->data;
+		size = buf->size;
+	} else {
+		data = luaL_checklstring(L, 2, &size);
+	}
+	if (!g_write_thread) {
+		g_write_mutex = cf_make_mutex();
+		g_write_cv = cf_make_cv();
+		g_write_done_cv = cf_make_cv();
+		g_write_thread = cf_thread_create(fs_write_thread, "Async writes", NULL);
+	}
+	AsyncWrite* write = new AsyncWrite;
+	write->id = g_write_next_id++;
+	write->path = path;
+	REF_EncodeBytes(&write->data, data, (int)size);
+	g_writes.add(write->id, write);
+	cf_mutex_lock(&g_write_mutex);
+	g_write_queue.add(write);
+	++g_write_pending;
+	cf_cv_wake_one(&g_write_cv);
+	cf_mutex_unlock(&g_write_mutex);
+	lua_settop(L, 0);
+	lua_pushinteger(L, write->id);
+	return 1;
+}
+REF_WRAP_MANUAL(wrap_fs_write_async);
+
+// Returns nil while the write is pending, otherwise true, or false and an error message.
+//
+//     ok, error = fs_write_async_status(handle)
+int wrap_fs_write_async_status(lua_State* L)
+{
+	uint64_t id = (uint64_t)luaL_checkinteger(L, 1);
+	lua_settop(L, 0);
+	AsyncWrite** found = g_writes.try_find(id);
+	if (!found) return 0;
+	AsyncWrite* write = *found;
+	cf_mutex_lock(&g_write_mutex);
+	bool done = write->done;
+	cf_mutex_unlock(&g_write_mutex);
+	if (!done) return 0;
+	g_writes.remove(id);
+	lua_pushboolean(L, !write->failed);
+	int count = 1;
+	if (write->failed) {
+		lua_pushfstring(L, "Unable to write %s.", write->path.c_str());
+		count = 2;
+	}
+	delete write;
+	return count;
+}
+REF_WRAP_MANUAL(wrap_fs_write_async_status);
+
+void fs_write_async_flush()
+{
+	if (!g_write_thread) return;
+	cf_mutex_lock(&g_write_mutex);
+	while (g_write_pending) {
+		cf_cv_wait(&g_write_done_cv, &g_write_mutex);
+	}
+	cf_mutex_unlock(&g_write_mutex);
+}
+REF_FUNCTION(fs_write_async_flush);
+
 // -------------------------------------------------------------------------------------------------
 // Dear ImGui bindings on an as-needed basis.
 
 #include <imgui.h>
 
+REF_HEADLESS_NOOP_BEGIN();
+
 REF_CONSTANT(ImGuiWindowFlags_None);
 REF_CONSTANT(ImGuiWindowFlags_NoTitleBar);
 REF_CONSTANT(ImGuiWindowFlags_NoResize);
@@ -1396,4 +4328,6 @@ REF_FUNCTION(imgui_set_scroll_here_y);
 float imgui_slider_float(const char* label, float v, float lo, float hi) { ImGui::SliderFloat(label, &v, lo, hi); return v; }
 REF_FUNCTION(imgui_slider_float);
 CF_V2 imgui_slider_float2(const char* label, CF_V2 v, float lo, float hi) { ImGui::SliderFloat2(label, &v.x, lo, hi); return v; }
-REF_FUNCTION(imgui_slider_float2);
\ No newline at end of file
+REF_FUNCTION(imgui_slider_float2);
+
+REF_HEADLESS_NOOP_END();